@@ -9,6 +9,7 @@
 #include "src/idt.h"
 #include "src/gdt.h"
 #include "src/syscall.h"
+#include "src/cpu.h"
 
 // Set the base revision to 2, this is recommended as this is the latest
 // base revision described by the Limine boot protocol specification.
@@ -55,6 +56,15 @@ volatile struct limine_hhdm_request hhdm_request = {
     .revision = 0
 };
 
+// Request the other CPUs, started by smp_init. Without the x2APIC flag
+// their local APICs stay in xAPIC mode.
+__attribute__((used, section(".requests")))
+volatile struct limine_smp_request smp_request = {
+    .id = LIMINE_SMP_REQUEST,
+    .revision = 0,
+    .flags = 0
+};
+
 // Finally, define the start and end markers for the Limine requests.
 // These can also be moved anywhere, to any .c file, as seen fit.
 
@@ -157,6 +167,9 @@ void kmain(void)
     serial_init();
     serial_write("Kernel started.\n", 15);
 
+    // Per-CPU state (GS base) before anything that uses it
+    cpu_local_init(0);
+
     // Initialize Physical Memory Manager
     pmm_init();
 
@@ -0,0 +1,104 @@
+#include "apic.h"
+#include "cpu.h"
+#include "vmm.h"
+#include "serial.h"
+
+#define MSR_APIC_BASE        0x1B
+#define APIC_BASE_X2APIC     (1ULL << 10)
+#define APIC_BASE_ENABLE     (1ULL << 11)
+#define APIC_BASE_ADDR_MASK  0x000FFFFFFFFFF000ULL
+
+#define LAPIC_REG_ID            0x20
+#define LAPIC_REG_TPR           0x80
+#define LAPIC_REG_EOI           0xB0
+#define LAPIC_REG_SVR           0xF0
+#define LAPIC_REG_ICR_LOW       0x300
+#define LAPIC_REG_ICR_HIGH      0x310
+#define LAPIC_REG_LVT_TIMER     0x320
+#define LAPIC_REG_TIMER_INITIAL 0x380
+#define LAPIC_REG_TIMER_CURRENT 0x390
+#define LAPIC_REG_TIMER_DIVIDE  0x3E0
+
+#define LAPIC_SVR_ENABLE      (1 << 8)
+#define LAPIC_ICR_PENDING     (1 << 12)
+#define LAPIC_ICR_ASSERT      (1 << 14)
+#define LAPIC_LVT_MASKED      (1 << 16)
+#define LAPIC_TIMER_PERIODIC  (1 << 17)
+#define LAPIC_TIMER_DIVIDE_16 0x3
+
+volatile uint32_t* lapic_regs = NULL;
+
+static inline uint32_t lapic_read(uint32_t reg) {
+    return lapic_regs[reg / 4];
+}
+
+static inline void lapic_write(uint32_t reg, uint32_t value) {
+    lapic_regs[reg / 4] = value;
+}
+
+bool lapic_init(void) {
+    uint64_t base = read_msr(MSR_APIC_BASE);
+    if (base & APIC_BASE_X2APIC) {
+        serial_write("APIC: x2APIC mode is not supported\n", 35);
+        return false;
+    }
+    if (!(base & APIC_BASE_ENABLE)) {
+        write_msr(MSR_APIC_BASE, base | APIC_BASE_ENABLE);
+    }
+
+    // Registers are MMIO: uncached, and not in the HHDM
+    lapic_regs = vmm_map_physical(base & APIC_BASE_ADDR_MASK, PAGE_SIZE,
+                                  PTE_PRESENT | PTE_WRITABLE | PTE_NX |
+                                  PTE_CACHE_DISABLE | PTE_WRITE_THROUGH);
+    if (!lapic_regs) {
+        serial_write("APIC: Cannot map the local APIC\n", 32);
+        return false;
+    }
+    lapic_init_cpu();
+    serial_write("APIC: Local APIC at 0x", 22);
+    serial_print_hex(base & APIC_BASE_ADDR_MASK);
+    serial_write(", ID 0x", 7);
+    serial_print_hex(lapic_id());
+    serial_write("\n", 1);
+    return true;
+}
+
+void lapic_init_cpu(void) {
+    lapic_write(LAPIC_REG_TPR, 0); // Accept every vector
+    lapic_write(LAPIC_REG_SVR, LAPIC_SVR_ENABLE | LAPIC_SPURIOUS_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+}
+
+uint32_t lapic_id(void) {
+    return lapic_read(LAPIC_REG_ID) >> 24;
+}
+
+void lapic_eoi(void) {
+    lapic_write(LAPIC_REG_EOI, 0);
+}
+
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector) {
+    // One IPI at a time per CPU: wait for the previous one to be accepted
+    while (lapic_read(LAPIC_REG_ICR_LOW) & LAPIC_ICR_PENDING) {
+        asm volatile("pause");
+    }
+    lapic_write(LAPIC_REG_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_REG_ICR_LOW, LAPIC_ICR_ASSERT | vector); // Writing the low half sends it
+}
+
+void lapic_timer_periodic(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_TIMER_PERIODIC | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
+
+void lapic_timer_oneshot(uint32_t count) {
+    lapic_write(LAPIC_REG_TIMER_DIVIDE, LAPIC_TIMER_DIVIDE_16);
+    lapic_write(LAPIC_REG_LVT_TIMER, LAPIC_LVT_MASKED | LAPIC_TIMER_VECTOR);
+    lapic_write(LAPIC_REG_TIMER_INITIAL, count);
+}
+
+uint32_t lapic_timer_remaining(void) {
+    return lapic_read(LAPIC_REG_TIMER_CURRENT);
+}
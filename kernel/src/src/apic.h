@@ -0,0 +1,45 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Local APIC ---
+
+// Each CPU's local APIC, driven through its MMIO registers (xAPIC mode).
+// It provides the per-CPU timer interrupt and sends and receives
+// inter-processor interrupts. The legacy PIC is remapped out of the way
+// and masked (see timer.c).
+
+#define PIC_VECTOR_BASE          32   // Legacy PIC IRQs 0-15, all masked
+#define LAPIC_TIMER_VECTOR       48
+#define IPI_RESCHEDULE_VECTOR    49   // Wakes a halted idle CPU
+#define IPI_TLB_SHOOTDOWN_VECTOR 50   // See smp_tlb_shootdown
+#define LAPIC_SPURIOUS_VECTOR    0xFF // No EOI
+
+// The registers, NULL until lapic_init maps them
+extern volatile uint32_t* lapic_regs;
+
+// Maps the local APIC and enables it on the bootstrap processor. Returns
+// false if there is none usable (x2APIC-only mode).
+bool lapic_init(void);
+
+// Enables the local APIC of the calling CPU
+void lapic_init_cpu(void);
+
+// Local APIC ID of the calling CPU
+uint32_t lapic_id(void);
+
+// Signals the end of the interrupt being handled
+void lapic_eoi(void);
+
+// Sends a fixed interrupt with the given vector to one CPU
+void lapic_send_ipi(uint32_t apic_id, uint8_t vector);
+
+// Starts the timer firing LAPIC_TIMER_VECTOR every `count` ticks of the
+// bus clock divided by 16
+void lapic_timer_periodic(uint32_t count);
+
+// Starts the timer counting down from `count` without interrupting, for
+// calibration; lapic_timer_remaining reads what is left
+void lapic_timer_oneshot(uint32_t count);
+uint32_t lapic_timer_remaining(void);
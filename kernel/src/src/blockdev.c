@@ -0,0 +1,95 @@
+#include "blockdev.h"
+#include "vmm.h"
+#include "slab.h"
+#include "serial.h"
+#include "lib/string.h"
+
+static struct block_device* blockdev_table[BLOCKDEV_MAX];
+
+bool blockdev_register(struct block_device* dev) {
+    if (blockdev_find(dev->name)) {
+        return false;
+    }
+    for (unsigned int i = 0; i < BLOCKDEV_MAX; i++) {
+        if (!blockdev_table[i]) {
+            blockdev_table[i] = dev;
+            return true;
+        }
+    }
+    serial_write("blockdev: Too many block devices\n", 33);
+    return false;
+}
+
+struct block_device* blockdev_find(const char* name) {
+    for (unsigned int i = 0; i < BLOCKDEV_MAX; i++) {
+        if (blockdev_table[i] && strcmp(blockdev_table[i]->name, name) == 0) {
+            return blockdev_table[i];
+        }
+    }
+    return NULL;
+}
+
+static bool blockdev_range_ok(struct block_device* dev, uint64_t sector, uint64_t count) {
+    return sector <= dev->sectors && count <= dev->sectors - sector;
+}
+
+bool blockdev_read(struct block_device* dev, uint64_t sector, uint64_t count, void* buf) {
+    if (!blockdev_range_ok(dev, sector, count) || !dev->read(dev, sector, count, buf)) {
+        return false;
+    }
+    dev->reads += count;
+    return true;
+}
+
+bool blockdev_write(struct block_device* dev, uint64_t sector, uint64_t count, const void* buf) {
+    if (!blockdev_range_ok(dev, sector, count) || !dev->write(dev, sector, count, buf)) {
+        return false;
+    }
+    dev->writes += count;
+    return true;
+}
+
+void blockdev_discard(struct block_device* dev, uint64_t sector, uint64_t count) {
+    if (dev->discard && blockdev_range_ok(dev, sector, count)) {
+        dev->discard(dev, sector, count);
+    }
+}
+
+// --- RAM disk ---
+
+// The disk is one kernel buffer; a transfer is a memcpy
+
+static bool ramdisk_read(struct block_device* dev, uint64_t sector, uint64_t count, void* buf) {
+    memcpy(buf, (uint8_t*)dev->priv + sector * BLOCK_SECTOR_SIZE, count * BLOCK_SECTOR_SIZE);
+    return true;
+}
+
+static bool ramdisk_write(struct block_device* dev, uint64_t sector, uint64_t count, const void* buf) {
+    memcpy((uint8_t*)dev->priv + sector * BLOCK_SECTOR_SIZE, buf, count * BLOCK_SECTOR_SIZE);
+    return true;
+}
+
+struct block_device* ramdisk_create(const char* name, uint64_t size) {
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    if (size == 0 || blockdev_find(name)) {
+        return NULL;
+    }
+    struct block_device* dev = kzalloc(sizeof(*dev));
+    if (!dev) {
+        return NULL;
+    }
+    dev->priv = vmm_alloc_kernel_buffer(size, MEMSTAT_KERNEL);
+    if (!dev->priv) {
+        kfree(dev);
+        return NULL;
+    }
+    strncpy(dev->name, name, BLOCKDEV_NAME_LEN - 1);
+    dev->sectors = size / BLOCK_SECTOR_SIZE;
+    dev->read = ramdisk_read;
+    dev->write = ramdisk_write;
+    if (!blockdev_register(dev)) {
+        kfree(dev); // The buffer stays in the kernel window; window space is never reused
+        return NULL;
+    }
+    return dev;
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// --- Block devices ---
+
+// A block device transfers whole sectors. Drivers fill in a struct
+// block_device and register it by name; users look it up with
+// blockdev_find. Transfers are synchronous.
+
+#define BLOCK_SECTOR_SIZE 512
+#define BLOCKDEV_MAX 8
+#define BLOCKDEV_NAME_LEN 16
+
+struct block_device {
+    char name[BLOCKDEV_NAME_LEN];
+    uint64_t sectors;  // Capacity in BLOCK_SECTOR_SIZE sectors
+    // Return false on an I/O error or a range past the end of the device
+    bool (*read)(struct block_device* dev, uint64_t sector, uint64_t count, void* buf);
+    bool (*write)(struct block_device* dev, uint64_t sector, uint64_t count, const void* buf);
+    // Optional: the sectors no longer hold data the user cares about
+    void (*discard)(struct block_device* dev, uint64_t sector, uint64_t count);
+    void* priv;        // Driver data
+    uint64_t reads;    // Sectors read
+    uint64_t writes;   // Sectors written
+};
+
+// Adds a device to the registry. Returns false if the name is taken or the
+// registry is full. The device must stay allocated.
+bool blockdev_register(struct block_device* dev);
+struct block_device* blockdev_find(const char* name);
+
+// Counted transfers; use these rather than the driver callbacks directly
+bool blockdev_read(struct block_device* dev, uint64_t sector, uint64_t count, void* buf);
+bool blockdev_write(struct block_device* dev, uint64_t sector, uint64_t count, const void* buf);
+// Tells the driver a range is unused so it can drop its backing memory;
+// a no-op for drivers without a discard callback
+void blockdev_discard(struct block_device* dev, uint64_t sector, uint64_t count);
+
+// Creates and registers a RAM disk of `size` bytes (rounded up to a page).
+// Returns NULL if out of memory or the name is taken.
+struct block_device* ramdisk_create(const char* name, uint64_t size);
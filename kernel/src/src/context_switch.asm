@@ -0,0 +1,46 @@
+[bits 64]
+
+section .text
+global context_switch
+
+; void context_switch(uint64_t* save_rsp, uint64_t load_rsp);
+; Saves the callee-saved registers on the current stack, stores RSP to
+; *save_rsp, then loads load_rsp and resumes whatever was saved there: a
+; previous context_switch call, or the frame sched.c builds for a new
+; process or idle task (which "returns" into an entry point below).
+; Interrupts must be off.
+context_switch:
+    push rbp
+    push rbx
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbx
+    pop rbp
+    ret
+
+; Where context_switch "returns" to in a new process: finish the switch in
+; C, then enter user mode through the syscall frame at the top of the stack
+global sched_process_entry
+extern sched_process_start
+extern syscall_return
+sched_process_entry:
+    call sched_process_start
+    jmp syscall_return
+
+; Same for CPU 0's idle task, which never returns
+global sched_idle_entry
+extern sched_idle_start
+sched_idle_entry:
+    call sched_idle_start
+    ud2
+
+section .note.GNU-stack noalloc noexec nowrite progbits
@@ -2,8 +2,42 @@
 #include "syscall.h"
 #include "serial.h"
 
-// External function from syscall_entry.asm
-extern void syscall_asm_entry(void);
+// From syscall_entry.asm
+extern void syscall_entry(void);
+
+bool cpu_smap_enabled = false;
+
+static struct cpu_local cpu_locals[MAX_CPUS];
+
+void cpu_local_init(unsigned int cpu) {
+    struct cpu_local* local = &cpu_locals[cpu];
+    local->self = local;
+    local->id = cpu;
+    write_msr(MSR_GS_BASE, (uint64_t)local);
+    write_msr(MSR_KERNEL_GS_BASE, 0); // User mode starts out with GS base 0
+}
+
+// With SMEP the kernel faults if it executes a user page; with SMAP it also
+// faults on user data accessed outside uaccess_begin/uaccess_end
+static void cpu_enable_smep_smap(void) {
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) {
+        return;
+    }
+    cpu_cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    uint64_t cr4 = cpu_read_cr4();
+    if (ebx & CPUID_7_EBX_SMEP) {
+        cr4 |= CR4_SMEP;
+        serial_write("CPU: SMEP enabled\n", 18);
+    }
+    if (ebx & CPUID_7_EBX_SMAP) {
+        cr4 |= CR4_SMAP;
+        serial_write("CPU: SMAP enabled\n", 18);
+    }
+    cpu_write_cr4(cr4);
+    cpu_smap_enabled = (cr4 & CR4_SMAP) != 0;
+}
 
 // Setup CPU for syscalls
 void cpu_init(void) {
@@ -11,6 +45,8 @@ void cpu_init(void) {
     uint64_t efer = read_msr(MSR_EFER);
     efer |= EFER_SCE;
     write_msr(MSR_EFER, efer);
+
+    cpu_enable_smep_smap();
     
     // Setup STAR MSR (segments for syscall/sysret)
     // Format: [63:48] = user code selector (0x18), [47:32] = kernel code selector (0x08)
@@ -19,7 +55,7 @@ void cpu_init(void) {
     write_msr(MSR_STAR, star);
     
     // Setup LSTAR MSR (syscall entry point)
-    write_msr(MSR_LSTAR, (uint64_t)syscall_asm_entry);
+    write_msr(MSR_LSTAR, (uint64_t)syscall_entry);
     
     // Setup FMASK MSR (flags mask for syscall)
     // Disable interrupts during syscall by masking IF flag (bit 9)
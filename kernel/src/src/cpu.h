@@ -1,16 +1,110 @@
 #pragma once
 
 #include <stdint.h>
+#include <stdbool.h>
 
 // MSR registers for syscall/sysret
 #define MSR_EFER       0xC0000080
 #define MSR_STAR       0xC0000081
 #define MSR_LSTAR      0xC0000082
 #define MSR_FMASK      0xC0000084
+#define MSR_GS_BASE    0xC0000101
+#define MSR_KERNEL_GS_BASE 0xC0000102  // Swapped with MSR_GS_BASE by swapgs
 
 // EFER flags
 #define EFER_SCE       (1 << 0)    // Syscall Enable
 
+// CR4 bits
+#define CR4_PGE        (1 << 7)    // Global pages
+#define CR4_PCIDE      (1 << 17)   // Process-context identifiers
+#define CR4_SMEP       (1 << 20)   // Supervisor-mode execution prevention
+#define CR4_SMAP       (1 << 21)   // Supervisor-mode access prevention
+
+// CPUID leaf 7 EBX feature bits
+#define CPUID_7_EBX_SMEP (1u << 7)
+#define CPUID_7_EBX_SMAP (1u << 20)
+
+// RFLAGS bits
+#define RFLAGS_IF      (1 << 9)    // Interrupt Enable
+
+// Upper bound on CPUs the kernel keeps per-CPU state for
+#define MAX_CPUS       16
+
+struct process;
+
+// Each CPU's own data, reached through the GS base. In the kernel GS points
+// at the running CPU's block; in user mode it holds the user's GS base, and
+// swapgs on every entry and exit (syscall_entry.asm, isr_stubs.asm)
+// switches the two. The entry code uses the offsets of kernel_rsp and
+// user_rsp: keep them in sync.
+struct cpu_local {
+    struct cpu_local* self;     // For getting at the block's address
+    uint64_t kernel_rsp;        // Top of the running process's kernel stack
+    uint64_t user_rsp;          // Scratch: user RSP during syscall entry
+    struct process* current;    // Process running on this CPU
+    unsigned int id;            // See cpu_current_id
+};
+
+// Points GS at CPU `cpu`'s block. The first thing each CPU does, as
+// everything per-CPU depends on it.
+void cpu_local_init(unsigned int cpu);
+
+// The block of the CPU executing this code. Not cached by the compiler: a
+// process can be switched out on one CPU and resumed on another.
+static inline struct cpu_local* cpu_local(void) {
+    struct cpu_local* local;
+    asm volatile("mov %%gs:%c1, %0" : "=r"(local) : "i"(__builtin_offsetof(struct cpu_local, self)));
+    return local;
+}
+
+// Index of the CPU executing this code, used to pick per-CPU state: 0 is
+// the bootstrap processor, the others follow in the order smp_init started
+// them
+static inline unsigned int cpu_current_id(void) {
+    unsigned int id;
+    asm volatile("movl %%gs:%c1, %0" : "=r"(id) : "i"(__builtin_offsetof(struct cpu_local, id)));
+    return id;
+}
+
+// Disables interrupts and returns the previous RFLAGS for cpu_irq_restore
+static inline uint64_t cpu_irq_save(void) {
+    uint64_t flags;
+    asm volatile("pushfq; pop %0; cli" : "=r"(flags) : : "memory");
+    return flags;
+}
+
+// Re-enables interrupts if they were enabled when cpu_irq_save was called
+static inline void cpu_irq_restore(uint64_t flags) {
+    if (flags & RFLAGS_IF) {
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+// Executes CPUID for the given leaf/subleaf
+static inline void cpu_cpuid(uint32_t leaf, uint32_t subleaf,
+                             uint32_t *eax, uint32_t *ebx, uint32_t *ecx, uint32_t *edx) {
+    asm volatile("cpuid"
+                 : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx)
+                 : "a"(leaf), "c"(subleaf));
+}
+
+// Reads the time-stamp counter
+static inline uint64_t cpu_rdtsc(void) {
+    uint32_t low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((uint64_t)high << 32) | low;
+}
+
+static inline uint64_t cpu_read_cr4(void) {
+    uint64_t cr4;
+    asm volatile("mov %%cr4, %0" : "=r"(cr4));
+    return cr4;
+}
+
+static inline void cpu_write_cr4(uint64_t cr4) {
+    asm volatile("mov %0, %%cr4" : : "r"(cr4) : "memory");
+}
+
 // Function to read MSR
 static inline uint64_t read_msr(uint32_t msr) {
     uint32_t low, high;
@@ -25,5 +119,8 @@ static inline void write_msr(uint32_t msr, uint64_t value) {
     asm volatile("wrmsr" : : "c"(msr), "a"(low), "d"(high));
 }
 
+// Set by cpu_init when CR4.SMAP is on (see uaccess.h)
+extern bool cpu_smap_enabled;
+
 // Setup CPU features
 void cpu_init(void);
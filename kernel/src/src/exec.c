@@ -1,7 +1,10 @@
 #include "exec.h"
 #include "lib/string.h"
-#include "usermode_entry.h" // For jmp_usermode
+#include "sched.h"          // For sched_spawn
+#include "syscall.h"        // For struct syscall_frame
 #include "vmm.h"          
+#include "pagecache.h"
+#include "slab.h"
 // #include "pmm.h" // REMOVED - Prototypes are in vmm.h
 // #include "filesystem.h" // For getFile and struct limine_file
 #include "serial.h"
@@ -35,7 +38,55 @@
 #define EXEC_MAPPING_ERROR 4
 #define EXEC_JUMP_FAILED 5
 
-void exec_elf(const char *filename) {
+// Frames that were still allocated after a process was torn down. Anything
+// other than 0 means a page or page table escaped vmm_destroy_address_space.
+static uint64_t exec_leaked_frames = 0;
+
+uint64_t exec_get_leaked_frames(void) {
+    return exec_leaked_frames;
+}
+
+// Allocated frames not owned by the page cache, the kernel heap or process
+// kernel stacks (an exited process keeps its stack until it is reaped),
+// which legitimately keep text pages and file data after the process is gone
+static uint64_t exec_used_frames(void) {
+    struct pagecache_stats cache;
+    pagecache_get_stats(&cache);
+    uint64_t stacks = 0;
+    struct process p;
+    for (unsigned int i = 1; sched_get_process(i, &p); i++) {
+        if (p.kernel_stack) {
+            stacks++;
+        }
+    }
+    return pmm_get_used_frames() - cache.pages - kmem_get_used_frames() -
+           (stacks << PROC_KERNEL_STACK_ORDER);
+}
+
+// Compares the allocated frame count with the one from before the process
+// was created and records the difference as leaked
+static void exec_check_leaks(uint64_t frames_before) {
+    uint64_t frames_after = exec_used_frames();
+    if (frames_after > frames_before) {
+        exec_leaked_frames += frames_after - frames_before;
+        serial_write("[EXEC] Warning: leaked frames: 0x", 33);
+        serial_print_hex(frames_after - frames_before);
+        serial_write("\n", 1);
+    }
+}
+
+// True if no user process is alive besides `self` (NULL = none at all)
+static bool exec_alone(const struct process *self) {
+    struct process p;
+    for (unsigned int i = 1; sched_get_process(i, &p); i++) {
+        if (p.state != PROC_UNUSED && p.state != PROC_ZOMBIE && (!self || p.pid != self->pid)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+int64_t exec_elf(const char *filename, bool background) {
     serial_write("IN EXEC_ELF\n", 12);
     serial_write("Executing ELF file: ", 20);
     serial_write(filename, strlen(filename));
@@ -48,11 +99,18 @@ void exec_elf(const char *filename) {
         serial_write("Error: File not found via fs_open: ", 35);
         serial_write(filename, strlen(filename));
         serial_write("\n", 1);
-        return; // Or handle error appropriately
+        return -1;
     }
     // Remove the check for null address, as fs_file doesn't guarantee data allocation on open
     // if (elf_file_struct->address == NULL) { ... }
 
+    // Only initramfs files have their contents in memory; the areas below
+    // keep referring to the file for as long as the process lives
+    if (elf_file_struct->fs_type != FS_TYPE_INITRAMFS) {
+        serial_write("Error: Can only execute initramfs files.\n", 41);
+        return -1;
+    }
+
     // Use file data and size from fs_file struct
     void* elf_data = elf_file_struct->data; 
     size_t elf_size = elf_file_struct->size; 
@@ -66,7 +124,7 @@ void exec_elf(const char *filename) {
     // --- Validate ELF Header --- 
     if (elf_size < sizeof(elf64_header_t)) { // Use local type
         serial_write("Error: File too small to be ELF header.\n", 41);
-        return;
+        return -1;
     }
     elf64_header_t *header = (elf64_header_t *)elf_data; // Use local type
     // Check magic, class, data, type, machine, version using local header fields
@@ -78,26 +136,28 @@ void exec_elf(const char *filename) {
         header->common.e_version != EV_CURRENT) {    // Must be current version
         serial_write("Error: Invalid ELF header fields.\n", 34);
         // Optional: print specific mismatch
-        return;
+        return -1;
     }
 
     uint64_t entry_point_vaddr = header->e_entry; // Virtual address from ELF header
 
     // --- VMM Setup ---
+    uint64_t frames_before = exec_used_frames();
     serial_write("Creating address space...\n", 27);
-    pml4_t* user_pml4_phys = vmm_create_address_space();
-    if (!user_pml4_phys) {
+    struct address_space* user_as = vmm_create_address_space();
+    if (!user_as) {
         serial_write("Error: Failed to create address space for process.\n", 51);
-        return; // Cannot proceed
+        return -1; // Cannot proceed
     }
 
     // --- Load Program Headers (Segments) --- 
     if (elf_size < header->e_phoff + (uint64_t)header->e_phnum * sizeof(elf64_program_header_t)) { // Use local type
         serial_write("Error: File too small for program headers.\n", 43);
-        return;
+        goto destroy;
     }
     elf64_program_header_t *phdrs = (elf64_program_header_t *)((uint8_t *)elf_data + header->e_phoff); // Use local type
     serial_write("Loading program segments...\n", 28);
+    uint64_t image_end = 0; // The heap starts after the highest segment
     for (int i = 0; i < header->e_phnum; i++) {
         elf64_program_header_t *ph = &phdrs[i]; // Use local type
 
@@ -121,159 +181,126 @@ void exec_elf(const char *filename) {
 
         if (segment_mem_size == 0) continue; // Skip empty segments
 
-        // Align virtual address down to page boundary for mapping loop
+        // Page range covered by the segment
         uint64_t first_page_vaddr = segment_virt_addr & PAGE_MASK;
         uint64_t last_page_vaddr = (segment_virt_addr + segment_mem_size + PAGE_SIZE - 1) & PAGE_MASK;
-        uint64_t num_pages = (last_page_vaddr - first_page_vaddr) / PAGE_SIZE;
-        if (num_pages == 0 && segment_mem_size > 0) num_pages = 1; // Handle small segments within one page
-
-        serial_write("VMM: Mapping segment...\n", 26); // DEBUG
-        for (uint64_t offset = 0; offset < ph->p_memsz; offset += PAGE_SIZE) {
-            uint64_t page_vaddr = (ph->p_vaddr + offset) & PAGE_MASK;
-            
-            // Check if this page is already mapped (can happen with overlapping segments? unlikely)
-            // Note: vmm_get_physical_address not implemented yet, skip check for now.
-            // if (vmm_get_physical_address(user_pml4_phys, current_virt_addr) != 0) {
-            //     continue;
-            // }
-            
-            void* phys_frame = pmm_alloc_frame();
-            if (!phys_frame) {
-                 serial_write("Error: Out of physical memory loading segment.\n", 47);
-                 // TODO: Need process cleanup (free allocated frames, page tables)
-                 return;
-            }
-
-            uint64_t current_phys_addr = (uint64_t)phys_frame;
-
-            // Determine page flags
-            uint64_t page_flags = PTE_PRESENT | PTE_USER; // Base flags
-            if (segment_flags & PF_W) page_flags |= PTE_WRITABLE;
-            if (!(segment_flags & PF_X)) page_flags |= PTE_NX; // No-Execute if not executable
-
-            // Map the page
-            if (!vmm_map_page(user_pml4_phys, page_vaddr, current_phys_addr, page_flags)) {
-                serial_write("Error: Failed to map page for segment.\n", 40);
-                pmm_free_frame(phys_frame); // Free the frame we just allocated
-                // TODO: Need process cleanup
-                return;
-            }
-            
-            // Copy data from ELF file to the newly allocated physical frame (via virtual addr)
-            void* virt_frame_dest = phys_to_virt(current_phys_addr);
-            memset(virt_frame_dest, 0, PAGE_SIZE); // Zero the page first (for .bss sections)
-            
-            // Calculate copy ranges carefully
-            uint64_t file_start_offset = ph->p_offset;
-            uint64_t segment_start_in_file = file_start_offset;
-            uint64_t segment_end_in_file = file_start_offset + segment_file_size;
-            
-            uint64_t page_start_vaddr = page_vaddr;
-            uint64_t page_end_vaddr = page_vaddr + PAGE_SIZE;
-            
-            uint64_t segment_start_vaddr = segment_virt_addr;
-            uint64_t segment_end_vaddr = segment_virt_addr + segment_mem_size;
-            
-            // Determine intersection of file data range and current page range
-            uint64_t copy_start_vaddr = (page_start_vaddr > segment_start_vaddr) ? page_start_vaddr : segment_start_vaddr;
-            uint64_t copy_end_vaddr = (page_end_vaddr < segment_end_vaddr) ? page_end_vaddr : segment_end_vaddr;
-            
-            if (copy_start_vaddr < copy_end_vaddr) { // If there is an overlap
-                uint64_t copy_offset_in_page = copy_start_vaddr - page_start_vaddr;
-                uint64_t copy_offset_in_segment = copy_start_vaddr - segment_start_vaddr;
-                uint64_t file_offset = segment_start_in_file + copy_offset_in_segment;
-                size_t bytes_to_copy = copy_end_vaddr - copy_start_vaddr;
-
-                // Ensure we don't read past the file size allocated to the segment
-                if (file_offset + bytes_to_copy > segment_end_in_file) {
-                    if (file_offset >= segment_end_in_file) {
-                        bytes_to_copy = 0; // No file data left in this range
-                    } else {
-                        bytes_to_copy = segment_end_in_file - file_offset;
-                    }
-                }
-                
-                if (bytes_to_copy > 0) {
-                    memcpy((uint8_t*)virt_frame_dest + copy_offset_in_page,
-                           (uint8_t *)elf_data + file_offset,
-                           bytes_to_copy);
-                }
-            }
-            
-            // serial_write("    Mapped V=0x", 16); serial_print_hex(current_virt_addr);
-            // serial_write(" -> P=0x", 9); serial_print_hex(current_phys_addr);
-            // serial_write(" Flags=0x", 10); serial_print_hex(page_flags);
-            // serial_write("\n", 1);
+
+        // Determine page flags
+        uint64_t page_flags = PTE_PRESENT | PTE_USER; // Base flags
+        if (segment_flags & PF_W) page_flags |= PTE_WRITABLE;
+        if (!(segment_flags & PF_X)) page_flags |= PTE_NX; // No-Execute if not executable
+
+        if (segment_file_size > segment_mem_size) {
+            segment_file_size = segment_mem_size;
+        }
+        if (ph->p_offset > elf_size || segment_file_size > elf_size - ph->p_offset) {
+            serial_write("Error: Segment data past end of file.\n", 38);
+            goto destroy;
+        }
+
+        // Only record the area: pages are allocated and filled from the
+        // file by the page fault handler when the program first touches them
+        struct vmm_area segment = {
+            .start = first_page_vaddr,
+            .end = last_page_vaddr,
+            .flags = page_flags,
+            .file = elf_file_struct,
+            .file_offset = ph->p_offset,
+            .file_vaddr = segment_virt_addr,
+            .file_size = segment_file_size,
+        };
+        // Read-only pages of binaries are shared between processes
+        if (ph->p_offset % PAGE_SIZE == segment_virt_addr % PAGE_SIZE) {
+            segment.cached = true;
+        }
+        if (!vmm_add_segment(user_as, &segment)) {
+            goto destroy;
+        }
+        if (last_page_vaddr > image_end) {
+            image_end = last_page_vaddr;
         }
     }
-    serial_write("ELF Segments loaded and mapped.\n", 31);
+    user_as->brk_start = image_end;
+    user_as->brk = image_end;
+    serial_write("ELF Segments recorded.\n", 23);
 
     // --- Allocate and Map User Stack ---
     serial_write("[EXEC] Allocating user stack...\n", 30);
     uint64_t user_rsp = USER_STACK_TOP_VADDR + PAGE_SIZE - 8;
-    for (uint64_t vaddr = USER_STACK_BOTTOM_VADDR; vaddr <= USER_STACK_TOP_VADDR; vaddr += PAGE_SIZE) {
-        void* phys_frame = pmm_alloc_frame();
-        if (!phys_frame) {
-            serial_write("Error: Out of physical memory allocating stack.\n", 48);
-            // TODO: Cleanup
-            return;
-        }
-        uint64_t stack_flags = PTE_PRESENT | PTE_USER | PTE_WRITABLE; // REMOVED PTE_NX
-        int map_result = vmm_map_page(user_pml4_phys, vaddr, (uint64_t)phys_frame, stack_flags);
-        serial_write("[STACK MAP] vaddr=0x", 20); serial_print_hex(vaddr);
-        serial_write(" phys=0x", 8); serial_print_hex((uint64_t)phys_frame);
-        serial_write(" result=", 9); serial_print_hex(map_result);
-        serial_write("\n", 1);
-        if (!map_result) {
-             serial_write("Error: Failed to map page for stack.\n", 37);
-             pmm_free_frame(phys_frame);
-             // TODO: Cleanup
-             return;
-         }
-        // serial_write("    Mapped Stack V=0x", 22); serial_print_hex(vaddr);
-        // serial_write(" -> P=0x", 9); serial_print_hex((uint64_t)phys_frame);
-        // serial_write("\n", 1);
+    uint64_t stack_flags = PTE_PRESENT | PTE_USER | PTE_WRITABLE; // REMOVED PTE_NX
+    struct vmm_area stack = {
+        .start = USER_STACK_BOTTOM_VADDR,
+        .end = USER_STACK_TOP_VADDR + PAGE_SIZE,
+        .flags = stack_flags,
+    };
+    if (!vmm_add_area(user_as, &stack)) {
+        goto destroy;
     }
 
-    // Save current kernel address space before switching
-    pml4_t* kernel_pml4_phys = vmm_get_current_address_space();
+    // The process starts by "returning" to user mode at the entry point
+    struct syscall_frame frame = {
+        .rip = entry_point_vaddr,
+        .cs = USER_CODE_SELECTOR,
+        .rflags = 0x202, // IF=1, reserved bit
+        .rsp = user_rsp,
+        .ss = USER_DATA_SELECTOR,
+    };
+    bool check_leaks = exec_alone(NULL);
+    struct process *proc = sched_spawn(filename, user_as, &frame, background);
+    if (!proc) {
+        goto destroy;
+    }
+    proc->check_leaks = check_leaks;
+    proc->frames_before = frames_before;
+
+    serial_write("[EXEC] Process created, PID 0x", 30);
+    serial_print_hex(proc->pid);
+    serial_write(" RIP=0x", 7); serial_print_hex(entry_point_vaddr);
+    serial_write(" RSP=0x", 7); serial_print_hex(user_rsp);
+    serial_write("\n", 1);
+    return (int64_t)proc->pid;
+
+destroy:
+    vmm_destroy_address_space(user_as);
+    return -1;
+}
+
+void exec_release(struct process *proc) {
+    struct address_space *user_as = proc->as;
 
-    // Switch to the new process's address space
-    vmm_switch_address_space(user_pml4_phys);
-    serial_write("[EXEC] CR3 switched.\n", 19);
+    serial_write("[EXEC] Process 0x", 17);
+    serial_print_hex(proc->pid);
+    serial_write(" exited, cleaning up...\n", 24);
 
-    serial_write("[EXEC] About to JMP to user mode...\n", 36);
-    serial_write("[EXEC] RIP=0x", 12); serial_print_hex(entry_point_vaddr); 
-    serial_write(" RSP=0x", 8); serial_print_hex(user_rsp);
+    serial_write("[EXEC] Demand paging: faulted in 0x", 35);
+    serial_print_hex(user_as->pages_faulted);
+    serial_write(" of 0x", 6);
+    serial_print_hex(user_as->area_pages);
+    serial_write(" pages in memory areas\n", 23);
+    struct vmm_page_counts pages;
+    vmm_count_pages(user_as, &pages);
+    serial_write("[EXEC] Resident pages: zero 0x", 30);
+    serial_print_hex(pages.zero);
+    serial_write(", shared 0x", 11);
+    serial_print_hex(pages.shared);
+    serial_write(", private 0x", 12);
+    serial_print_hex(pages.private);
+    serial_write(", swapped 0x", 12);
+    serial_print_hex(pages.swapped);
     serial_write("\n", 1);
+    serial_write("[EXEC] Copy-on-write: copied 0x", 31);
+    serial_print_hex(user_as->cow_copies);
+    serial_write(" shared pages\n", 14);
+    serial_write("[EXEC] Page cache: shared 0x", 28);
+    serial_print_hex(user_as->pages_cached);
+    serial_write(" text pages\n", 12);
 
-    // Jump to user mode - note that this function is declared as void
-    jmp_usermode(entry_point_vaddr, user_rsp);
-    
-    // If we get here, the user program has exited via syscall or jmp_usermode returned unexpectedly
-    serial_write("[EXEC] Process returned from usermode, cleaning up...\n", 55);
-    
-    // 1. Restore kernel address space
-    vmm_switch_address_space(kernel_pml4_phys);
-    
-    // 2. Free process memory - release all pages allocated for this process
-    // For now, we'll just free the user stack pages since we know their range
-    serial_write("[EXEC] Freeing user stack memory...\n", 36);
-    for (uint64_t vaddr = USER_STACK_BOTTOM_VADDR; vaddr <= USER_STACK_TOP_VADDR; vaddr += PAGE_SIZE) {
-        // Get the physical address for this virtual address
-        void* phys_addr = (void*)vmm_get_physical_address(user_pml4_phys, vaddr);
-        if (phys_addr) {
-            // Free the physical frame
-            pmm_free_frame(phys_addr);
-            
-            // Unmap from page tables
-            vmm_unmap_page(user_pml4_phys, vaddr);
-        }
+    // Free every frame and page table of the process. With other processes
+    // alive the frame count says nothing about this one.
+    vmm_destroy_address_space(user_as);
+    if (proc->check_leaks && exec_alone(proc)) {
+        exec_check_leaks(proc->frames_before);
     }
-    
-    // 3. TODO: Free the user page tables themselves (for now we'll leak these)
-    // This would involve walking the page tables and freeing each level
-    
+
     serial_write("[EXEC] Process cleanup complete\n", 32);
-    return;
 }
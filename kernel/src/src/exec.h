@@ -2,7 +2,18 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 
-// Execute an ELF file
-// Returns true if execution was successful, false otherwise
-void exec_elf(const char *filename);
+struct process;
+
+// Loads an ELF file into a new process, which the scheduler runs from then
+// on. A background process is reaped when it exits; otherwise the caller
+// collects it with sched_wait. Returns its PID, or -1 on error.
+int64_t exec_elf(const char *filename, bool background);
+
+// Prints the memory statistics of an exiting process and frees its address
+// space (called by sched_exit, with the kernel address space loaded)
+void exec_release(struct process *proc);
+
+// Total frames still allocated after processes were torn down (should be 0)
+uint64_t exec_get_leaked_frames(void);
@@ -1,5 +1,6 @@
 #include "ext2.h"
 #include "serial.h"
+#include "uaccess.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <stdbool.h>
@@ -64,8 +65,10 @@ static struct ext2_inode *ext2_read_inode(uint32_t inode_num) {
 }
 
 // Helper function to read data from an inode
-static size_t ext2_read_inode_data(struct ext2_inode *inode, size_t offset, 
-                                  void *buf, size_t len) {
+// Copies file data block by block straight into buf, which is user memory
+// if to_user is set. Returns bytes read, or -1 if buf is a bad user address.
+static int64_t ext2_read_inode_data(struct ext2_inode *inode, size_t offset, 
+                                    void *buf, size_t len, bool to_user) {
     if (!inode || !buf || offset >= inode->size) {
         return 0;
     }
@@ -107,7 +110,13 @@ static size_t ext2_read_inode_data(struct ext2_inode *inode, size_t offset,
             to_read = len - bytes_read;
         }
         
-        memcpy((uint8_t *)buf + bytes_read, block_data, to_read);
+        if (to_user) {
+            if (copy_to_user((uint8_t *)buf + bytes_read, block_data, to_read) < 0) {
+                return -1;
+            }
+        } else {
+            memcpy((uint8_t *)buf + bytes_read, block_data, to_read);
+        }
         bytes_read += to_read;
         
         if (bytes_read >= len) {
@@ -118,7 +127,7 @@ static size_t ext2_read_inode_data(struct ext2_inode *inode, size_t offset,
     // TODO: Implement indirect block reading if needed
     // This simplified implementation only handles direct blocks
     
-    return bytes_read;
+    return (int64_t)bytes_read;
 }
 
 // Helper function to find an inode by path
@@ -324,12 +333,8 @@ struct fs_file *ext2_open(const char *path) {
     return &file;
 }
 
-// Read from a file
-size_t ext2_read(const struct fs_file *file, size_t offset, void *buf, size_t len) {
-    if (!file || !buf || offset >= file->size) {
-        return 0;
-    }
-    
+// Finds the inode behind a file returned by ext2_open
+static struct ext2_inode *ext2_file_inode(const struct fs_file *file) {
     // Get the inode number from the data pointer
     uint32_t inode_blocks = (uint32_t)(uintptr_t)file->data;
     
@@ -346,12 +351,35 @@ size_t ext2_read(const struct fs_file *file, size_t offset, void *buf, size_t le
         }
     }
     
+    return inode;
+}
+
+// Read from a file
+size_t ext2_read(const struct fs_file *file, size_t offset, void *buf, size_t len) {
+    if (!file || !buf || offset >= file->size) {
+        return 0;
+    }
+    
+    struct ext2_inode *inode = ext2_file_inode(file);
     if (!inode) {
         return 0;
     }
     
     // Read the data from the inode
-    return ext2_read_inode_data(inode, offset, buf, len);
+    return (size_t)ext2_read_inode_data(inode, offset, buf, len, false);
+}
+
+int64_t ext2_read_user(const struct fs_file *file, size_t offset, void *user_buf, size_t len) {
+    if (!file || offset >= file->size) {
+        return 0;
+    }
+    
+    struct ext2_inode *inode = ext2_file_inode(file);
+    if (!inode) {
+        return 0;
+    }
+    
+    return ext2_read_inode_data(inode, offset, user_buf, len, true);
 }
 
 // List files in a directory
@@ -134,6 +134,8 @@ bool ext2_detect(const void *data, size_t size);
 bool ext2_init(const void *data, size_t size);
 struct fs_file *ext2_open(const char *path);
 size_t ext2_read(const struct fs_file *file, size_t offset, void *buf, size_t len);
+// Like ext2_read, but copies straight into user memory (-1 on a bad buffer)
+int64_t ext2_read_user(const struct fs_file *file, size_t offset, void *user_buf, size_t len);
 const struct fs_file *ext2_list(const char *path, size_t *count);
 bool ext2_change_dir(const char *path);
 
@@ -2,31 +2,54 @@
 #include "initramfs.h"
 #include "ext2.h"
 #include "serial.h"
+#include "pagecache.h"
+#include "slab.h"
+#include "uaccess.h"
 #include <stddef.h>
 #include <string.h>
 
 // File system instance
 static struct fs_mount fs;
 
-// Memory allocation helper
-static void *fs_alloc(size_t size) {
-    // This is a very simple allocator for our demo
-    // In a real system, we'd use a proper memory allocator
-    static char mem_pool[64 * 1024]; // 64KB memory pool
-    static size_t mem_used = 0;
-    
-    if (mem_used + size > sizeof(mem_pool)) {
-        return NULL; // Out of memory
+static struct kmem_cache *fs_file_cache;
+
+// Listing handed out by fs_list while ext2 is active
+static const struct fs_file *fs_ext2_listing[FS_MAX_FILES];
+
+// Appends a zeroed entry to the file list, growing the list as needed
+static struct fs_file *fs_add_file(void) {
+    if (fs.file_count == fs.file_capacity) {
+        size_t new_capacity = fs.file_capacity ? fs.file_capacity * 2 : 16;
+        struct fs_file **files = krealloc(fs.files, new_capacity * sizeof(*files));
+        if (!files) {
+            return NULL;
+        }
+        fs.files = files;
+        fs.file_capacity = new_capacity;
     }
-    
-    void *ptr = mem_pool + mem_used;
-    mem_used += size;
-    return ptr;
+
+    struct fs_file *file = kmem_cache_alloc(fs_file_cache);
+    if (!file) {
+        return NULL;
+    }
+    memset(file, 0, sizeof(*file));
+    fs.files[fs.file_count++] = file;
+    return file;
+}
+
+// Undoes the last fs_add_file
+static void fs_drop_last_file(void) {
+    struct fs_file *file = fs.files[--fs.file_count];
+    kfree(file->data);
+    kmem_cache_free(fs_file_cache, file);
 }
 
 void fs_init(void) {
     // Clear filesystem state
     memset(&fs, 0, sizeof(fs));
+    if (!fs_file_cache) {
+        fs_file_cache = kmem_cache_create("fs_file", sizeof(struct fs_file));
+    }
     
     // Set root directory
     strcpy(fs.current_dir, "/");
@@ -46,11 +69,6 @@ void fs_init(void) {
         if (!src) break;
         count++;
         
-        if (fs.file_count >= FS_MAX_FILES) {
-            serial_write("[fs_init] Warning: Reached max files limit\n", 41);
-            break; // No more room
-        }
-        
         size_t name_len = strlen(src->name);
         if (name_len > 0 && src->name[name_len - 1] == '/') {
             char dir_name[32];
@@ -62,18 +80,25 @@ void fs_init(void) {
             continue;
         }
 
-        struct fs_file *dst = &fs.files[fs.file_count++];
+        struct fs_file *dst = fs_add_file();
+        if (!dst) {
+            serial_write("[fs_init] Warning: Out of memory for files\n", 43);
+            break;
+        }
         strncpy(dst->name, src->name, sizeof(dst->name) - 1);
         dst->name[sizeof(dst->name) - 1] = '\0';
 
-        dst->capacity = src->size;
-        dst->data = fs_alloc(dst->capacity);
+        // One spare byte for the terminator fs_write keeps after the data
+        dst->capacity = src->size + 1;
+        dst->data = kmalloc(dst->capacity);
         if (!dst->data) {
-            fs.file_count--;
+            fs_drop_last_file();
+            serial_write("[fs_init] Warning: Out of memory for files\n", 43);
             break;
         }
 
         memcpy(dst->data, src->data, src->size);
+        dst->data[src->size] = '\0';
         dst->size = src->size;
         dst->is_dir = false;
         dst->mode = 0644;
@@ -107,7 +132,7 @@ void fs_init(void) {
     
     // Check if any of the files is an ext2 image that we can mount
     for (size_t i = 0; i < fs.file_count; i++) {
-        struct fs_file *file = &fs.files[i];
+        struct fs_file *file = fs.files[i];
         if (strcmp(file->name, "ext2.img") == 0 || 
             strcmp(file->name, "disk.img") == 0) {
             // Try to mount as ext2
@@ -224,7 +249,7 @@ struct fs_file *fs_open(const char *name) {
         memset(processed_entry, 0, sizeof(processed_entry));
         
         // Make a clean copy of the entry name
-        strncpy(processed_entry, fs.files[i].name, sizeof(processed_entry) - 1);
+        strncpy(processed_entry, fs.files[i]->name, sizeof(processed_entry) - 1);
         processed_entry[sizeof(processed_entry) - 1] = '\0';
 
         // Strip './' from the entry name if present
@@ -240,9 +265,9 @@ struct fs_file *fs_open(const char *name) {
 
         // Try both the processed name and direct comparison
         if (strcmp(processed_entry, processed_name) == 0 || 
-            strcmp(fs.files[i].name, processed_name) == 0 ||
-            strcmp(fs.files[i].name, name) == 0) {
-            return &fs.files[i];
+            strcmp(fs.files[i]->name, processed_name) == 0 ||
+            strcmp(fs.files[i]->name, name) == 0) {
+            return fs.files[i];
         }
     }
 
@@ -268,17 +293,41 @@ size_t fs_read(const struct fs_file *file, size_t offset, void *buf, size_t len)
     }
 }
 
-const struct fs_file *fs_list(size_t *count) {
+int64_t fs_read_user(const struct fs_file *file, size_t offset, void *user_buf, size_t len) {
+    if (!file || offset >= file->size) return 0;
+
+    if (file->fs_type == FS_TYPE_EXT2) {
+        return ext2_read_user(file, offset, user_buf, len);
+    }
+
+    if (!file->data) return 0;
+    size_t to_copy = file->size - offset;
+    if (to_copy > len) to_copy = len;
+    return copy_to_user(user_buf, file->data + offset, to_copy);
+}
+
+const struct fs_file *const *fs_list(size_t *count) {
     // Handle based on active filesystem
     if (fs.active_fs == FS_TYPE_EXT2) {
         // Use ext2 driver
-        return ext2_list(fs.current_dir, count);
+        size_t n = 0;
+        const struct fs_file *files = ext2_list(fs.current_dir, &n);
+        if (!files) {
+            n = 0;
+        }
+        for (size_t i = 0; i < n && i < FS_MAX_FILES; i++) {
+            fs_ext2_listing[i] = &files[i];
+        }
+        if (count) {
+            *count = n < FS_MAX_FILES ? n : FS_MAX_FILES;
+        }
+        return fs_ext2_listing;
     } else {
         // Use initramfs driver (original implementation)
         if (count) {
             *count = fs.file_count;
         }
-        return fs.files;
+        return (const struct fs_file *const *)fs.files;
     }
 }
 
@@ -295,21 +344,19 @@ struct fs_file *fs_create_file(const char *name) {
         return NULL;
     }
     
-    // Check if we have room for a new file
-    if (fs.file_count >= FS_MAX_FILES) {
-        return NULL; // No more room
-    }
-    
     // Create new file
-    struct fs_file *file = &fs.files[fs.file_count++];
+    struct fs_file *file = fs_add_file();
+    if (!file) {
+        return NULL; // Out of memory
+    }
     strncpy(file->name, name, sizeof(file->name) - 1);
     file->name[sizeof(file->name) - 1] = '\0';
     
     // Allocate initial buffer
     file->capacity = 256; // Start with 256 bytes
-    file->data = fs_alloc(file->capacity);
+    file->data = kmalloc(file->capacity);
     if (!file->data) {
-        fs.file_count--; // Revert the file addition
+        fs_drop_last_file(); // Revert the file addition
         return NULL;
     }
     
@@ -322,34 +369,35 @@ struct fs_file *fs_create_file(const char *name) {
     return file;
 }
 
-size_t fs_write(struct fs_file *file, size_t offset, const void *buf, size_t len) {
-    if (!file) return 0;
+// Makes room for len bytes at offset: grows the buffer, zeroes any gap past
+// the end and drops stale cached pages. Returns false if the file cannot be
+// written or memory ran out.
+static bool fs_write_prepare(struct fs_file *file, size_t offset, size_t len) {
+    if (!file) return false;
     
     // For now, only support writing to initramfs files
     if (file->fs_type == FS_TYPE_EXT2) {
         serial_write("[fs_write] Writing to ext2 files not supported yet\n", 49);
-        return 0;
+        return false;
     }
     
-    if (!file->data) return 0;
+    if (!file->data) return false;
     
-    // Check if we need to expand the buffer
-    size_t new_size = offset + len;
-    if (new_size > file->capacity) {
+    // Check if we need to expand the buffer (keeping a byte for the terminator)
+    size_t new_size;
+    if (__builtin_add_overflow(offset, len, &new_size)) return false;
+    if (new_size >= file->capacity) {
         // Calculate new capacity (double the needed size)
         size_t new_capacity = new_size * 2;
         
-        // Allocate new buffer
-        char *new_data = fs_alloc(new_capacity);
+        // Grow the buffer; krealloc copies the contents and frees the old one
+        char *new_data = krealloc(file->data, new_capacity);
         if (!new_data) {
-            return 0; // Failed to allocate
+            return false; // Failed to allocate
         }
         
-        // Zero the new buffer so unwritten regions don't expose stale data
-        memset(new_data, 0, new_capacity);
-
-        // Copy existing file contents
-        memcpy(new_data, file->data, file->size);
+        // Zero the new space so unwritten regions don't expose stale data
+        memset(new_data + file->size, 0, new_capacity - file->size);
         
         // Update file struct
         file->data = new_data;
@@ -361,18 +409,38 @@ size_t fs_write(struct fs_file *file, size_t offset, const void *buf, size_t len
         memset(file->data + file->size, 0, offset - file->size);
     }
 
-    // Write the data
-    memcpy(file->data + offset, buf, len);
-    
-    // Update size if needed
+    // Executable pages cached from the old contents are stale now
+    pagecache_invalidate(file);
+    return true;
+}
+
+// Extends the file over data written up to new_size
+static void fs_write_commit(struct fs_file *file, size_t new_size) {
     if (new_size > file->size) {
         file->size = new_size;
         file->data[file->size] = '\0'; // Ensure null termination
     }
-    
+}
+
+size_t fs_write(struct fs_file *file, size_t offset, const void *buf, size_t len) {
+    if (!fs_write_prepare(file, offset, len)) return 0;
+
+    // Write the data
+    memcpy(file->data + offset, buf, len);
+    fs_write_commit(file, offset + len);
     return len;
 }
 
+int64_t fs_write_user(struct fs_file *file, size_t offset, const void *user_buf, size_t len) {
+    if (!fs_write_prepare(file, offset, len)) return -1;
+
+    // Copy straight from the caller into the file; on a fault the size is
+    // left alone so no partially written tail becomes visible
+    if (copy_from_user(file->data + offset, user_buf, len) < 0) return -1;
+    fs_write_commit(file, offset + len);
+    return (int64_t)len;
+}
+
 bool fs_create_dir(const char *name) {
     // For now, only support directory creation in initramfs
     if (fs.active_fs == FS_TYPE_EXT2) {
@@ -424,9 +492,8 @@ bool fs_create_dir(const char *name) {
     dir->path[max_len - 1] = '\0';
 
     // Also create an entry in the file list so directory shows up in listings
-    if (fs.file_count < FS_MAX_FILES) {
-        struct fs_file *f = &fs.files[fs.file_count++];
-        memset(f, 0, sizeof(*f));
+    struct fs_file *f = fs_add_file();
+    if (f) {
         strncpy(f->name, name, sizeof(f->name) - 1);
         f->name[sizeof(f->name) - 1] = '\0';
         f->is_dir = true;
@@ -444,3 +511,13 @@ bool fs_chmod(const char *name, unsigned short mode) {
     f->mode = mode;
     return true;
 }
+
+size_t fs_get_data_bytes(void) {
+    size_t bytes = 0;
+    for (size_t i = 0; i < fs.file_count; i++) {
+        if (fs.files[i]->data) {
+            bytes += fs.files[i]->capacity;
+        }
+    }
+    return bytes;
+}
@@ -6,7 +6,7 @@
 #include <stdbool.h>
 
 #define FS_MAX_PATH 128
-#define FS_MAX_FILES 32
+#define FS_MAX_FILES 32 // Entries in one ext2 directory listing
 #define FS_MAX_DIRS 8
 
 // Filesystem types
@@ -35,8 +35,9 @@ struct fs_dir {
 
 // File system mount
 struct fs_mount {
-    struct fs_file files[FS_MAX_FILES];
+    struct fs_file **files;  // Entries, each allocated from a kmem cache
     size_t file_count;
+    size_t file_capacity;    // Slots in files
     struct fs_dir dirs[FS_MAX_DIRS];
     size_t dir_count;
     char current_dir[FS_MAX_PATH];
@@ -61,8 +62,12 @@ struct fs_file *fs_open(const char *name);
 // Read from file (returns number of bytes read)
 size_t fs_read(const struct fs_file *file, size_t offset, void *buf, size_t len);
 
-// List files in current directory (returns pointer to array and count)
-const struct fs_file *fs_list(size_t *count);
+// Read from file straight into user memory (returns bytes read, -1 if the
+// buffer is not writable user memory)
+int64_t fs_read_user(const struct fs_file *file, size_t offset, void *user_buf, size_t len);
+
+// List files in current directory (returns array of entries and count)
+const struct fs_file *const *fs_list(size_t *count);
 
 // Create a new empty file (returns the new file or NULL if failed)
 struct fs_file *fs_create_file(const char *name);
@@ -70,10 +75,17 @@ struct fs_file *fs_create_file(const char *name);
 // Write to a file (returns number of bytes written)
 size_t fs_write(struct fs_file *file, size_t offset, const void *buf, size_t len);
 
+// Write to a file straight from user memory (returns bytes written, -1 on a
+// bad buffer or if the file cannot be written)
+int64_t fs_write_user(struct fs_file *file, size_t offset, const void *user_buf, size_t len);
+
 // Create a new directory
 bool fs_create_dir(const char *name);
 
 // Change permissions of a file
 bool fs_chmod(const char *name, unsigned short mode);
 
+// Bytes allocated for in-memory file contents
+size_t fs_get_data_bytes(void);
+
 #endif // FS_H
@@ -2,11 +2,14 @@
 #include <stddef.h>
 #include <stdint.h>
 #include "serial.h"
+#include "cpu.h"
 
 #define GDT_ENTRIES 7
 
-static struct gdt_entry gdt[GDT_ENTRIES];
-static struct gdt_ptr gp;
+// Every CPU has its own GDT, as the TSS descriptor in it is marked busy by
+// the CPU that loads it, and its own TSS
+static struct gdt_entry gdts[MAX_CPUS][GDT_ENTRIES];
+static struct gdt_ptr gps[MAX_CPUS];
 
 // 64-bit TSS descriptor is 16 bytes, so we need to place it after the normal entries.
 struct __attribute__((packed)) gdt_tss_desc {
@@ -20,12 +23,12 @@ struct __attribute__((packed)) gdt_tss_desc {
     uint32_t reserved;
 };
 
-static struct tss_entry tss __attribute__((aligned(16)));
+static struct tss_entry tsss[MAX_CPUS] __attribute__((aligned(16)));
 
 extern void gdt_flush(uint64_t);
 extern void tss_flush();
 
-static void set_gdt_entry(int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
+static void set_gdt_entry(struct gdt_entry* gdt, int num, uint32_t base, uint32_t limit, uint8_t access, uint8_t gran) {
     gdt[num].limit_low = (limit & 0xFFFF);
     gdt[num].base_low = (base & 0xFFFF);
     gdt[num].base_middle = (base >> 16) & 0xFF;
@@ -34,43 +37,34 @@ static void set_gdt_entry(int num, uint32_t base, uint32_t limit, uint8_t access
     gdt[num].base_high = (base >> 24) & 0xFF;
 }
 
-void gdt_init(void) {
-    serial_write("GDT: Initializing...\n", 22);
+// Fills in and loads the GDT and TSS of one CPU
+static void gdt_setup(unsigned int cpu, uint64_t rsp0) {
+    struct gdt_entry* gdt = gdts[cpu];
+    struct tss_entry* tss = &tsss[cpu];
+
     // Null segment
-    set_gdt_entry(0, 0, 0, 0, 0);
+    set_gdt_entry(gdt, 0, 0, 0, 0, 0);
     // Kernel code: base=0, limit=0xFFFFF, access=0x9A, gran=0xA0 (L=1, G=1, D=0)
-    set_gdt_entry(1, 0, 0xFFFFF, 0x9A, 0xA0);
+    set_gdt_entry(gdt, 1, 0, 0xFFFFF, 0x9A, 0xA0);
     // Kernel data: base=0, limit=0xFFFFF, access=0x92, gran=0xC0 (G=1, D=1)
-    set_gdt_entry(2, 0, 0xFFFFF, 0x92, 0xC0);
+    set_gdt_entry(gdt, 2, 0, 0xFFFFF, 0x92, 0xC0);
     // User code: base=0, limit=0xFFFFF, access=0xFA, gran=0xA0 (L=1, G=1, D=0, DPL=3)
-    set_gdt_entry(3, 0, 0xFFFFF, 0xFA, 0xA0);
+    set_gdt_entry(gdt, 3, 0, 0xFFFFF, 0xFA, 0xA0);
     // User data: base=0, limit=0xFFFFF, access=0xF2, gran=0xC0 (G=1, D=1, DPL=3)
-    set_gdt_entry(4, 0, 0xFFFFF, 0xF2, 0xC0);
-    set_gdt_entry(5, 0, 0, 0, 0);               // Placeholder for TSS (part 1)
-    set_gdt_entry(6, 0, 0, 0, 0);               // Placeholder for TSS (part 2)
-
-    serial_write("User code GDT[3]: access=0x", 28);
-    serial_print_hex(gdt[3].access);
-    serial_write(" gran=0x", 9);
-    serial_print_hex(gdt[3].granularity);
-    serial_write("\n", 1);
-    serial_write("User data GDT[4]: access=0x", 28);
-    serial_print_hex(gdt[4].access);
-    serial_write(" gran=0x", 9);
-    serial_print_hex(gdt[4].granularity);
-    serial_write("\n", 1);
+    set_gdt_entry(gdt, 4, 0, 0xFFFFF, 0xF2, 0xC0);
+    set_gdt_entry(gdt, 5, 0, 0, 0, 0);               // Placeholder for TSS (part 1)
+    set_gdt_entry(gdt, 6, 0, 0, 0, 0);               // Placeholder for TSS (part 2)
 
-    gp.limit = sizeof(gdt) - 1;
-    gp.base = (uint64_t)&gdt;
+    gps[cpu].limit = sizeof(gdts[cpu]) - 1;
+    gps[cpu].base = (uint64_t)gdt;
 
     // Setup TSS
-    for (int i = 0; i < sizeof(struct tss_entry); ++i) ((uint8_t*)&tss)[i] = 0;
-    extern uint8_t kernel_stack_top[];
-    tss.rsp0 = (uint64_t)kernel_stack_top;
-    tss.iomap_base = sizeof(struct tss_entry);
+    for (int i = 0; i < sizeof(struct tss_entry); ++i) ((uint8_t*)tss)[i] = 0;
+    tss->rsp0 = rsp0;
+    tss->iomap_base = sizeof(struct tss_entry);
 
     // Setup TSS descriptor in GDT
-    uint64_t tss_base = (uint64_t)&tss;
+    uint64_t tss_base = (uint64_t)tss;
     uint16_t tss_limit = sizeof(struct tss_entry) - 1;
     uint8_t *desc = (uint8_t *)&gdt[5];
     desc[0] = tss_limit & 0xFF;
@@ -90,7 +84,35 @@ void gdt_init(void) {
     desc[14] = 0;
     desc[15] = 0;
 
-    gdt_flush((uint64_t)&gp);
+    gdt_flush((uint64_t)&gps[cpu]);
     tss_flush();
+}
+
+void gdt_init(void) {
+    serial_write("GDT: Initializing...\n", 22);
+    extern uint8_t kernel_stack_top[];
+    gdt_setup(0, (uint64_t)kernel_stack_top);
+
+    struct gdt_entry* gdt = gdts[0];
+    serial_write("User code GDT[3]: access=0x", 28);
+    serial_print_hex(gdt[3].access);
+    serial_write(" gran=0x", 9);
+    serial_print_hex(gdt[3].granularity);
+    serial_write("\n", 1);
+    serial_write("User data GDT[4]: access=0x", 28);
+    serial_print_hex(gdt[4].access);
+    serial_write(" gran=0x", 9);
+    serial_print_hex(gdt[4].granularity);
+    serial_write("\n", 1);
     serial_write("GDT: Initialized\n", 17);
 }
+
+void gdt_init_cpu(unsigned int cpu) {
+    // Nothing comes from user mode before the scheduler sets rsp0
+    gdt_setup(cpu, 0);
+}
+
+// Interrupts from user mode switch to this stack (TSS.rsp0)
+void gdt_set_kernel_stack(uint64_t rsp0) {
+    tsss[cpu_current_id()].rsp0 = rsp0;
+}
@@ -34,6 +34,11 @@ struct __attribute__((packed)) tss_entry {
     uint16_t iomap_base;
 };
 
+// Sets up and loads the bootstrap processor's GDT and TSS
 void gdt_init(void);
+// Same for an application processor, given its CPU index
+void gdt_init_cpu(unsigned int cpu);
+// Sets the stack this CPU switches to on an interrupt from user mode
+void gdt_set_kernel_stack(uint64_t rsp0);
 
 #endif // GDT_H
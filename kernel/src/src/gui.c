@@ -1,19 +1,17 @@
 #include "gui.h"
+#include "vmm.h"
 #include <stddef.h>
 #include <string.h>
 
-#define GUI_MAX_WIDTH 1920
-#define GUI_MAX_HEIGHT 1200
-
-static uint32_t gui_backbuffer[GUI_MAX_WIDTH * GUI_MAX_HEIGHT];
-
 void gui_init(struct gui_context *ctx, struct Framebuffer fb) {
     if (!ctx) return;
     ctx->fb = (uint32_t*)fb.base_address;
     ctx->width = fb.width;
     ctx->height = fb.height;
     ctx->pitch = fb.pixels_per_scan_line;
-    ctx->backbuffer = gui_backbuffer;
+    // Several MiB for a full-screen buffer: back it with 2MiB pages
+    ctx->backbuffer = vmm_alloc_kernel_buffer((uint64_t)fb.width * fb.height * sizeof(uint32_t),
+                                             MEMSTAT_GUI);
 }
 
 void gui_fill_rect(struct gui_context *ctx, int x, int y, int w, int h, uint32_t color) {
@@ -3,6 +3,11 @@
 #include "lib/string.h"
 #include <stdbool.h> // Include for bool type
 #include "vmm.h"     // Include for pml4_t and vmm function prototypes
+#include "sched.h"   // For sched_exit
+#include "timer.h"   // For timer_interrupt
+#include "apic.h"    // For the interrupt vectors
+#include "smp.h"     // For kernel_lock and smp_tlb_interrupt
+#include "uaccess.h" // For uaccess_fixup
 
 // Declare the IDT array (256 entries)
 static struct idt_entry idt_entries[256];
@@ -31,8 +36,33 @@ extern struct flanterm_context *ft_ctx;
 extern void flanterm_write(struct flanterm_context *ctx, const char *buf, size_t count);
 extern void flanterm_flush(struct flanterm_context *ctx);
 
-// C-level ISR handler called by assembly stubs
-void isr_handler(struct registers *regs) {
+// Handles a CPU exception
+static void isr_exception(struct registers *regs) {
+    // A fault inside a user-access window arrives with RFLAGS.AC set; the
+    // handler does not need it and iretq restores it
+    uaccess_end();
+
+    // Demand paging: a fault on a not-yet-populated page of a user memory area
+    // is resolved here and the access retried
+    if (regs->int_no == 14) {
+        uint64_t fault_addr;
+        asm volatile("mov %%cr2, %0" : "=r" (fault_addr));
+        if (vmm_handle_page_fault(fault_addr, regs->err_code)) {
+            return;
+        }
+        // A user-access helper hit a bad address: resume at its fixup,
+        // which reports the error to the syscall
+        if (uaccess_fixup(regs)) {
+            return;
+        }
+        // A syscall touching an invalid user address is the process's
+        // fault, not the kernel's
+        if (fault_addr < VMM_KERNEL_HALF &&
+            vmm_get_current_address_space() != &g_kernel_address_space) {
+            regs->err_code |= PF_ERR_USER;
+        }
+    }
+
     // If the fault is from user mode, try to recover by returning to the shell
     // Check the User/Supervisor bit in the error code for PF, or CS selector for others
     bool user_fault = false;
@@ -62,25 +92,11 @@ void isr_handler(struct registers *regs) {
         flanterm_flush(ft_ctx);
         serial_write(fault_msg, strlen(fault_msg)); // Also log to serial
 
-        // Clean up? (e.g., free process memory - requires process management)
-        // For now, we just abandon the process state.
-
-        // Restore kernel address space
-        if (!g_kernel_pml4) {
-            serial_write("[ISR_HANDLER] FATAL: g_kernel_pml4 is NULL!\n", 46);
-            goto halt_system; // Cannot recover without kernel PML4
-        }
-        serial_write("[ISR_HANDLER] Switching back to kernel PML4\n", 42);
-        vmm_switch_address_space(g_kernel_pml4); 
-
-        // Re-enable interrupts and jump to shell
-        serial_write("[ISR_HANDLER] Enabling interrupts and running shell\n", 51);
-        asm volatile ("sti");
-        shell_run();
-
-        // Should not be reached if shell_run loops indefinitely
-        serial_write("[ISR_HANDLER] shell_run returned?! Halting.\n", 44);
-        goto halt_system;
+        // Kill the process; sched_exit frees its memory and runs the next
+        // one. The exit code is 128 + vector, like a shell reports a fatal
+        // signal.
+        serial_write("[ISR_HANDLER] Terminating user process\n", 39);
+        sched_exit(128 + (int64_t)regs->int_no);
     }
 
     // --- Kernel Mode Fault or Unhandled Interrupt --- 
@@ -118,12 +134,40 @@ void isr_handler(struct registers *regs) {
     serial_write("    R8: 0x", 10); serial_print_hex(regs->r8);  serial_write("  R9: 0x", 7); serial_print_hex(regs->r9);  serial_write(" R10: 0x", 7); serial_print_hex(regs->r10); serial_write(" R11: 0x", 7); serial_print_hex(regs->r11); serial_write("\n", 1);
     serial_write("   R12: 0x", 10); serial_print_hex(regs->r12); serial_write(" R13: 0x", 7); serial_print_hex(regs->r13); serial_write(" R14: 0x", 7); serial_print_hex(regs->r14); serial_write(" R15: 0x", 7); serial_print_hex(regs->r15); serial_write("\n", 1);
 
-halt_system: // Moved label here so it's reachable from the user fault path too
     serial_write("System Halted.\n", 15);
     // Halt the system
     asm volatile ("cli; hlt");
 }
 
+// C-level ISR handler called by assembly stubs
+void isr_handler(struct registers *regs) {
+    switch (regs->int_no) {
+    case LAPIC_TIMER_VECTOR:
+        timer_interrupt(regs);
+        return;
+    case IPI_RESCHEDULE_VECTOR:
+        // Only wakes the CPU from hlt; the idle loop does the rest
+        lapic_eoi();
+        return;
+    case IPI_TLB_SHOOTDOWN_VECTOR:
+        smp_tlb_interrupt();
+        return;
+    case LAPIC_SPURIOUS_VECTOR:
+        return;
+    }
+
+    // An exception from user mode enters the kernel like a syscall does;
+    // in kernel mode the lock is already held
+    bool from_user = regs->cs == USER_CODE_SELECTOR;
+    if (from_user) {
+        kernel_lock();
+    }
+    isr_exception(regs);
+    if (from_user) {
+        kernel_unlock();
+    }
+}
+
 // Initialize the IDT
 void idt_init(void) {
     serial_write("IDT: Initializing...\n", 23);
@@ -139,6 +183,10 @@ void idt_init(void) {
     // Use IDT_TA_InterruptGate for interrupts/exceptions
     idt_set_gate(13, (uint64_t)isr13, 0x08, IDT_TA_InterruptGate);
     idt_set_gate(14, (uint64_t)isr14, 0x08, IDT_TA_InterruptGate);
+    idt_set_gate(LAPIC_TIMER_VECTOR, (uint64_t)isr48, 0x08, IDT_TA_InterruptGate);
+    idt_set_gate(IPI_RESCHEDULE_VECTOR, (uint64_t)isr49, 0x08, IDT_TA_InterruptGate);
+    idt_set_gate(IPI_TLB_SHOOTDOWN_VECTOR, (uint64_t)isr50, 0x08, IDT_TA_InterruptGate);
+    idt_set_gate(LAPIC_SPURIOUS_VECTOR, (uint64_t)isr255, 0x08, IDT_TA_InterruptGate);
 
     // Add other ISRs here if needed
 
@@ -147,3 +195,8 @@ void idt_init(void) {
 
     serial_write("IDT: Loaded.\n", 14);
 }
+
+// The IDT is the same for every CPU
+void idt_init_cpu(void) {
+    idt_load(&idt_pointer);
+}
@@ -35,11 +35,17 @@ struct registers {
 
 // Function Declarations
 extern void idt_init(void);
+// Loads the IDT idt_init built on an application processor
+extern void idt_init_cpu(void);
 extern void isr_handler(struct registers *regs);
 
 // Declare the external assembly ISR stubs (will be defined in isr_stubs.asm)
 // We need stubs for the exceptions we want to handle.
 extern void isr13(void); // General Protection Fault (#GP)
 extern void isr14(void); // Page Fault (#PF)
+extern void isr48(void); // Local APIC timer
+extern void isr49(void); // Reschedule IPI
+extern void isr50(void); // TLB shootdown IPI
+extern void isr255(void); // Local APIC spurious interrupt
 
 // Add declarations for other ISRs if needed
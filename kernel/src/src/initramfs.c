@@ -1,4 +1,5 @@
 #include "initramfs.h"
+#include "slab.h"
 #include <stddef.h>
 #include <stdint.h>
 #include <string.h>
@@ -9,7 +10,7 @@
 static const void *ramfs_base = NULL;
 static size_t ramfs_len = 0;
 
-static struct initramfs_file files[16];
+static struct initramfs_file *files = NULL;
 static size_t file_count = 0;
 
 static uint32_t hex2u32(const char *s, size_t n) {
@@ -24,14 +25,14 @@ static uint32_t hex2u32(const char *s, size_t n) {
     return v;
 }
 
-void initramfs_init(const void *base, size_t len) {
-    ramfs_base = base;
-    ramfs_len = len;
-    file_count = 0;
-    const uint8_t *p = (const uint8_t *)base;
-    const uint8_t *end = p + len;
+// Walks the archive and returns the number of entries, storing them in out
+// unless it is NULL
+static size_t initramfs_scan(struct initramfs_file *out) {
+    size_t count = 0;
+    const uint8_t *p = (const uint8_t *)ramfs_base;
+    const uint8_t *end = p + ramfs_len;
 
-    while (p + 110 < end && file_count < 16) {
+    while (p + 110 < end) {
         // Check header magic
         if (memcmp(p, CPIO_NEWC_MAGIC, 6) != 0) {
             // Optional: Print error or break differently if magic fails mid-archive
@@ -66,14 +67,32 @@ void initramfs_init(const void *base, size_t len) {
         }
 
         // Store file info (already checked it's not the trailer)
-        files[file_count].name = name;
-        files[file_count].data = filedata;
-        files[file_count].size = filesize;
-        file_count++;
+        if (out) {
+            out[count].name = name;
+            out[count].data = filedata;
+            out[count].size = filesize;
+        }
+        count++;
 
         // Advance pointer to the start of the next header
         p = (const uint8_t *)next_header_start_aligned;
     }
+    return count;
+}
+
+void initramfs_init(const void *base, size_t len) {
+    ramfs_base = base;
+    ramfs_len = len;
+    kfree(files);
+    files = NULL;
+    file_count = 0;
+
+    // Count first so the table is sized to the archive
+    size_t count = initramfs_scan(NULL);
+    if (count == 0) return;
+    files = kmalloc(count * sizeof(*files));
+    if (!files) return;
+    file_count = initramfs_scan(files);
 }
 
 const struct initramfs_file *initramfs_find(const char *name) {
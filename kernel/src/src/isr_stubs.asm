@@ -3,7 +3,7 @@
 
 section .text
 global idt_load
-global isr13, isr14 ; Declare the ISRs we are defining
+global isr13, isr14, isr48, isr49, isr50, isr255 ; Declare the ISRs we are defining
 extern isr_handler    ; External C handler function
 
 ; Macro to define ISR stubs that push an error code (if provided by CPU)
@@ -31,9 +31,19 @@ isr%1:
 ; Define specific ISRs
 ISR_ERRCODE 13 ; #GP General Protection Fault (Error code pushed by CPU)
 ISR_ERRCODE 14 ; #PF Page Fault (Error code pushed by CPU)
+ISR_NOERRCODE 48 ; Local APIC timer
+ISR_NOERRCODE 49 ; Reschedule IPI
+ISR_NOERRCODE 50 ; TLB shootdown IPI
+ISR_NOERRCODE 255 ; Local APIC spurious interrupt
 
 ; Common stub for all ISRs
 isr_common_stub:
+  ; From user mode (RPL 3 in the saved CS), switch GS to the kernel's
+  test qword [rsp + 24], 3
+  jz .from_kernel
+  swapgs
+.from_kernel:
+
   ; Save general purpose registers (order matches struct registers in idt.h)
   push rax
   push rbx
@@ -75,6 +85,12 @@ isr_common_stub:
   ; Clean up the pushed interrupt number and error code
   add rsp, 16
 
+  ; Going back to user mode, give it back its GS
+  test qword [rsp + 8], 3
+  jz .to_kernel
+  swapgs
+.to_kernel:
+
   ; Return from interrupt
   iretq
 
@@ -12,13 +12,23 @@
 #include "serial.h"
 #include "syscall.h"
 #include "vmm.h"
+#include "slab.h"
 #include "gui.h"
+#include "sched.h"
+#include "timer.h"
+#include "smp.h"
 
 struct flanterm_context *ft_ctx;
 struct gui_context gui_ctx;
 
 #define SHELL_BUFSZ 256
 
+// flanterm frees with the allocation size; kfree finds it itself
+static void flanterm_kfree(void *ptr, size_t size) {
+    (void)size;
+    kfree(ptr);
+}
+
 // Reference to the module request defined in main.c
 extern volatile struct limine_module_request module_request;
 
@@ -28,11 +38,22 @@ void kernel(struct Framebuffer framebuffer) {
     // Initialize Memory Management (PMM and VMM)
     pmm_init();
     vmm_init(); // Initialize VMM and store kernel PML4
+    kmem_init(); // Kernel heap (kmalloc) on top of the PMM
+
+    // Remap the framebuffer through the kernel window so it is covered by
+    // 2MiB pages. PAT|PWT selects PAT entry 5, which Limine sets to
+    // write-combining.
+    uint64_t fb_size = (uint64_t)framebuffer.pixels_per_scan_line * 4 * framebuffer.height;
+    void *fb_virt = vmm_map_physical(virt_to_phys(framebuffer.base_address), fb_size,
+                                     PTE_PRESENT | PTE_WRITABLE | PTE_NX | PTE_PAT | PTE_WRITE_THROUGH);
+    if (fb_virt) {
+        framebuffer.base_address = fb_virt;
+    }
 
     // Initialize CPU syscall MSRs (EFER, STAR, LSTAR, FMASK)
     cpu_init();
     ft_ctx = flanterm_fb_init(
-        NULL, NULL,
+        kmalloc, flanterm_kfree,
         (uint32_t*)framebuffer.base_address,
         framebuffer.width,
         framebuffer.height,
@@ -50,6 +71,11 @@ void kernel(struct Framebuffer framebuffer) {
     );
     gui_init(&gui_ctx, framebuffer);
     syscall_init();
+    // The shell becomes the kernel task; user programs are scheduled
+    // around it on timer ticks, on every CPU
+    sched_init();
+    timer_init();
+    smp_init();
     const char msg[] = "Welcome to limine-shell (flanterm)!\n";
     flanterm_write(ft_ctx, msg, sizeof(msg)-1);
     serial_write(msg, sizeof(msg)-1);
@@ -100,12 +126,12 @@ void kernel(struct Framebuffer framebuffer) {
             fs_init();
             // List files at boot
             size_t nfiles = 0;
-            const struct fs_file *files = fs_list(&nfiles);
+            const struct fs_file *const *files = fs_list(&nfiles);
             flanterm_write(ft_ctx, "[initramfs: files: ", 18);
             serial_write("[initramfs: files: ", 18);
             for (size_t i = 0; i < nfiles; ++i) {
-                flanterm_write(ft_ctx, files[i].name, strlen(files[i].name));
-                serial_write(files[i].name, strlen(files[i].name));
+                flanterm_write(ft_ctx, files[i]->name, strlen(files[i]->name));
+                serial_write(files[i]->name, strlen(files[i]->name));
                 if (i < nfiles - 1)
                     flanterm_write(ft_ctx, ", ", 2);
                     serial_write(", ", 2);
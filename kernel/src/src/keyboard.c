@@ -2,6 +2,10 @@
 #include <stddef.h>
 #include <stdbool.h>
 #include "keyboard.h"
+#include "vmm.h" // For pmm_zero_idle_work
+#include "ksm.h"
+#include "smp.h"
+#include "sched.h"
 
 // Basic PS/2 keyboard polling for x86_64
 #define KEYBOARD_DATA_PORT 0x60
@@ -50,7 +54,21 @@ static const char scancode_set1_shift[128] = {
 };
 
 char keyboard_read_char(void) {
-    while (!keyboard_has_data());
+    // Nothing to do but wait for a key: let other processes run, or else
+    // use the time to pre-zero frames, then to merge identical user pages.
+    // In between, the other CPUs get a turn at the kernel lock, and with
+    // no work left this CPU halts until the next tick.
+    while (!keyboard_has_data()) {
+        if (sched_yield()) {
+            continue;
+        }
+        bool worked = pmm_zero_idle_work() || ksm_idle_work();
+        kernel_unlock();
+        if (!worked) {
+            asm volatile("sti; hlt; cli" : : : "memory");
+        }
+        kernel_lock();
+    }
     uint8_t sc = inb(KEYBOARD_DATA_PORT);
     
     // Handle key release (bit 7 set)
@@ -0,0 +1,212 @@
+#include "ksm.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "memstat.h"
+#include "lib/string.h"
+
+// Pages scanned per ksm_idle_work call, so a key press is never kept
+// waiting for more than a few page hashes
+#define KSM_PAGES_PER_CALL 16
+// Pause between full passes (TSC cycles), so an idle system with nothing
+// new to merge does not rescan continuously
+#define KSM_PASS_INTERVAL 2000000000ULL
+#define KSM_TABLE_SIZE 512
+
+// A page seen during the scan. Merged frames live in the stable table,
+// indexed by content hash; pages seen once in this pass wait in the
+// unstable table for a twin. Both are direct-mapped: a newer entry simply
+// replaces an older one with the same index. phys == 0 marks a free slot.
+struct ksm_entry {
+    uint64_t hash;
+    uint64_t phys;
+    struct address_space* as; // Unstable entries only
+    uint64_t page;
+};
+
+static struct ksm_entry ksm_stable[KSM_TABLE_SIZE];
+static struct ksm_entry ksm_unstable[KSM_TABLE_SIZE];
+
+static bool ksm_enabled = false;
+static unsigned int ksm_cursor_as = 0; // Address space slot being scanned
+static uint64_t ksm_cursor_page = 0;   // Next page to look at in it
+static uint64_t ksm_pass_end = 0;      // TSC at the end of the last pass, 0 = not waiting
+static struct ksm_stats ksm_stats;
+
+void ksm_set_enabled(bool enabled) {
+    ksm_enabled = enabled;
+}
+
+bool ksm_is_enabled(void) {
+    return ksm_enabled;
+}
+
+// FNV-1a over the frame's words; also reports whether it is all zeros
+static uint64_t ksm_hash_frame(uint64_t phys, bool* zero) {
+    const uint64_t* words = phys_to_virt(phys);
+    uint64_t hash = 14695981039346656037ULL;
+    uint64_t bits = 0;
+    for (unsigned int i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        hash = (hash ^ words[i]) * 1099511628211ULL;
+        bits |= words[i];
+    }
+    *zero = bits == 0;
+    return hash;
+}
+
+static bool ksm_same(uint64_t a, uint64_t b) {
+    return memcmp(phys_to_virt(a), phys_to_virt(b), PAGE_SIZE) == 0;
+}
+
+// Only private user frames are merged: shared ones (fork, page cache) and
+// the zero frame already save what they can
+static bool ksm_candidate(uint64_t phys) {
+    return pmm_get_category((void*)phys) == MEMSTAT_USER && pmm_frame_sharers((void*)phys) == 0;
+}
+
+// True if the page recorded in an unstable entry still maps the same
+// private frame
+static bool ksm_unstable_valid(const struct ksm_entry* entry) {
+    if (!entry->as->in_use) {
+        return false;
+    }
+    pte_t* pte = vmm_get_user_pte(entry->as, entry->page);
+    return pte && (*pte & PTE_PRESENT) && (*pte & PTE_ADDR_MASK) == entry->phys &&
+           ksm_candidate(entry->phys);
+}
+
+static bool ksm_merge(struct address_space* as, uint64_t page, uint64_t phys);
+
+static void ksm_scan_page(struct address_space* as, uint64_t page) {
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (!pte) {
+        // No page table: nothing is mapped up to the next 2MiB boundary
+        ksm_cursor_page = (page | (PAGE_SIZE_2M - 1)) + 1;
+        return;
+    }
+    if (!(*pte & PTE_PRESENT)) {
+        return;
+    }
+    uint64_t phys = *pte & PTE_ADDR_MASK;
+    if (!ksm_candidate(phys)) {
+        return;
+    }
+    ksm_stats.scanned++;
+
+    // A store from another CPU between comparing and remapping would be
+    // lost: the page stays read-only while its contents are looked at
+    uint64_t old_pte = vmm_write_protect(as, page);
+    if (!ksm_merge(as, page, phys)) {
+        vmm_write_restore(as, page, old_pte);
+    }
+}
+
+// Merges the write-protected page at `page` if its contents are known;
+// otherwise records it as a candidate and returns false
+static bool ksm_merge(struct address_space* as, uint64_t page, uint64_t phys) {
+    bool zero;
+    uint64_t hash = ksm_hash_frame(phys, &zero);
+    if (zero) {
+        if (vmm_merge_page(as, page, phys, 0)) {
+            ksm_stats.zero_merged++;
+            return true;
+        }
+        return false;
+    }
+
+    // A merged frame with these contents? Its category tells whether the
+    // frame is still one: freeing resets it, and a last owner writing to it
+    // takes it back as a private page.
+    struct ksm_entry* stable = &ksm_stable[hash % KSM_TABLE_SIZE];
+    if (stable->phys && stable->hash == hash &&
+        pmm_get_category((void*)stable->phys) == MEMSTAT_KSM && ksm_same(stable->phys, phys)) {
+        if (vmm_merge_page(as, page, phys, stable->phys)) {
+            ksm_stats.merged++;
+            return true;
+        }
+        return false;
+    }
+
+    // A page seen earlier in this pass with the same contents? Its frame
+    // becomes the merged frame for both, so it is write-protected for good
+    // before the comparison.
+    struct ksm_entry* unstable = &ksm_unstable[hash % KSM_TABLE_SIZE];
+    if (unstable->phys && unstable->phys != phys && unstable->hash == hash &&
+        ksm_unstable_valid(unstable)) {
+        uint64_t twin_pte = vmm_write_protect(unstable->as, unstable->page);
+        if (ksm_same(unstable->phys, phys)) {
+            pmm_set_category((void*)unstable->phys, 0, MEMSTAT_KSM);
+            bool merged = vmm_merge_page(as, page, phys, unstable->phys);
+            if (merged) {
+                ksm_stats.merged++;
+            }
+            stable->hash = hash;
+            stable->phys = unstable->phys;
+            unstable->phys = 0;
+            return merged;
+        }
+        vmm_write_restore(unstable->as, unstable->page, twin_pte);
+    }
+
+    unstable->hash = hash;
+    unstable->phys = phys;
+    unstable->as = as;
+    unstable->page = page;
+    return false;
+}
+
+// Advances the cursor to the next page inside an area. Returns false at the
+// end of a pass.
+static bool ksm_next_page(struct address_space** as_out, uint64_t* page_out) {
+    while (ksm_cursor_as < VMM_MAX_ADDRESS_SPACES) {
+        struct address_space* as = vmm_get_address_space(ksm_cursor_as);
+        for (unsigned int i = 0; as && i < as->area_count; i++) {
+            const struct vmm_area* area = &as->areas[i];
+            if (area->end > ksm_cursor_page) {
+                uint64_t page = area->start > ksm_cursor_page ? area->start : ksm_cursor_page;
+                ksm_cursor_page = page + PAGE_SIZE;
+                *as_out = as;
+                *page_out = page;
+                return true;
+            }
+        }
+        ksm_cursor_as++;
+        ksm_cursor_page = 0;
+    }
+
+    // Pages left unpaired in this pass may have changed by the next one
+    ksm_cursor_as = 0;
+    memset(ksm_unstable, 0, sizeof(ksm_unstable));
+    ksm_stats.full_scans++;
+    ksm_pass_end = cpu_rdtsc();
+    return false;
+}
+
+bool ksm_idle_work(void) {
+    if (!ksm_enabled) {
+        return false;
+    }
+    if (ksm_pass_end != 0) {
+        if (cpu_rdtsc() - ksm_pass_end < KSM_PASS_INTERVAL) {
+            return false;
+        }
+        ksm_pass_end = 0;
+    }
+
+    for (unsigned int n = 0; n < KSM_PAGES_PER_CALL; n++) {
+        struct address_space* as;
+        uint64_t page;
+        if (!ksm_next_page(&as, &page)) {
+            break;
+        }
+        // Page tables are not locked; keep interrupt handlers off them
+        uint64_t irq_flags = cpu_irq_save();
+        ksm_scan_page(as, page);
+        cpu_irq_restore(irq_flags);
+    }
+    return true;
+}
+
+void ksm_get_stats(struct ksm_stats* stats) {
+    *stats = ksm_stats;
+    stats->shared = memstat_read(MEMSTAT_KSM);
+}
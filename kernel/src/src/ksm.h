@@ -0,0 +1,29 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Same-page merging ---
+
+// An optional scanner that walks the private pages of every user address
+// space while the CPU is idle, hashes them, and maps pages with identical
+// contents to one read-only frame shared copy-on-write (the first write
+// gives the writer its own copy again). All-zero pages are merged into the
+// VMM's shared zero frame. It is off until ksm_set_enabled(true).
+
+struct ksm_stats {
+    uint64_t scanned;     // Pages looked at
+    uint64_t merged;      // Pages remapped to an identical merged frame
+    uint64_t zero_merged; // Pages remapped to the zero frame
+    uint64_t full_scans;  // Completed passes over all address spaces
+    uint64_t shared;      // Merged frames currently in use
+};
+
+void ksm_set_enabled(bool enabled);
+bool ksm_is_enabled(void);
+
+// Scans a small batch of pages. Meant to be called from idle loops, like
+// pmm_zero_idle_work; returns true if there was work to do.
+bool ksm_idle_work(void);
+
+void ksm_get_stats(struct ksm_stats *stats);
@@ -0,0 +1,153 @@
+#include "lz.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "lib/string.h"
+
+#define LZ_MIN_MATCH 4
+#define LZ_LAST_LITERALS 5   // The format ends every block with literals
+#define LZ_MAX_OFFSET 65535
+#define LZ_MAX_INPUT 65536
+#define LZ_HASH_BITS 12
+
+// Last position (plus one, 0 = none) at which each hashed 4-byte sequence
+// was seen. Shared, so compression is serialized by lz_lock.
+static uint32_t lz_table[1 << LZ_HASH_BITS];
+static spinlock_t lz_lock = SPINLOCK_INIT;
+
+static inline uint32_t lz_read32(const uint8_t* p) {
+    uint32_t v;
+    memcpy(&v, p, sizeof(v));
+    return v;
+}
+
+static inline uint32_t lz_hash(uint32_t seq) {
+    return (seq * 2654435761u) >> (32 - LZ_HASH_BITS);
+}
+
+// Writes the bytes that extend a length nibble of 15
+static uint8_t* lz_put_length(uint8_t* op, uint8_t* oend, size_t len) {
+    while (len >= 255) {
+        if (op >= oend) return NULL;
+        *op++ = 255;
+        len -= 255;
+    }
+    if (op >= oend) return NULL;
+    *op++ = (uint8_t)len;
+    return op;
+}
+
+// Emits one sequence; match_len 0 marks the final, literals-only one.
+// Returns the new output position or NULL if dst is full.
+static uint8_t* lz_emit(uint8_t* op, uint8_t* oend, const uint8_t* lit, size_t lit_len,
+                        size_t offset, size_t match_len) {
+    if (op >= oend) return NULL;
+    uint8_t* token = op++;
+    uint8_t lit_nibble = lit_len >= 15 ? 15 : (uint8_t)lit_len;
+    if (lit_nibble == 15 && !(op = lz_put_length(op, oend, lit_len - 15))) {
+        return NULL;
+    }
+    if (lit_len > (size_t)(oend - op)) return NULL;
+    memcpy(op, lit, lit_len);
+    op += lit_len;
+    if (match_len == 0) {
+        *token = (uint8_t)(lit_nibble << 4);
+        return op;
+    }
+
+    if (oend - op < 2) return NULL;
+    *op++ = (uint8_t)offset;
+    *op++ = (uint8_t)(offset >> 8);
+    size_t extra = match_len - LZ_MIN_MATCH;
+    uint8_t match_nibble = extra >= 15 ? 15 : (uint8_t)extra;
+    if (match_nibble == 15 && !(op = lz_put_length(op, oend, extra - 15))) {
+        return NULL;
+    }
+    *token = (uint8_t)((lit_nibble << 4) | match_nibble);
+    return op;
+}
+
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap) {
+    if (len > LZ_MAX_INPUT) {
+        return 0;
+    }
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_cap;
+    size_t limit = len > LZ_LAST_LITERALS ? len - LZ_LAST_LITERALS : 0;
+    size_t ip = 0, anchor = 0;
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&lz_lock);
+    memset(lz_table, 0, sizeof(lz_table));
+    while (op && ip + LZ_MIN_MATCH <= limit) {
+        uint32_t seq = lz_read32(src + ip);
+        uint32_t h = lz_hash(seq);
+        size_t ref = lz_table[h];
+        lz_table[h] = (uint32_t)ip + 1;
+        if (ref == 0 || ip - (ref - 1) > LZ_MAX_OFFSET || lz_read32(src + ref - 1) != seq) {
+            ip++;
+            continue;
+        }
+        ref--;
+        size_t match_len = LZ_MIN_MATCH;
+        while (ip + match_len < limit && src[ref + match_len] == src[ip + match_len]) {
+            match_len++;
+        }
+        op = lz_emit(op, oend, src + anchor, ip - anchor, ip - ref, match_len);
+        ip += match_len;
+        anchor = ip;
+    }
+    spin_unlock(&lz_lock);
+    cpu_irq_restore(irq_flags);
+
+    if (op) {
+        op = lz_emit(op, oend, src + anchor, len - anchor, 0, 0);
+    }
+    return op ? (size_t)(op - dst) : 0;
+}
+
+// Reads the bytes that extend a length nibble of 15; false on truncation
+static bool lz_get_length(const uint8_t** ip, const uint8_t* iend, size_t* len) {
+    uint8_t b;
+    do {
+        if (*ip >= iend) return false;
+        b = *(*ip)++;
+        *len += b;
+    } while (b == 255);
+    return true;
+}
+
+size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap) {
+    const uint8_t* ip = src;
+    const uint8_t* iend = src + len;
+    uint8_t* op = dst;
+    uint8_t* oend = dst + dst_cap;
+
+    while (ip < iend) {
+        uint8_t token = *ip++;
+        size_t lit_len = token >> 4;
+        if (lit_len == 15 && !lz_get_length(&ip, iend, &lit_len)) return 0;
+        if (lit_len > (size_t)(iend - ip) || lit_len > (size_t)(oend - op)) return 0;
+        memcpy(op, ip, lit_len);
+        op += lit_len;
+        ip += lit_len;
+        if (ip == iend) {
+            break; // The final sequence has no match
+        }
+
+        if (iend - ip < 2) return 0;
+        size_t offset = ip[0] | ((size_t)ip[1] << 8);
+        ip += 2;
+        if (offset == 0 || offset > (size_t)(op - dst)) return 0;
+        size_t match_len = token & 15;
+        if (match_len == 15 && !lz_get_length(&ip, iend, &match_len)) return 0;
+        match_len += LZ_MIN_MATCH;
+        if (match_len > (size_t)(oend - op)) return 0;
+        // Byte by byte: the match may overlap the bytes it produces
+        const uint8_t* match = op - offset;
+        for (size_t i = 0; i < match_len; i++) {
+            op[i] = match[i];
+        }
+        op += match_len;
+    }
+    return (size_t)(op - dst);
+}
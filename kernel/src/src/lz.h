@@ -0,0 +1,19 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+
+// --- LZ compression ---
+
+// A byte-oriented LZ77 codec in the LZ4 block format: sequences of a token
+// (literal count and match length nibbles), the literals, and a 16-bit match
+// offset. Greedy matching through one hash table probe per position keeps
+// it fast enough to run on the page reclaim path; inputs are at most 64KiB.
+
+// Compresses src into dst. Returns the compressed size, or 0 if it would
+// not fit in dst_cap bytes (the caller then keeps the data uncompressed).
+size_t lz_compress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap);
+
+// Decompresses src into dst. Returns the decompressed size, or 0 if the
+// input is malformed or would overflow dst_cap bytes.
+size_t lz_decompress(const uint8_t* src, size_t len, uint8_t* dst, size_t dst_cap);
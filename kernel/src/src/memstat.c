@@ -0,0 +1,38 @@
+#include "memstat.h"
+#include "vmm.h"
+#include "fs.h"
+#include "swap.h"
+#include "lib/string.h"
+
+struct memstat_cpu memstat_cpus[MAX_CPUS];
+
+uint64_t memstat_read(enum memstat_category cat) {
+    // A frame charged on one CPU may be uncharged on another, so only the
+    // sum is meaningful. It is not a consistent snapshot across categories,
+    // which is fine for reporting.
+    int64_t sum = 0;
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        sum += __atomic_load_n(&memstat_cpus[cpu].frames[cat], __ATOMIC_RELAXED);
+    }
+    return sum > 0 ? (uint64_t)sum : 0;
+}
+
+void memstat_get_meminfo(struct meminfo *info) {
+    memset(info, 0, sizeof(*info));
+    info->total = pmm_get_total_frames();
+    info->free = info->total - pmm_get_used_frames();
+    info->zero_pool = memstat_read(MEMSTAT_ZERO_POOL);
+    info->kernel = memstat_read(MEMSTAT_KERNEL);
+    info->page_tables = memstat_read(MEMSTAT_PAGE_TABLES);
+    info->user = memstat_read(MEMSTAT_USER);
+    info->page_cache = memstat_read(MEMSTAT_PAGE_CACHE);
+    info->slab = memstat_read(MEMSTAT_SLAB);
+    info->kmalloc_large = memstat_read(MEMSTAT_KMALLOC_LARGE);
+    info->gui = memstat_read(MEMSTAT_GUI);
+    info->ksm = memstat_read(MEMSTAT_KSM);
+    struct swap_stats swap;
+    swap_get_stats(&swap);
+    info->swap_total = swap.slots;
+    info->swap_used = swap.used;
+    info->file_data_bytes = fs_get_data_bytes();
+}
@@ -0,0 +1,65 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include "cpu.h"
+
+// --- Memory accounting ---
+
+// Every allocated frame is charged to one category. The PMM charges new
+// frames to MEMSTAT_KERNEL and remembers the category of each frame, so a
+// free always uncharges the right counter; owners that know better move
+// their frames with pmm_set_category. The counters are per CPU and only
+// summed when somebody asks, so keeping them costs one add per event.
+
+enum memstat_category {
+    MEMSTAT_KERNEL = 0,     // Everything not tagged otherwise
+    MEMSTAT_PAGE_TABLES,    // Paging structures of all address spaces
+    MEMSTAT_USER,           // Pages mapped into processes
+    MEMSTAT_PAGE_CACHE,     // Cached file pages
+    MEMSTAT_SLAB,           // Slab frames of the kernel heap
+    MEMSTAT_KMALLOC_LARGE,  // kmalloc blocks too big for a slab
+    MEMSTAT_ZERO_POOL,      // Pre-zeroed frames waiting in the PMM pool
+    MEMSTAT_GUI,            // GUI backbuffer
+    MEMSTAT_KSM,            // User pages merged by the same-page scanner
+    MEMSTAT_NR
+};
+
+struct memstat_cpu {
+    int64_t frames[MEMSTAT_NR]; // Net frames charged on this CPU; may go negative
+} __attribute__((aligned(64)));
+
+extern struct memstat_cpu memstat_cpus[MAX_CPUS];
+
+// Charges (or with a negative delta, uncharges) frames to a category. A single
+// read-modify-write instruction, so an interrupt cannot split it and no lock
+// is needed.
+static inline void memstat_add(enum memstat_category cat, int64_t delta) {
+    asm volatile("addq %1, %0"
+                 : "+m"(memstat_cpus[cpu_current_id()].frames[cat])
+                 : "er"(delta));
+}
+
+// Frames currently charged to a category, summed over all CPUs
+uint64_t memstat_read(enum memstat_category cat);
+
+// Snapshot for the meminfo builtin and SYS_MEMINFO. Counts are in frames
+// unless noted otherwise.
+struct meminfo {
+    uint64_t total;           // Frames managed by the PMM
+    uint64_t free;            // Free, in magazines or in the zero pool
+    uint64_t zero_pool;
+    uint64_t kernel;
+    uint64_t page_tables;
+    uint64_t user;
+    uint64_t page_cache;
+    uint64_t slab;
+    uint64_t kmalloc_large;
+    uint64_t gui;
+    uint64_t ksm;
+    uint64_t swap_total;      // Pages that fit in the swap areas
+    uint64_t swap_used;       // Pages currently swapped out
+    uint64_t file_data_bytes; // In-memory file contents (part of slab/kmalloc_large)
+};
+
+void memstat_get_meminfo(struct meminfo *info);
@@ -0,0 +1,150 @@
+#include "pagecache.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "lib/string.h"
+
+// Entries live in a fixed table and are chained per hash bucket by index.
+// A page is identified by the file, its file offset and the valid byte
+// range: two segments can place different bytes of the same file at the
+// same offset of a page (the zero-filled parts differ).
+#define PAGECACHE_BUCKETS 64
+#define PAGECACHE_NONE 0xFFFF
+
+struct pagecache_entry {
+    const void* file;     // NULL = slot unused
+    uint64_t offset;
+    uint64_t valid_start;
+    uint64_t valid_end;
+    void* frame;
+    uint16_t next;        // Next entry in the bucket
+};
+
+static struct pagecache_entry pagecache_entries[PAGECACHE_MAX_PAGES];
+static uint16_t pagecache_buckets[PAGECACHE_BUCKETS];
+static bool pagecache_initialized = false;
+static unsigned int pagecache_clock = 0; // Next slot to consider for eviction
+static struct pagecache_stats pagecache_stats;
+static spinlock_t pagecache_lock = SPINLOCK_INIT;
+
+static unsigned int pagecache_hash(const void* file, uint64_t offset) {
+    uint64_t h = ((uint64_t)file / 64 + offset / PAGE_SIZE) * 0x9E3779B97F4A7C15ULL;
+    return (unsigned int)(h >> 32) % PAGECACHE_BUCKETS;
+}
+
+static void pagecache_init(void) {
+    for (unsigned int i = 0; i < PAGECACHE_BUCKETS; i++) {
+        pagecache_buckets[i] = PAGECACHE_NONE;
+    }
+    pagecache_initialized = true;
+}
+
+// Unlinks entry i from its bucket and releases the cache's reference
+static void pagecache_remove(unsigned int i) {
+    struct pagecache_entry* entry = &pagecache_entries[i];
+    uint16_t* link = &pagecache_buckets[pagecache_hash(entry->file, entry->offset)];
+    while (*link != i) {
+        link = &pagecache_entries[*link].next;
+    }
+    *link = entry->next;
+    pmm_frame_release(entry->frame);
+    entry->file = NULL;
+    pagecache_stats.pages--;
+}
+
+// Finds a free slot, evicting a page no process maps if the table is full
+static int pagecache_free_slot(void) {
+    for (unsigned int n = 0; n < PAGECACHE_MAX_PAGES; n++) {
+        unsigned int i = pagecache_clock;
+        pagecache_clock = (pagecache_clock + 1) % PAGECACHE_MAX_PAGES;
+        if (!pagecache_entries[i].file) {
+            return i;
+        }
+        if (pmm_frame_sharers(pagecache_entries[i].frame) == 0) {
+            pagecache_remove(i);
+            pagecache_stats.evictions++;
+            return i;
+        }
+    }
+    return -1;
+}
+
+void* pagecache_get(const void* file, const uint8_t* file_data, uint64_t offset,
+                    uint64_t valid_start, uint64_t valid_end) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pagecache_lock);
+    if (!pagecache_initialized) {
+        pagecache_init();
+    }
+
+    unsigned int bucket = pagecache_hash(file, offset);
+    for (uint16_t i = pagecache_buckets[bucket]; i != PAGECACHE_NONE; i = pagecache_entries[i].next) {
+        struct pagecache_entry* entry = &pagecache_entries[i];
+        if (entry->file == file && entry->offset == offset &&
+            entry->valid_start == valid_start && entry->valid_end == valid_end &&
+            pmm_frame_share(entry->frame)) {
+            pagecache_stats.hits++;
+            spin_unlock(&pagecache_lock);
+            cpu_irq_restore(irq_flags);
+            return entry->frame;
+        }
+    }
+
+    pagecache_stats.misses++;
+    int slot = pagecache_free_slot();
+    void* frame = slot >= 0 ? pmm_alloc_frame() : NULL;
+    if (!frame) {
+        spin_unlock(&pagecache_lock);
+        cpu_irq_restore(irq_flags);
+        return NULL;
+    }
+    pmm_set_category(frame, 0, MEMSTAT_PAGE_CACHE);
+
+    // Fill the page: file bytes where the range is valid, zeros elsewhere
+    uint8_t* page = phys_to_virt((uint64_t)frame);
+    memset(page, 0, PAGE_SIZE);
+    uint64_t copy_start = valid_start > offset ? valid_start : offset;
+    uint64_t copy_end = valid_end < offset + PAGE_SIZE ? valid_end : offset + PAGE_SIZE;
+    if (copy_start < copy_end) {
+        memcpy(page + (copy_start - offset), file_data + copy_start, copy_end - copy_start);
+    }
+
+    // One reference for the cache, one for the caller
+    pmm_frame_share(frame);
+    struct pagecache_entry* entry = &pagecache_entries[slot];
+    entry->file = file;
+    entry->offset = offset;
+    entry->valid_start = valid_start;
+    entry->valid_end = valid_end;
+    entry->frame = frame;
+    entry->next = pagecache_buckets[bucket];
+    pagecache_buckets[bucket] = slot;
+    pagecache_stats.pages++;
+
+    spin_unlock(&pagecache_lock);
+    cpu_irq_restore(irq_flags);
+    return frame;
+}
+
+void pagecache_invalidate(const void* file) {
+    if (!file) {
+        return;
+    }
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pagecache_lock);
+    for (unsigned int i = 0; i < PAGECACHE_MAX_PAGES; i++) {
+        if (pagecache_entries[i].file == file) {
+            pagecache_remove(i);
+        }
+    }
+    spin_unlock(&pagecache_lock);
+    cpu_irq_restore(irq_flags);
+}
+
+void pagecache_get_stats(struct pagecache_stats* stats) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pagecache_lock);
+    *stats = pagecache_stats;
+    spin_unlock(&pagecache_lock);
+    cpu_irq_restore(irq_flags);
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+
+// --- Executable page cache ---
+
+// Read-only pages of executables, keyed by (file, file offset), so every
+// process running the same binary maps the same frames. The cache owns one
+// reference to each frame (see pmm_frame_share); each mapping owns another.
+// Pages no process maps any more are freed when the cache needs the slot or
+// the file changes.
+
+#define PAGECACHE_MAX_PAGES 256
+
+// Returns a frame holding the page at file offset `offset`: the bytes of
+// [valid_start, valid_end) come from file_data (the whole file), the rest of
+// the page is zero. The caller owns a reference and must drop it with
+// pmm_frame_release. Returns NULL if the cache is full of mapped pages or
+// memory ran out; the caller should then use a private copy.
+void* pagecache_get(const void* file, const uint8_t* file_data, uint64_t offset,
+                    uint64_t valid_start, uint64_t valid_end);
+
+// Drops every cached page of file (call when its contents change). Pages
+// still mapped stay with their processes until they exit.
+void pagecache_invalidate(const void* file);
+
+struct pagecache_stats {
+    uint64_t hits;      // Lookups served from the cache
+    uint64_t misses;    // Lookups that had to read the file
+    uint64_t evictions; // Unmapped pages freed to make room
+    uint64_t pages;     // Frames currently owned by the cache
+};
+void pagecache_get_stats(struct pagecache_stats* stats);
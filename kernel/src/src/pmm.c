@@ -0,0 +1,709 @@
+#include "vmm.h"
+#include "cpu.h"
+#include "memstat.h"
+#include "spinlock.h"
+#include "serial.h"
+#include "lib/string.h"
+#include <stdbool.h>
+#include <stddef.h>
+#include "limine.h" // Include Limine header for request structures
+
+// Extern declarations for Limine requests defined in main.c
+extern volatile struct limine_memmap_request memmap_request;
+extern volatile struct limine_kernel_address_request kernel_address_request;
+
+// --- Physical Memory Manager (PMM) ---
+
+// Binary buddy allocator. Free memory is kept as naturally aligned blocks of
+// 2^order frames on one free list per order. Allocation pops the smallest
+// block that fits and splits it down; freeing merges a block with its buddy
+// for as long as the buddy is free too, so both are O(PMM_MAX_ORDER).
+
+// Memory below 1MiB is never handed out (real-mode structures, BIOS data...)
+#define PMM_LOW_MEMORY_LIMIT 0x100000
+
+// Per-frame state byte. The first frame of a free block holds
+// PMM_FRAME_FREE | order; frames inside a free block hold 0. An allocated
+// frame holds its share count (owners beyond the first, see pmm_frame_share)
+// in the low bits, so it never looks like a free buddy. A frame sitting in
+// a magazine or the zero pool holds PMM_FRAME_CACHED, which carries the
+// free bit (so freeing it again is caught) without matching any order.
+// The array covers every frame up to the highest usable address and is
+// carved out of usable memory at boot, accessed through the HHDM.
+#define PMM_FRAME_FREE 0x80
+#define PMM_FRAME_CACHED (PMM_FRAME_FREE | 0x40)
+#define PMM_FRAME_SHARE_MAX 0x7F
+static uint8_t *pmm_frame_state = NULL;
+// Per-frame memstat category, set on the first frame of an allocated block.
+// Shares the carved region with the state array (it follows it).
+static uint8_t *pmm_frame_category = NULL;
+static uint64_t pmm_frame_state_phys = 0;
+static uint64_t pmm_frame_state_pages = 0;
+
+// Free blocks are linked through their own first bytes (accessed via HHDM),
+// so the free lists cost no memory beyond the state array.
+struct pmm_free_block {
+    struct pmm_free_block *next;
+    struct pmm_free_block *prev;
+};
+
+static struct pmm_free_block *pmm_free_lists[PMM_MAX_ORDER + 1];
+
+static uint64_t pmm_highest_address = 0;
+static uint64_t pmm_free_frames = 0;
+static uint64_t pmm_total_frames = 0; // Frames seeded into the allocator
+static bool pmm_initialized = false;
+
+// Protects the free lists, the frame state array and pmm_free_frames
+static spinlock_t pmm_lock = SPINLOCK_INIT;
+
+// Per-CPU magazines of order-0 frames in front of the buddy allocator. The
+// common alloc/free only touches the local magazine; the global lock is
+// taken once per PMM_MAGAZINE_BATCH frames to refill or drain it.
+#define PMM_MAGAZINE_SIZE 64
+#define PMM_MAGAZINE_BATCH 32
+
+struct pmm_magazine {
+    uint64_t count;
+    void* frames[PMM_MAGAZINE_SIZE];
+    struct pmm_magazine_stats stats;
+} __attribute__((aligned(64))); // One cache line boundary per CPU, no false sharing
+
+static struct pmm_magazine pmm_magazines[MAX_CPUS];
+
+// Pool of frames that are already zero-filled. pmm_zero_idle_work() tops it
+// up while the CPU would otherwise spin, so pmm_alloc_zeroed_frame() can
+// usually skip the memset on the caller's latency path. Frames in the pool
+// cannot carry list links (they must stay zero), hence the array.
+#define PMM_ZERO_POOL_SIZE 256
+
+static void* pmm_zero_pool[PMM_ZERO_POOL_SIZE];
+static size_t pmm_zero_pool_count = 0;
+static spinlock_t pmm_zero_lock = SPINLOCK_INIT;
+static struct pmm_zero_pool_stats pmm_zero_stats;
+
+// Called when the allocator runs dry, to free frames (e.g. by swapping)
+static pmm_reclaim_fn pmm_reclaim = NULL;
+static bool pmm_reclaiming = false;
+
+// Frames held back for the reclaim hook itself: storing a page on a
+// compressing swap device (zram) can need memory before any is freed
+#define PMM_RECLAIM_RESERVE 16
+static void* pmm_reserve[PMM_RECLAIM_RESERVE];
+static size_t pmm_reserve_count = 0;
+
+// --- Free list helpers ---
+
+static inline struct pmm_free_block *pmm_frame_to_block(uint64_t frame) {
+    return (struct pmm_free_block *)phys_to_virt(frame * PAGE_SIZE);
+}
+
+static inline uint64_t pmm_block_to_frame(struct pmm_free_block *block) {
+    return virt_to_phys(block) / PAGE_SIZE;
+}
+
+static void pmm_push_block(uint64_t frame, unsigned int order) {
+    struct pmm_free_block *block = pmm_frame_to_block(frame);
+    block->prev = NULL;
+    block->next = pmm_free_lists[order];
+    if (block->next) {
+        block->next->prev = block;
+    }
+    pmm_free_lists[order] = block;
+    pmm_frame_state[frame] = PMM_FRAME_FREE | order;
+}
+
+static void pmm_remove_block(struct pmm_free_block *block, unsigned int order) {
+    if (block->prev) {
+        block->prev->next = block->next;
+    } else {
+        pmm_free_lists[order] = block->next;
+    }
+    if (block->next) {
+        block->next->prev = block->prev;
+    }
+    pmm_frame_state[pmm_block_to_frame(block)] = 0;
+}
+
+// Adds the frames [start, end) to the free lists as the largest naturally
+// aligned blocks that fit. Seeding a whole memmap region costs a handful of
+// list insertions instead of one bitmap update per frame.
+static void pmm_seed_range(uint64_t start, uint64_t end) {
+    while (start < end) {
+        unsigned int order = PMM_MAX_ORDER;
+        while (order > 0 &&
+               ((start & ((1ULL << order) - 1)) != 0 || start + (1ULL << order) > end)) {
+            order--;
+        }
+        pmm_push_block(start, order);
+        pmm_free_frames += 1ULL << order;
+        start += 1ULL << order;
+    }
+}
+
+// Frame range [start, end) that must not be seeded
+struct pmm_range {
+    uint64_t start;
+    uint64_t end;
+};
+
+// Seeds [start, end) minus every range in excl
+static void pmm_seed_excluding(uint64_t start, uint64_t end, const struct pmm_range *excl, size_t count) {
+    for (size_t i = 0; i < count; i++) {
+        if (excl[i].start < end && excl[i].end > start) {
+            if (start < excl[i].start) pmm_seed_excluding(start, excl[i].start, excl + i + 1, count - i - 1);
+            if (excl[i].end < end) pmm_seed_excluding(excl[i].end, end, excl + i + 1, count - i - 1);
+            return;
+        }
+    }
+    if (start < end) {
+        pmm_seed_range(start, end);
+    }
+}
+
+// Usable frame range of a memmap entry, clipped to what the PMM may hand out.
+// Returns false if nothing usable remains.
+static bool pmm_entry_frames(const struct limine_memmap_entry *entry, uint64_t *start_frame, uint64_t *end_frame) {
+    if (entry->type != LIMINE_MEMMAP_USABLE) {
+        return false;
+    }
+    *start_frame = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE; // Align up
+    *end_frame = (entry->base + entry->length) / PAGE_SIZE; // Align down
+    if (*start_frame < PMM_LOW_MEMORY_LIMIT / PAGE_SIZE) *start_frame = PMM_LOW_MEMORY_LIMIT / PAGE_SIZE;
+    return *start_frame < *end_frame;
+}
+
+void pmm_init(void) {
+    // kmain and kernel() both call this; the second call must not hand out
+    // frames that were allocated in between.
+    if (pmm_initialized) {
+        return;
+    }
+
+    if (memmap_request.response == NULL) {
+        serial_write("PMM Error: No memory map response from Limine!\n", 47);
+        // TODO: Halt or handle error appropriately
+        for(;;);
+    }
+    if (kernel_address_request.response == NULL) {
+        serial_write("PMM Error: No kernel address response from Limine!\n", 51);
+        // TODO: Halt or handle error appropriately
+        for(;;);
+    }
+
+    struct limine_memmap_entry **entries = memmap_request.response->entries;
+    uint64_t entry_count = memmap_request.response->entry_count;
+
+    serial_write("PMM: Initializing...\n", 21);
+
+    // 1. Find the highest usable address; the frame metadata covers
+    // everything below it, however much RAM the machine has.
+    pmm_highest_address = 0;
+    for (uint64_t i = 0; i < entry_count; i++) {
+        uint64_t start_frame, end_frame;
+        if (pmm_entry_frames(entries[i], &start_frame, &end_frame) &&
+            end_frame * PAGE_SIZE > pmm_highest_address) {
+            pmm_highest_address = end_frame * PAGE_SIZE;
+        }
+    }
+    uint64_t max_frames = pmm_highest_address / PAGE_SIZE;
+
+    // 2. Work out which frames hold the kernel image so they are never seeded.
+    // Limine reports the kernel as its own memmap type, this is a safety net.
+    uint64_t kernel_phys_base = kernel_address_request.response->physical_base;
+    uint64_t kernel_virt_base = kernel_address_request.response->virtual_base;
+    extern uint8_t _kernel_end[]; // Symbol from linker script
+    uint64_t kernel_size = (uint64_t)_kernel_end - kernel_virt_base;
+    // Ensure a minimum size if the symbol isn't right or calculation is off
+    if (kernel_size == 0 || kernel_size > (512 * 1024 * 1024)) { // Sanity check (e.g., > 512MiB is suspicious)
+        serial_write("PMM Warning: Kernel size calculation seems off. Using 16MiB placeholder.\n", 73);
+        kernel_size = 16 * 1024 * 1024; // Use a 16MiB placeholder size
+    }
+    struct pmm_range excluded[2];
+    excluded[0].start = kernel_phys_base / PAGE_SIZE;
+    excluded[0].end = (kernel_phys_base + kernel_size + PAGE_SIZE - 1) / PAGE_SIZE;
+
+    // 3. Carve the frame state and category arrays out of the first usable
+    // region that can hold them. Usable memory is covered by the HHDM, so no
+    // extra mapping is needed to reach it.
+    pmm_frame_state_pages = (2 * max_frames + PAGE_SIZE - 1) / PAGE_SIZE;
+    pmm_frame_state_phys = 0;
+    for (uint64_t i = 0; i < entry_count; i++) {
+        uint64_t start_frame, end_frame;
+        if (!pmm_entry_frames(entries[i], &start_frame, &end_frame)) {
+            continue;
+        }
+        // Skip past the kernel image if it sits at the start of the region
+        if (start_frame >= excluded[0].start && start_frame < excluded[0].end) {
+            start_frame = excluded[0].end;
+        }
+        uint64_t limit = end_frame;
+        if (start_frame < excluded[0].start && excluded[0].start < end_frame) {
+            limit = excluded[0].start;
+        }
+        if (start_frame < limit && limit - start_frame >= pmm_frame_state_pages) {
+            pmm_frame_state_phys = start_frame * PAGE_SIZE;
+            break;
+        }
+    }
+    if (pmm_frame_state_phys == 0) {
+        serial_write("PMM Error: No usable region can hold the frame metadata!\n", 57);
+        for(;;);
+    }
+    excluded[1].start = pmm_frame_state_phys / PAGE_SIZE;
+    excluded[1].end = excluded[1].start + pmm_frame_state_pages;
+
+    serial_write("PMM: Frame metadata at phys 0x", 30);
+    serial_print_hex(pmm_frame_state_phys);
+    serial_write(", pages: ", 9);
+    serial_print_hex(pmm_frame_state_pages);
+    serial_write("\n", 1);
+
+    // 4. No frame is free until a usable region says so.
+    pmm_frame_state = (uint8_t *)phys_to_virt(pmm_frame_state_phys);
+    pmm_frame_category = pmm_frame_state + max_frames;
+    memset(pmm_frame_state, 0, 2 * max_frames);
+    for (unsigned int order = 0; order <= PMM_MAX_ORDER; order++) {
+        pmm_free_lists[order] = NULL;
+    }
+    pmm_free_frames = 0;
+
+    // 5. Seed the free lists one usable region at a time.
+    for (uint64_t i = 0; i < entry_count; i++) {
+        uint64_t start_frame, end_frame;
+        if (pmm_entry_frames(entries[i], &start_frame, &end_frame)) {
+            pmm_seed_excluding(start_frame, end_frame, excluded, 2);
+        }
+    }
+
+    pmm_total_frames = pmm_free_frames;
+    pmm_initialized = true;
+
+    serial_write("PMM: Initialization complete. Highest address: 0x", 49);
+    serial_print_hex(pmm_highest_address);
+    serial_write(", free frames: ", 15);
+    serial_print_hex(pmm_free_frames);
+    serial_write("\n", 1);
+}
+
+// --- Buddy core (callers hold pmm_lock) ---
+
+static uint64_t pmm_buddy_alloc(unsigned int order) {
+    // Smallest non-empty list that can satisfy the request
+    unsigned int current = order;
+    while (current <= PMM_MAX_ORDER && pmm_free_lists[current] == NULL) {
+        current++;
+    }
+    if (current > PMM_MAX_ORDER) {
+        return 0; // Out of memory
+    }
+
+    struct pmm_free_block *block = pmm_free_lists[current];
+    uint64_t frame = pmm_block_to_frame(block);
+    pmm_remove_block(block, current);
+
+    // Split down, returning the upper half of each split to the free lists
+    while (current > order) {
+        current--;
+        pmm_push_block(frame + (1ULL << current), current);
+    }
+
+    pmm_free_frames -= 1ULL << order;
+    return frame * PAGE_SIZE;
+}
+
+static void pmm_buddy_free(uint64_t phys_addr, unsigned int order) {
+    uint64_t frame = phys_addr / PAGE_SIZE;
+    pmm_free_frames += 1ULL << order;
+
+    // Merge with the buddy for as long as it is a free block of the same order
+    uint64_t max_frame = pmm_highest_address / PAGE_SIZE;
+    while (order < PMM_MAX_ORDER) {
+        uint64_t buddy = frame ^ (1ULL << order);
+        if (buddy >= max_frame || pmm_frame_state[buddy] != (PMM_FRAME_FREE | order)) {
+            break;
+        }
+        pmm_remove_block(pmm_frame_to_block(buddy), order);
+        frame &= ~(1ULL << order);
+        order++;
+    }
+
+    pmm_push_block(frame, order);
+}
+
+// Checks a block handed back by a caller; logs and returns false if invalid
+static bool pmm_check_free(uint64_t phys_addr, unsigned int order) {
+    if (order > PMM_MAX_ORDER || phys_addr % (PAGE_SIZE << order) != 0) {
+        serial_write("PMM Error: Attempted to free misaligned block 0x", 48);
+        serial_print_hex(phys_addr);
+        serial_write("\n", 1);
+        return false;
+    }
+    if (phys_addr < PMM_LOW_MEMORY_LIMIT || phys_addr + (PAGE_SIZE << order) > pmm_highest_address) {
+        serial_write("PMM Error: Attempted to free address outside managed range 0x", 61);
+        serial_print_hex(phys_addr);
+        serial_write("\n", 1);
+        return false;
+    }
+    if (pmm_frame_state[phys_addr / PAGE_SIZE] & PMM_FRAME_FREE) {
+        serial_write("PMM Warning: Attempted to double-free frame 0x", 46);
+        serial_print_hex(phys_addr);
+        serial_write("\n", 1);
+        return false;
+    }
+    return true;
+}
+
+// Drops the charge of a block being freed and resets its category, so the
+// next owner starts out as MEMSTAT_KERNEL
+static inline void pmm_uncharge(uint64_t phys_addr, unsigned int order) {
+    uint8_t *cat = &pmm_frame_category[phys_addr / PAGE_SIZE];
+    memstat_add((enum memstat_category)*cat, -(int64_t)(1ULL << order));
+    *cat = MEMSTAT_KERNEL;
+}
+
+// Marks a frame as entering (or leaving) a magazine or the zero pool
+static inline void pmm_set_cached(void* frame, bool cached) {
+    pmm_frame_state[(uint64_t)frame / PAGE_SIZE] = cached ? PMM_FRAME_CACHED : 0;
+}
+
+// --- Magazines ---
+
+// Returns every frame cached by this CPU's magazine to the buddy allocator
+static void pmm_magazine_flush(struct pmm_magazine *mag) {
+    spin_lock(&pmm_lock);
+    while (mag->count > 0) {
+        void* frame = mag->frames[--mag->count];
+        pmm_set_cached(frame, false);
+        pmm_buddy_free((uint64_t)frame, 0);
+    }
+    spin_unlock(&pmm_lock);
+}
+
+static void* pmm_magazine_alloc(void);
+
+// Tops the reclaim reserve back up, as far as free memory allows
+static void pmm_reserve_refill(void) {
+    while (pmm_reserve_count < PMM_RECLAIM_RESERVE) {
+        void* frame = pmm_magazine_alloc();
+        if (!frame) break;
+        pmm_reserve[pmm_reserve_count++] = frame;
+    }
+}
+
+// Asks the reclaim hook for frames; true if it freed any
+static bool pmm_try_reclaim(uint64_t frames) {
+    if (!pmm_reclaim || pmm_reclaiming) {
+        return false;
+    }
+    pmm_reclaiming = true;
+    bool freed = pmm_reclaim(frames) > 0;
+    pmm_reclaiming = false;
+    pmm_reserve_refill();
+    return freed;
+}
+
+void pmm_set_reclaim(pmm_reclaim_fn fn) {
+    pmm_reclaim = fn;
+    pmm_reserve_refill();
+}
+
+// One attempt at a block from the buddy allocator; returns 0 if none
+static uint64_t pmm_alloc_pages_once(unsigned int order) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_lock);
+    uint64_t phys_addr = pmm_buddy_alloc(order);
+    spin_unlock(&pmm_lock);
+
+    if (phys_addr == 0) {
+        // Frames parked in the local magazine may be what is missing to
+        // form a large enough block; give them back and try once more.
+        pmm_magazine_flush(&pmm_magazines[cpu_current_id()]);
+        spin_lock(&pmm_lock);
+        phys_addr = pmm_buddy_alloc(order);
+        spin_unlock(&pmm_lock);
+    }
+    cpu_irq_restore(irq_flags);
+    return phys_addr;
+}
+
+// Allocates 2^order physically contiguous frames, aligned to their size.
+// Returns the physical address of the first frame, or NULL if out of memory.
+void* pmm_alloc_pages(unsigned int order) {
+    if (order > PMM_MAX_ORDER) {
+        return NULL;
+    }
+
+    uint64_t phys_addr = pmm_alloc_pages_once(order);
+    if (phys_addr == 0 && pmm_try_reclaim(1ULL << order)) {
+        // Reclaimed frames are not necessarily contiguous, but may be
+        phys_addr = pmm_alloc_pages_once(order);
+    }
+    if (phys_addr == 0) {
+        serial_write("PMM Error: Out of physical memory!\n", 35);
+        return NULL;
+    }
+    memstat_add(MEMSTAT_KERNEL, 1LL << order);
+    return (void*)phys_addr;
+}
+
+// Frees 2^order frames previously returned by pmm_alloc_pages(order)
+void pmm_free_pages(void* addr, unsigned int order) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_lock);
+    if (pmm_check_free((uint64_t)addr, order)) {
+        pmm_uncharge((uint64_t)addr, order);
+        pmm_buddy_free((uint64_t)addr, order);
+    }
+    spin_unlock(&pmm_lock);
+    cpu_irq_restore(irq_flags);
+}
+
+// Takes a frame from this CPU's magazine, refilling it from the buddy
+// allocator if needed. Returns NULL if both are empty.
+static void* pmm_magazine_alloc(void) {
+    uint64_t irq_flags = cpu_irq_save();
+    struct pmm_magazine *mag = &pmm_magazines[cpu_current_id()];
+
+    if (mag->count == 0) {
+        // Refill half a magazine in one go under the global lock
+        spin_lock(&pmm_lock);
+        while (mag->count < PMM_MAGAZINE_BATCH) {
+            uint64_t phys_addr = pmm_buddy_alloc(0);
+            if (phys_addr == 0) break;
+            pmm_set_cached((void*)phys_addr, true);
+            mag->frames[mag->count++] = (void*)phys_addr;
+        }
+        spin_unlock(&pmm_lock);
+        mag->stats.refills++;
+
+        if (mag->count == 0) {
+            cpu_irq_restore(irq_flags);
+            return NULL; // Out of memory
+        }
+    }
+
+    void* frame = mag->frames[--mag->count];
+    pmm_set_cached(frame, false);
+    mag->stats.allocs++;
+    memstat_add(MEMSTAT_KERNEL, 1);
+    cpu_irq_restore(irq_flags);
+    return frame;
+}
+
+// Allocates one physical 4KiB frame
+// Returns physical address of the frame, or NULL if out of memory
+void* pmm_alloc_frame(void) {
+    void* frame = pmm_magazine_alloc();
+    if (!frame && pmm_reclaiming && pmm_reserve_count > 0) {
+        frame = pmm_reserve[--pmm_reserve_count]; // Already charged
+    }
+    if (!frame && pmm_try_reclaim(PMM_MAGAZINE_BATCH)) {
+        frame = pmm_magazine_alloc(); // Reclaimed frames land in the magazine
+    }
+    if (!frame) {
+        serial_write("PMM Error: Out of physical memory!\n", 35);
+    }
+    return frame;
+}
+
+// Frees a physical frame
+void pmm_free_frame(void* frame_addr) {
+    uint64_t phys_addr = (uint64_t)frame_addr;
+
+    // Checked with interrupts off so an IRQ handler freeing the same frame
+    // cannot slip in between the check and the push
+    uint64_t irq_flags = cpu_irq_save();
+    if (!pmm_check_free(phys_addr, 0)) {
+        cpu_irq_restore(irq_flags);
+        return;
+    }
+    struct pmm_magazine *mag = &pmm_magazines[cpu_current_id()];
+
+    if (mag->count == PMM_MAGAZINE_SIZE) {
+        // Drain the oldest half so the next frees and allocs stay local
+        spin_lock(&pmm_lock);
+        for (uint64_t i = 0; i < PMM_MAGAZINE_BATCH; i++) {
+            pmm_set_cached(mag->frames[i], false);
+            pmm_buddy_free((uint64_t)mag->frames[i], 0);
+        }
+        spin_unlock(&pmm_lock);
+        memmove(&mag->frames[0], &mag->frames[PMM_MAGAZINE_BATCH],
+                (PMM_MAGAZINE_SIZE - PMM_MAGAZINE_BATCH) * sizeof(mag->frames[0]));
+        mag->count -= PMM_MAGAZINE_BATCH;
+        mag->stats.drains++;
+    }
+
+    pmm_uncharge(phys_addr, 0);
+    pmm_set_cached(frame_addr, true);
+    mag->frames[mag->count++] = frame_addr;
+    mag->stats.frees++;
+    cpu_irq_restore(irq_flags);
+}
+
+// Copies the magazine counters of one CPU
+void pmm_get_magazine_stats(unsigned int cpu, struct pmm_magazine_stats *stats) {
+    if (cpu >= MAX_CPUS || !stats) {
+        return;
+    }
+    *stats = pmm_magazines[cpu].stats;
+    stats->cached = pmm_magazines[cpu].count;
+}
+
+// --- Pre-zeroed frames ---
+
+// Zero-fills one frame through the HHDM
+static inline void pmm_zero_frame(void* frame) {
+    void* virt = phys_to_virt((uint64_t)frame);
+    uint64_t count = PAGE_SIZE / sizeof(uint64_t);
+    asm volatile ("rep stosq" : "+D"(virt), "+c"(count) : "a"(0ULL) : "memory");
+}
+
+// Allocates one zero-filled 4KiB frame, preferring the pre-zeroed pool
+void* pmm_alloc_zeroed_frame(void) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_zero_lock);
+    void* frame = NULL;
+    if (pmm_zero_pool_count > 0) {
+        frame = pmm_zero_pool[--pmm_zero_pool_count];
+        pmm_set_cached(frame, false);
+        pmm_zero_stats.hits++;
+    } else {
+        pmm_zero_stats.misses++;
+    }
+    spin_unlock(&pmm_zero_lock);
+    cpu_irq_restore(irq_flags);
+
+    if (frame) {
+        pmm_set_category(frame, 0, MEMSTAT_KERNEL);
+        return frame;
+    }
+
+    // Pool empty: zero synchronously
+    frame = pmm_alloc_frame();
+    if (frame) {
+        pmm_zero_frame(frame);
+    }
+    return frame;
+}
+
+// Zeroes at most one frame into the pool. Meant to be called from idle
+// loops; returns true if there was work to do.
+bool pmm_zero_idle_work(void) {
+    if (!pmm_initialized || pmm_zero_pool_count >= PMM_ZERO_POOL_SIZE) {
+        return false;
+    }
+
+    // Never reclaim (or complain) just to fill the pool
+    void* frame = pmm_magazine_alloc();
+    if (!frame) {
+        return false;
+    }
+    pmm_zero_frame(frame);
+    pmm_set_category(frame, 0, MEMSTAT_ZERO_POOL);
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_zero_lock);
+    bool stored = pmm_zero_pool_count < PMM_ZERO_POOL_SIZE;
+    if (stored) {
+        pmm_set_cached(frame, true);
+        pmm_zero_pool[pmm_zero_pool_count++] = frame;
+        pmm_zero_stats.idle_zeroed++;
+    }
+    spin_unlock(&pmm_zero_lock);
+    cpu_irq_restore(irq_flags);
+
+    if (!stored) {
+        pmm_free_frame(frame); // Someone else filled the pool meanwhile
+    }
+    return true;
+}
+
+// Copies the zero pool counters
+void pmm_get_zero_pool_stats(struct pmm_zero_pool_stats *stats) {
+    if (!stats) {
+        return;
+    }
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_zero_lock);
+    *stats = pmm_zero_stats;
+    stats->pooled = pmm_zero_pool_count;
+    spin_unlock(&pmm_zero_lock);
+    cpu_irq_restore(irq_flags);
+}
+
+// Frames currently handed out: everything seeded minus what sits in the
+// buddy free lists, the magazines and the zero pool
+uint64_t pmm_get_used_frames(void) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_lock);
+    uint64_t idle = pmm_free_frames;
+    spin_unlock(&pmm_lock);
+    for (unsigned int cpu = 0; cpu < MAX_CPUS; cpu++) {
+        idle += pmm_magazines[cpu].count;
+    }
+    spin_lock(&pmm_zero_lock);
+    idle += pmm_zero_pool_count;
+    spin_unlock(&pmm_zero_lock);
+    cpu_irq_restore(irq_flags);
+    return pmm_total_frames - idle;
+}
+
+uint64_t pmm_get_total_frames(void) {
+    return pmm_total_frames;
+}
+
+// --- Accounting ---
+
+void pmm_set_category(void* frame, unsigned int order, enum memstat_category cat) {
+    uint8_t *old = &pmm_frame_category[(uint64_t)frame / PAGE_SIZE];
+    if (*old == cat) {
+        return;
+    }
+    int64_t frames = 1LL << order;
+    memstat_add((enum memstat_category)*old, -frames);
+    memstat_add(cat, frames);
+    *old = cat;
+}
+
+enum memstat_category pmm_get_category(void* frame) {
+    return (enum memstat_category)pmm_frame_category[(uint64_t)frame / PAGE_SIZE];
+}
+
+// --- Shared frames ---
+
+bool pmm_frame_share(void* frame) {
+    uint64_t frame_index = (uint64_t)frame / PAGE_SIZE;
+    bool shared = false;
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_lock);
+    if (pmm_frame_state[frame_index] < PMM_FRAME_SHARE_MAX) {
+        pmm_frame_state[frame_index]++;
+        shared = true;
+    }
+    spin_unlock(&pmm_lock);
+    cpu_irq_restore(irq_flags);
+    return shared;
+}
+
+unsigned int pmm_frame_sharers(void* frame) {
+    return pmm_frame_state[(uint64_t)frame / PAGE_SIZE];
+}
+
+void pmm_frame_release(void* frame) {
+    uint64_t frame_index = (uint64_t)frame / PAGE_SIZE;
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&pmm_lock);
+    bool last = pmm_frame_state[frame_index] == 0;
+    if (!last) {
+        pmm_frame_state[frame_index]--;
+    }
+    spin_unlock(&pmm_lock);
+    cpu_irq_restore(irq_flags);
+
+    if (last) {
+        pmm_free_frame(frame);
+    }
+}
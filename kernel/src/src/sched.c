@@ -0,0 +1,492 @@
+#include "sched.h"
+#include "vmm.h"
+#include "gdt.h"
+#include "cpu.h"
+#include "smp.h"
+#include "exec.h"
+#include "timer.h"
+#include "serial.h"
+#include "lib/string.h"
+
+// From context_switch.asm
+extern void context_switch(uint64_t* save_rsp, uint64_t load_rsp);
+extern void sched_process_entry(void);
+extern void sched_idle_entry(void);
+
+// A process switched out fewer ticks ago than this still has its working
+// set in that CPU's caches, and is not worth stealing
+#define SCHED_CACHE_HOT_TICKS 2
+
+// What each CPU schedules
+struct sched_cpu {
+    struct process* current;
+    struct process* prev;          // Switched away from, until the switch is finished
+    struct process idle;           // Runs when the run queue is empty
+    // Run queue: a ring of runnable processes in the order they run. Only
+    // the kernel lock holder pushes, at the bottom; the owner and thieves
+    // take from the top with a compare-and-swap, so an idle CPU can steal
+    // without the kernel lock. A process is in at most one queue, so
+    // PROC_MAX slots (a power of two) never fill up.
+    struct process* rq[PROC_MAX];
+    volatile uint64_t rq_top;      // Next to run
+    volatile uint64_t rq_bottom;   // Next free slot
+    unsigned int slice_left;
+    uint64_t switch_start;         // TSC when the last switch started
+    struct sched_stats stats;
+};
+
+static struct process proc_table[PROC_MAX];
+static struct sched_cpu sched_cpus[MAX_CPUS];
+static uint64_t sched_next_pid = 1;
+
+static unsigned int sched_timeslice = SCHED_DEFAULT_TIMESLICE_MS * TIMER_HZ / 1000;
+
+static void sched_idle_loop(void) __attribute__((noreturn));
+
+static void sched_init_idle(unsigned int cpu) {
+    struct process* idle = &sched_cpus[cpu].idle;
+    memset(idle, 0, sizeof(*idle));
+    idle->state = PROC_RUNNING;
+    strncpy(idle->name, "idle", PROC_NAME_LEN - 1);
+    idle->as = &g_kernel_address_space;
+    idle->cpu = cpu;
+}
+
+void sched_init(void) {
+    struct process* kernel = &proc_table[0];
+    memset(kernel, 0, sizeof(*kernel));
+    kernel->pid = 0;
+    kernel->state = PROC_RUNNING;
+    strncpy(kernel->name, "kernel", PROC_NAME_LEN - 1);
+    kernel->as = &g_kernel_address_space;
+    kernel->cpu = 0;
+
+    struct sched_cpu* sc = &sched_cpus[0];
+    sc->current = kernel;
+    cpu_local()->current = kernel;
+    sc->slice_left = sched_timeslice;
+
+    // The kernel task keeps the boot stack, so CPU 0's idle task needs one
+    // of its own. It starts in sched_idle_entry, which context_switch
+    // "returns" to with the stack top 16-byte aligned.
+    sched_init_idle(0);
+    void* frames = pmm_alloc_pages(PROC_KERNEL_STACK_ORDER);
+    if (!frames) {
+        serial_write("sched: Cannot allocate the idle stack\n", 38);
+        for (;;) asm volatile("hlt");
+    }
+    uint64_t* switch_frame = (uint64_t*)((uint64_t)phys_to_virt((uint64_t)frames) +
+                                         PROC_KERNEL_STACK_SIZE) - 7;
+    memset(switch_frame, 0, 6 * sizeof(uint64_t));
+    switch_frame[6] = (uint64_t)sched_idle_entry;
+    sc->idle.kernel_rsp = (uint64_t)switch_frame;
+    sc->idle.state = PROC_RUNNABLE;
+
+    kernel_lock();
+}
+
+struct process* sched_current(void) {
+    return cpu_local()->current;
+}
+
+// Frees what a zombie still holds. Never called on a running process: its
+// kernel stack is the one in use.
+static void sched_reap(struct process* p) {
+    pmm_free_pages((void*)virt_to_phys(p->kernel_stack), PROC_KERNEL_STACK_ORDER);
+    p->kernel_stack = NULL;
+    p->state = PROC_UNUSED;
+}
+
+// Processes in a run queue; exact only for the kernel lock holder
+static unsigned int sched_rq_len(struct sched_cpu* sc) {
+    uint64_t top = __atomic_load_n(&sc->rq_top, __ATOMIC_ACQUIRE);
+    uint64_t bottom = __atomic_load_n(&sc->rq_bottom, __ATOMIC_ACQUIRE);
+    return bottom > top ? (unsigned int)(bottom - top) : 0;
+}
+
+// Appends p to the run queue of its CPU, waking that CPU if it is idle.
+// Kernel lock held.
+static void sched_enqueue(struct process* p) {
+    struct sched_cpu* sc = &sched_cpus[p->cpu];
+    p->state = PROC_RUNNABLE;
+    uint64_t bottom = sc->rq_bottom;
+    sc->rq[bottom % PROC_MAX] = p;
+    // The slot is written before a thief can see it
+    __atomic_store_n(&sc->rq_bottom, bottom + 1, __ATOMIC_RELEASE);
+    if (p->cpu != cpu_current_id() && sc->current == &sc->idle) {
+        smp_send_reschedule(p->cpu);
+    }
+}
+
+// Takes the process at the top of a run queue, or returns NULL if it is
+// empty. With `pred` set, only takes it if pred approves. Lock-free: the
+// owner and thieves race with the compare-and-swap on rq_top, and the loser
+// looks again.
+static struct process* sched_rq_take(struct sched_cpu* sc,
+                                     bool (*pred)(struct process*)) {
+    for (;;) {
+        uint64_t top = __atomic_load_n(&sc->rq_top, __ATOMIC_ACQUIRE);
+        uint64_t bottom = __atomic_load_n(&sc->rq_bottom, __ATOMIC_ACQUIRE);
+        if (top >= bottom) {
+            return NULL;
+        }
+        // Pushes never reach this slot while rq_top is still `top`, so if
+        // the swap succeeds this is what was taken
+        struct process* p = sc->rq[top % PROC_MAX];
+        if (pred && !pred(p)) {
+            return NULL;
+        }
+        if (__atomic_compare_exchange_n(&sc->rq_top, &top, top + 1, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+            return p;
+        }
+    }
+}
+
+// Takes the next process off this CPU's run queue, or returns NULL
+static struct process* sched_dequeue(struct sched_cpu* sc) {
+    return sched_rq_take(sc, NULL);
+}
+
+// Whether a thief may take p: not the kernel task, which stays on the boot
+// stack and CPU 0, and not a process whose cache is still warm where it ran
+static bool sched_may_steal(struct process* p) {
+    if (p == &proc_table[0]) {
+        return false;
+    }
+    return timer_get_ticks() - p->last_ran >= SCHED_CACHE_HOT_TICKS;
+}
+
+// Steals a process for this idle CPU from the peer with the longest run
+// queue, without the kernel lock. Only the top of the queue is a
+// candidate: it has waited longest, so it is the coldest in the victim's
+// caches. Returns NULL if there is nothing worth stealing, otherwise the
+// process, now in no run queue, and its old CPU in *victim.
+static struct process* sched_steal(unsigned int cpu, unsigned int* victim) {
+    unsigned int busiest = cpu, busiest_len = 0;
+    for (unsigned int i = 0; i < smp_cpu_count(); i++) {
+        unsigned int len = sched_rq_len(&sched_cpus[i]);
+        if (i != cpu && len > busiest_len) {
+            busiest = i;
+            busiest_len = len;
+        }
+    }
+    if (busiest == cpu) {
+        return NULL;
+    }
+    struct sched_cpu* sc = &sched_cpus[busiest];
+    struct process* p = sched_rq_take(sc, sched_may_steal);
+    if (!p) {
+        // Emptied meanwhile, or the candidate is hot: tried again on the
+        // next tick
+        if (sched_rq_len(sc)) {
+            sched_cpus[cpu].stats.hot_skips++;
+        }
+        return NULL;
+    }
+    *victim = busiest;
+    return p;
+}
+
+// The online CPU with the fewest processes to run
+static unsigned int sched_pick_cpu(void) {
+    unsigned int best = 0, best_load = ~0u;
+    for (unsigned int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        struct sched_cpu* sc = &sched_cpus[cpu];
+        unsigned int load = sched_rq_len(sc) + (sc->current != &sc->idle);
+        if (load < best_load) {
+            best = cpu;
+            best_load = load;
+        }
+    }
+    return best;
+}
+
+// Runs on the stack switched to, right after the switch
+static void sched_finish_switch(void) {
+    struct sched_cpu* sc = &sched_cpus[cpu_current_id()];
+    uint64_t cycles = cpu_rdtsc() - sc->switch_start;
+    sc->stats.switch_cycles += cycles;
+    sc->stats.measured++;
+    if (cycles > sc->stats.switch_max) {
+        sc->stats.switch_max = cycles;
+    }
+
+    // Off its stack now: an exited process nobody waits for can go
+    struct process* prev = sc->prev;
+    sc->prev = NULL;
+    if (prev && prev->state == PROC_ZOMBIE && prev->detached) {
+        sched_reap(prev);
+    }
+}
+
+// Switches this CPU to next; returns when the current process is switched
+// back in. The caller has put the current process where it belongs (a run
+// queue, waiting, exited).
+static void sched_switch_to(struct process* next) {
+    unsigned int cpu = cpu_current_id();
+    struct sched_cpu* sc = &sched_cpus[cpu];
+    struct process* prev = sc->current;
+    prev->last_ran = timer_get_ticks();
+    next->state = PROC_RUNNING;
+    next->switches++;
+    sc->current = next;
+    cpu_local()->current = next;
+    sc->prev = prev;
+    sc->slice_left = sched_timeslice;
+    sc->stats.switches++;
+
+    if (next->kernel_stack) {
+        // Syscalls and interrupts from user mode land on its own stack
+        uint64_t top = (uint64_t)next->kernel_stack + PROC_KERNEL_STACK_SIZE;
+        gdt_set_kernel_stack(top);
+        cpu_local()->kernel_rsp = top;
+    }
+    vmm_switch_address_space(next->as);
+
+    sc->switch_start = cpu_rdtsc();
+    context_switch(&prev->kernel_rsp, next->kernel_rsp);
+    sched_finish_switch();
+}
+
+// Switches to the next process in this CPU's run queue, or to its idle task
+static void sched_switch_away(void) {
+    struct sched_cpu* sc = &sched_cpus[cpu_current_id()];
+    struct process* next = sched_dequeue(sc);
+    sched_switch_to(next ? next : &sc->idle);
+}
+
+// First thing a new process runs, before syscall_return takes it to user mode
+void sched_process_start(void) {
+    sched_finish_switch();
+    kernel_unlock();
+}
+
+// First thing CPU 0's idle task runs
+void sched_idle_start(void) {
+    sched_finish_switch();
+    sched_idle_loop();
+}
+
+// Holds the kernel lock except while looking for work. With its own queue
+// empty, the CPU tries to steal on every timer tick and halts in between.
+static void sched_idle_loop(void) {
+    unsigned int cpu = cpu_current_id();
+    struct sched_cpu* sc = &sched_cpus[cpu];
+    for (;;) {
+        struct process* next = sched_dequeue(sc);
+        if (next) {
+            sched_switch_to(next);
+            continue;
+        }
+        // sti only takes effect after hlt starts, so a wakeup that arrives
+        // after the check still ends the hlt
+        kernel_unlock();
+        unsigned int victim = cpu;
+        while (sched_rq_len(sc) == 0 && !(next = sched_steal(cpu, &victim))) {
+            asm volatile("sti; hlt; cli" : : : "memory");
+        }
+        kernel_lock();
+        if (next) {
+            // Its old CPU saved its context before releasing the lock
+            next->cpu = cpu;
+            sc->stats.steals++;
+            sched_cpus[victim].stats.stolen++;
+            sched_switch_to(next);
+        }
+    }
+}
+
+void sched_start_cpu(void) {
+    unsigned int cpu = cpu_current_id();
+    struct sched_cpu* sc = &sched_cpus[cpu];
+    sched_init_idle(cpu);
+    sc->current = &sc->idle;
+    cpu_local()->current = &sc->idle;
+    sc->slice_left = sched_timeslice;
+    kernel_lock();
+    sched_idle_loop();
+}
+
+bool sched_yield(void) {
+    uint64_t irq_flags = cpu_irq_save();
+    struct sched_cpu* sc = &sched_cpus[cpu_current_id()];
+    struct process* next = sched_dequeue(sc);
+    if (next) {
+        sched_enqueue(sc->current);
+        sched_switch_to(next);
+    }
+    cpu_irq_restore(irq_flags);
+    return next != NULL;
+}
+
+void sched_tick(bool from_user) {
+    struct sched_cpu* sc = &sched_cpus[cpu_current_id()];
+    sc->stats.ticks++;
+    if (sc->current == &sc->idle) {
+        sc->stats.idle_ticks++;
+        return;
+    }
+    sc->current->ticks++;
+    if (sc->slice_left > 0) {
+        sc->slice_left--;
+    }
+    if (!from_user || sc->slice_left > 0) {
+        return;
+    }
+    if (sched_rq_len(sc) == 0) {
+        sc->slice_left = sched_timeslice; // Alone on this CPU: keep running
+        return;
+    }
+
+    // Preempting enters the kernel like a syscall does
+    kernel_lock();
+    struct process* next = sched_dequeue(sc);
+    if (next) {
+        sc->stats.preemptions++;
+        sched_enqueue(sc->current);
+        sched_switch_to(next);
+    }
+    kernel_unlock();
+}
+
+struct process* sched_spawn(const char* name, struct address_space* as,
+                            const struct syscall_frame* frame, bool detached) {
+    uint64_t irq_flags = cpu_irq_save();
+    struct process* p = NULL;
+    for (unsigned int i = 1; i < PROC_MAX && !p; i++) {
+        if (proc_table[i].state == PROC_UNUSED) {
+            p = &proc_table[i];
+        }
+    }
+    void* frames = p ? pmm_alloc_pages(PROC_KERNEL_STACK_ORDER) : NULL;
+    if (!frames) {
+        cpu_irq_restore(irq_flags);
+        serial_write("sched: Cannot create process\n", 29);
+        return NULL;
+    }
+    void* stack = phys_to_virt((uint64_t)frames);
+
+    memset(p, 0, sizeof(*p));
+    p->pid = sched_next_pid++;
+    strncpy(p->name, name, PROC_NAME_LEN - 1);
+    p->as = as;
+    p->kernel_stack = stack;
+    p->detached = detached;
+    p->cpu = sched_pick_cpu();
+
+    // The user registers go at the top of the stack, where the syscall
+    // entry would have put them, and below them what context_switch pops:
+    // six callee-saved registers and the address of sched_process_entry
+    uint64_t top = (uint64_t)stack + PROC_KERNEL_STACK_SIZE;
+    struct syscall_frame* user = (struct syscall_frame*)(top - sizeof(*user));
+    *user = *frame;
+    uint64_t* switch_frame = (uint64_t*)user - 7;
+    memset(switch_frame, 0, 6 * sizeof(uint64_t));
+    switch_frame[6] = (uint64_t)sched_process_entry;
+    p->kernel_rsp = (uint64_t)switch_frame;
+
+    sched_enqueue(p);
+    cpu_irq_restore(irq_flags);
+    return p;
+}
+
+int64_t sched_fork(struct address_space* child_as) {
+    struct process* parent = sched_current();
+    // The parent's user registers, as saved by this syscall's entry
+    uint64_t top = (uint64_t)parent->kernel_stack + PROC_KERNEL_STACK_SIZE;
+    struct syscall_frame frame = *(struct syscall_frame*)(top - sizeof(frame));
+    frame.rax = 0; // fork returns 0 in the child
+
+    struct file_descriptor* fds[MAX_FDS] = { 0 };
+    if (!syscall_clone_fds(fds, parent->fds)) {
+        return -1;
+    }
+    // The kernel lock keeps the child from running before its descriptors
+    // are in place, even on another CPU
+    struct process* child = sched_spawn(parent->name, child_as, &frame, true);
+    if (!child) {
+        syscall_close_fds(fds);
+        return -1;
+    }
+    memcpy(child->fds, fds, sizeof(fds));
+    return (int64_t)child->pid;
+}
+
+void sched_exit(int64_t code) {
+    cpu_irq_save(); // Never restored: this context does not come back
+    struct process* p = sched_current();
+
+    // Back to the kernel's page tables before tearing down the process's
+    vmm_switch_address_space(&g_kernel_address_space);
+    exec_release(p);
+    p->as = &g_kernel_address_space;
+    syscall_close_fds(p->fds);
+
+    p->exit_code = code;
+    p->state = PROC_ZOMBIE;
+    for (unsigned int i = 0; i < PROC_MAX; i++) {
+        if (proc_table[i].state == PROC_WAITING && proc_table[i].wait_pid == p->pid) {
+            sched_enqueue(&proc_table[i]);
+        }
+    }
+
+    sched_switch_away();
+    __builtin_unreachable(); // A zombie is never switched back in
+}
+
+int64_t sched_wait(uint64_t pid) {
+    uint64_t irq_flags = cpu_irq_save();
+    struct process* target = NULL;
+    for (unsigned int i = 1; i < PROC_MAX; i++) {
+        if (proc_table[i].state != PROC_UNUSED && proc_table[i].pid == pid) {
+            target = &proc_table[i];
+        }
+    }
+    struct process* self = sched_current();
+    // Detached processes are reaped on exit, nothing to wait for
+    if (!target || target == self || target->detached) {
+        cpu_irq_restore(irq_flags);
+        return -1;
+    }
+
+    // The target may be running on another CPU; its exit puts us back in
+    // our run queue
+    while (target->state != PROC_ZOMBIE) {
+        self->state = PROC_WAITING;
+        self->wait_pid = pid;
+        sched_switch_away();
+    }
+    int64_t code = target->exit_code;
+    sched_reap(target);
+    cpu_irq_restore(irq_flags);
+    return code;
+}
+
+void sched_set_timeslice(unsigned int ms) {
+    unsigned int ticks = ms * TIMER_HZ / 1000;
+    sched_timeslice = ticks ? ticks : 1;
+}
+
+unsigned int sched_get_timeslice(void) {
+    return sched_timeslice * 1000 / TIMER_HZ;
+}
+
+bool sched_get_stats(unsigned int cpu, struct sched_stats* stats) {
+    if (cpu >= smp_cpu_count()) {
+        return false;
+    }
+    *stats = sched_cpus[cpu].stats;
+    stats->queued = sched_rq_len(&sched_cpus[cpu]);
+    return true;
+}
+
+bool sched_get_process(unsigned int idx, struct process* proc) {
+    if (idx >= PROC_MAX) {
+        return false;
+    }
+    uint64_t irq_flags = cpu_irq_save();
+    *proc = proc_table[idx];
+    cpu_irq_restore(irq_flags);
+    return true;
+}
@@ -0,0 +1,123 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "syscall.h"
+
+// --- Processes and scheduling ---
+
+// Every process has a slot in a fixed table with its address space, its
+// own kernel stack, the stack pointer context_switch saved there while it
+// is not running, and its file descriptors. Slot 0 is the kernel task: the
+// shell, running on the boot stack in the kernel address space, always on
+// CPU 0.
+//
+// Each CPU has a run queue and round-robins over it; a new process goes to
+// the CPU with the least work. With nothing to run a CPU switches to its
+// idle task, which steals a waiting process from the busiest other CPU,
+// unless that process ran there too recently to have gone cold in its
+// caches, or else halts until an interrupt. The timer tick
+// takes a process that used up its timeslice off the CPU, but only when it
+// interrupts user mode: kernel code is never preempted and gives the CPU
+// away itself (sched_yield, sched_wait, sched_exit).
+//
+// All of it runs under the kernel lock (smp.h), interrupts off, except for
+// taking processes off run queues, which is lock-free so idle CPUs can
+// steal without the lock.
+
+#define PROC_MAX 64
+#define PROC_NAME_LEN 32
+#define PROC_KERNEL_STACK_ORDER 2   // 16KiB of frames
+#define PROC_KERNEL_STACK_SIZE (4096 << PROC_KERNEL_STACK_ORDER)
+#define SCHED_DEFAULT_TIMESLICE_MS 10
+
+struct address_space;
+
+enum proc_state {
+    PROC_UNUSED = 0,
+    PROC_RUNNABLE,
+    PROC_RUNNING,
+    PROC_WAITING,    // In sched_wait
+    PROC_ZOMBIE,     // Exited; the slot and kernel stack wait to be reaped
+};
+
+struct process {
+    uint64_t pid;
+    enum proc_state state;
+    char name[PROC_NAME_LEN];
+    struct address_space* as;
+    void* kernel_stack;        // Lowest address; NULL = boot stack
+    uint64_t kernel_rsp;       // Saved by context_switch while switched out
+    struct file_descriptor* fds[MAX_FDS];
+    bool detached;             // Nobody waits: reaped as soon as it exits
+    uint64_t wait_pid;         // PROC_WAITING: the process waited for
+    int64_t exit_code;
+    uint64_t ticks;            // Timer ticks it was running for
+    uint64_t switches;         // Times it was switched in
+    unsigned int cpu;          // CPU whose run queue it belongs to
+    uint64_t last_ran;         // timer_get_ticks() when last switched out
+    // Leak check on exit (see exec.c): frames in use before it was created,
+    // only meaningful if no other process ran alongside
+    bool check_leaks;
+    uint64_t frames_before;
+};
+
+// Sets up the process table with the kernel task, which takes the kernel
+// lock. Call before timer_init.
+void sched_init(void);
+
+// Runs the idle task of an application processor; called by smp_init's
+// startup code once the CPU is set up
+void sched_start_cpu(void) __attribute__((noreturn));
+
+// The process running on this CPU
+struct process* sched_current(void);
+
+// Creates a process in `as` that starts by returning to user mode through
+// `frame`; it takes ownership of `as`. Returns the new process (already
+// runnable), or NULL if the table is full or out of memory.
+struct process* sched_spawn(const char* name, struct address_space* as,
+                            const struct syscall_frame* frame, bool detached);
+
+// Duplicates the current process for fork: same user registers except a 0
+// return value, the given address space, copies of the descriptors.
+// Returns the child's PID or -1.
+int64_t sched_fork(struct address_space* child_as);
+
+// Ends the current process: frees its memory, wakes a waiter, never returns
+void sched_exit(int64_t code) __attribute__((noreturn));
+
+// Blocks until process pid exits and returns its exit code; -1 if there is
+// no such process
+int64_t sched_wait(uint64_t pid);
+
+// Switches to the next runnable process on this CPU, if any; returns false
+// if there was none and the caller keeps the CPU
+bool sched_yield(void);
+
+// Called on every timer tick with interrupts off
+void sched_tick(bool from_user);
+
+// Timeslice in milliseconds of timer ticks
+void sched_set_timeslice(unsigned int ms);
+unsigned int sched_get_timeslice(void);
+
+struct sched_stats {
+    uint64_t switches;        // Context switches
+    uint64_t preemptions;     // ... forced by the timer
+    uint64_t switch_cycles;   // Total cycles from switching out to resuming
+    uint64_t switch_max;      // Slowest switch
+    uint64_t measured;        // Switches counted in switch_cycles
+    uint64_t ticks;
+    uint64_t idle_ticks;      // Ticks that found the idle task running
+    unsigned int queued;      // Processes in the run queue now
+    uint64_t steals;          // Processes taken from other CPUs' run queues
+    uint64_t stolen;          // ... and taken from this one by other CPUs
+    uint64_t hot_skips;       // Steals passed up on a cache-hot process
+};
+// Counters of one CPU; false past the last CPU online
+bool sched_get_stats(unsigned int cpu, struct sched_stats* stats);
+
+// Copies a process table slot by index (returns false past the end of the
+// table; unused slots come back with state PROC_UNUSED)
+bool sched_get_process(unsigned int idx, struct process* proc);
@@ -10,6 +10,14 @@
 #include "exec.h"
 #include "syscall.h"
 #include "gui.h"
+#include "vmm.h"
+#include "slab.h"
+#include "memstat.h"
+#include "ksm.h"
+#include "swap.h"
+#include "zram.h"
+#include "sched.h"
+#include "smp.h"
 
 extern struct gui_context gui_ctx;
 
@@ -109,6 +117,28 @@ static void shell_print(const char *s) {
     flanterm_write(ft_ctx, s, len);
 }
 
+static void shell_print_dec(uint64_t n) {
+    char buf[21];
+    int i = 20;
+    buf[i] = 0;
+    do {
+        buf[--i] = '0' + (n % 10);
+        n /= 10;
+    } while (n);
+    shell_print(&buf[i]);
+}
+
+// Parses a decimal argument, returning def if it is missing or malformed
+static uint64_t parse_dec(const char *s, uint64_t def) {
+    if (!s || !*s) return def;
+    uint64_t n = 0;
+    for (; *s; s++) {
+        if (*s < '0' || *s > '9') return def;
+        n = n * 10 + (*s - '0');
+    }
+    return n;
+}
+
 static void shell_print_colored(const char *s, const char *color) {
     shell_print(color);
     shell_print(s);
@@ -203,14 +233,23 @@ static bool try_exec_elf_command(const char *cmd, char *argv[], int argc) {
 
         struct fs_file *file = fs_open(path_buffer);
         if (file != NULL) {
-            (void)argv;
-            (void)argc;
+            // A trailing & runs the program alongside the shell
+            bool background = argc > 1 && !strcmp(argv[argc - 1], "&");
 
             shell_print("Executing: ");
             shell_print(path_buffer);
             shell_print("\n");
 
-            exec_elf(path_buffer);
+            int64_t pid = exec_elf(path_buffer, background);
+            if (pid < 0) {
+                shell_print(ANSI_RED "Error: " ANSI_RESET "Could not start the program\n");
+            } else if (background) {
+                shell_print("[");
+                shell_print_dec((uint64_t)pid);
+                shell_print("] running in the background\n");
+            } else {
+                sched_wait((uint64_t)pid);
+            }
             return true;
         }
         tok = strtok(NULL, ":");
@@ -266,6 +305,22 @@ static void shell_exec(const char *cmd, char *argv[], int argc) {
         shell_print_colored("║ ", ANSI_CYAN);
         shell_print_colored("  gui    - Start GUI demo          ║\n", ANSI_CYAN);
         shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  tlbbench - CR3 switch TLB cost   ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  slabinfo - Kernel heap usage     ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  meminfo - Memory use by category ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  ksm [on|off] - Same-page merging ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  swapon [zram] [KiB] - Add swap   ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  swapinfo - Swap areas and rates  ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  ps - Processes and scheduling    ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
+        shell_print_colored("  timeslice [ms] - Set timeslice   ║\n", ANSI_CYAN);
+        shell_print_colored("║ ", ANSI_CYAN);
         shell_print_colored("Other commands are executed via ELF.║\n", ANSI_CYAN);
         shell_print_colored("╚═════════════════════════════════════╝\n", ANSI_CYAN);
     } else if (!strcmp(cmd, "clear")) {
@@ -279,6 +334,262 @@ static void shell_exec(const char *cmd, char *argv[], int argc) {
         for (;;) { asm volatile ("cli; hlt"); }
     } else if (!strcmp(cmd, "gui")) {
         gui_run_demo(&gui_ctx);
+    } else if (!strcmp(cmd, "tlbbench")) {
+        // tlbbench [pages] [rounds]: switch into an address space, touch
+        // its working set and switch back, with and without PCIDs
+        uint64_t pages = parse_dec(argc > 1 ? argv[1] : NULL, 512);
+        uint64_t rounds = parse_dec(argc > 2 ? argv[2] : NULL, 1000);
+        shell_print("Working set: ");
+        shell_print_dec(pages);
+        shell_print(" pages, ");
+        shell_print_dec(rounds);
+        shell_print(" rounds\n");
+        uint64_t flush = vmm_tlb_benchmark(pages, rounds, false);
+        shell_print("  Full flush: ");
+        shell_print_dec(flush);
+        shell_print(" cycles/round\n");
+        if (vmm_pcid_supported()) {
+            uint64_t tagged = vmm_tlb_benchmark(pages, rounds, true);
+            shell_print("  PCID:       ");
+            shell_print_dec(tagged);
+            shell_print(" cycles/round\n");
+        } else {
+            shell_print("  PCID:       not supported by this CPU\n");
+        }
+    } else if (!strcmp(cmd, "slabinfo")) {
+        // One line per kmem cache: object size, objects in use / slots, frames
+        struct kmem_cache_stats stats;
+        for (size_t i = 0; kmem_cache_get_stats(i, &stats); i++) {
+            shell_print(stats.name);
+            shell_print(": ");
+            shell_print_dec(stats.object_size);
+            shell_print("B, ");
+            shell_print_dec(stats.active);
+            shell_print("/");
+            shell_print_dec(stats.total);
+            shell_print(" objects, ");
+            shell_print_dec(stats.slabs);
+            shell_print(" slabs, ");
+            shell_print_dec(stats.allocs);
+            shell_print(" allocs\n");
+        }
+        struct kmalloc_large_stats large;
+        kmalloc_get_large_stats(&large);
+        shell_print("kmalloc-large: ");
+        shell_print_dec(large.blocks);
+        shell_print(" blocks, ");
+        shell_print_dec(large.pages);
+        shell_print(" pages\n");
+    } else if (!strcmp(cmd, "meminfo")) {
+        // Frame counts by category, shown in KiB
+        struct meminfo info;
+        memstat_get_meminfo(&info);
+        const char *labels[] = {
+            "Total:        ", "Free:         ", "  Pre-zeroed: ", "Kernel:       ",
+            "Page tables:  ", "User:         ", "Page cache:   ", "Slab:         ",
+            "Kmalloc-large:", "GUI:          ", "Merged (KSM): ", "Swap total:   ",
+            "Swap used:    ",
+        };
+        const uint64_t frames[] = {
+            info.total, info.free, info.zero_pool, info.kernel,
+            info.page_tables, info.user, info.page_cache, info.slab,
+            info.kmalloc_large, info.gui, info.ksm, info.swap_total,
+            info.swap_used,
+        };
+        for (size_t i = 0; i < sizeof(frames) / sizeof(frames[0]); i++) {
+            shell_print(labels[i]);
+            shell_print(" ");
+            shell_print_dec(frames[i] * (PAGE_SIZE / 1024));
+            shell_print(" KiB\n");
+        }
+        shell_print("File data:     ");
+        shell_print_dec(info.file_data_bytes / 1024);
+        shell_print(" KiB\n");
+    } else if (!strcmp(cmd, "ksm")) {
+        // ksm [on|off]: toggle the idle same-page merging scanner and show
+        // what it has done so far
+        if (argc > 1 && !strcmp(argv[1], "on")) {
+            ksm_set_enabled(true);
+        } else if (argc > 1 && !strcmp(argv[1], "off")) {
+            ksm_set_enabled(false);
+        }
+        struct ksm_stats stats;
+        ksm_get_stats(&stats);
+        shell_print(ksm_is_enabled() ? "KSM: on\n" : "KSM: off\n");
+        shell_print("  Scanned:      ");
+        shell_print_dec(stats.scanned);
+        shell_print(" pages, ");
+        shell_print_dec(stats.full_scans);
+        shell_print(" full scans\n");
+        shell_print("  Merged:       ");
+        shell_print_dec(stats.merged);
+        shell_print(" pages into ");
+        shell_print_dec(stats.shared);
+        shell_print(" shared frames\n");
+        shell_print("  Zero merged:  ");
+        shell_print_dec(stats.zero_merged);
+        shell_print(" pages\n");
+    } else if (!strcmp(cmd, "swapon")) {
+        // swapon [zram] [KiB]: adds a swap area on a new RAM disk (default
+        // 16MiB). A zram disk compresses pages and is used before RAM disks.
+        static unsigned int ramdisks = 0;
+        static unsigned int zrams = 0;
+        bool zram = argc > 1 && !strcmp(argv[1], "zram");
+        const char *size_arg = argc > (zram ? 2 : 1) ? argv[zram ? 2 : 1] : NULL;
+        uint64_t size = parse_dec(size_arg, 16384) * 1024;
+        char name[BLOCKDEV_NAME_LEN];
+        struct block_device *dev;
+        if (zram) {
+            strcpy(name, "zram");
+            uitoa(zrams, name + 4, 10);
+            dev = zram_create(name, size);
+        } else {
+            strcpy(name, "ram");
+            uitoa(ramdisks, name + 3, 10);
+            dev = ramdisk_create(name, size);
+        }
+        if (!dev || !swap_on(dev, zram ? 10 : 0)) {
+            shell_print(ANSI_RED "Error: " ANSI_RESET "Could not set up swap\n");
+        } else {
+            if (zram) {
+                zrams++;
+            } else {
+                ramdisks++;
+            }
+            shell_print("Swapping to ");
+            shell_print(name);
+            shell_print("\n");
+        }
+    } else if (!strcmp(cmd, "swapinfo")) {
+        struct swap_area_info area;
+        for (unsigned int i = 0; swap_get_area(i, &area); i++) {
+            shell_print(area.device);
+            shell_print(": ");
+            shell_print_dec(area.used);
+            shell_print("/");
+            shell_print_dec(area.slots);
+            shell_print(" pages, priority ");
+            shell_print_dec((uint64_t)area.priority);
+            shell_print("\n");
+            struct zram_stats zs;
+            if (zram_get_stats(blockdev_find(area.device), &zs)) {
+                uint64_t packed = zs.pages - zs.same_pages - zs.raw_pages;
+                shell_print("  compressed: ");
+                shell_print_dec(packed);
+                shell_print(" pages in ");
+                shell_print_dec(zs.compressed_bytes / 1024);
+                shell_print(" KiB (ratio x");
+                shell_print_dec(zs.compressed_bytes ? packed * PAGE_SIZE * 10 / zs.compressed_bytes / 10 : 0);
+                shell_print(".");
+                shell_print_dec(zs.compressed_bytes ? packed * PAGE_SIZE * 10 / zs.compressed_bytes % 10 : 0);
+                shell_print(")\n  same-filled: ");
+                shell_print_dec(zs.same_pages);
+                shell_print(", raw: ");
+                shell_print_dec(zs.raw_pages);
+                shell_print(", pool: ");
+                shell_print_dec(zs.pool_bytes / 1024);
+                shell_print(" KiB\n  compress:   ");
+                shell_print_dec(zs.stores ? zs.store_cycles / zs.stores : 0);
+                shell_print(" cycles/page, decompress: ");
+                shell_print_dec(zs.loads ? zs.load_cycles / zs.loads : 0);
+                shell_print(" avg, ");
+                shell_print_dec(zs.load_max);
+                shell_print(" max\n");
+            }
+        }
+        struct swap_stats stats;
+        swap_get_stats(&stats);
+        shell_print("Swapped out:  ");
+        shell_print_dec(stats.swap_outs);
+        shell_print(" pages, ");
+        shell_print_dec(stats.swap_outs ? stats.out_cycles / stats.swap_outs : 0);
+        shell_print(" cycles/page\n");
+        shell_print("Swapped in:   ");
+        shell_print_dec(stats.swap_ins);
+        shell_print(" pages\n");
+        shell_print("Fault cost:   ");
+        shell_print_dec(stats.swap_ins ? stats.fault_cycles / stats.swap_ins : 0);
+        shell_print(" cycles avg, ");
+        shell_print_dec(stats.fault_max);
+        shell_print(" max\n");
+        shell_print("Reclaim:      ");
+        shell_print_dec(stats.reclaims);
+        shell_print(" calls, ");
+        shell_print_dec(stats.scanned);
+        shell_print(" pages scanned\n");
+    } else if (!strcmp(cmd, "ps")) {
+        static const char *const state_names[] = {
+            [PROC_RUNNABLE] = "runnable", [PROC_RUNNING] = "running ",
+            [PROC_WAITING] = "waiting ", [PROC_ZOMBIE] = "exited  ",
+        };
+        shell_print("  PID  CPU  STATE     TICKS  SWITCHES  NAME\n");
+        struct process proc;
+        for (unsigned int i = 0; sched_get_process(i, &proc); i++) {
+            if (proc.state == PROC_UNUSED) {
+                continue;
+            }
+            shell_print("  ");
+            shell_print_dec(proc.pid);
+            shell_print("  ");
+            shell_print_dec(proc.cpu);
+            shell_print("  ");
+            shell_print(state_names[proc.state]);
+            shell_print("  ");
+            shell_print_dec(proc.ticks);
+            shell_print("  ");
+            shell_print_dec(proc.switches);
+            shell_print("  ");
+            shell_print(proc.name);
+            shell_print("\n");
+        }
+        struct sched_stats stats;
+        struct smp_stats lock_stats;
+        for (unsigned int cpu = 0; sched_get_stats(cpu, &stats); cpu++) {
+            smp_get_stats(cpu, &lock_stats);
+            shell_print("CPU ");
+            shell_print_dec(cpu);
+            shell_print(":        ");
+            shell_print_dec(stats.switches);
+            shell_print(" switches (");
+            shell_print_dec(stats.preemptions);
+            shell_print(" by the timer), ");
+            shell_print_dec(stats.measured ? stats.switch_cycles / stats.measured : 0);
+            shell_print(" cycles avg, ");
+            shell_print_dec(stats.switch_max);
+            shell_print(" max\n");
+            shell_print("              ");
+            shell_print_dec(stats.ticks ? 100 * stats.idle_ticks / stats.ticks : 0);
+            shell_print("% idle, ");
+            shell_print_dec(stats.queued);
+            shell_print(" queued, ");
+            shell_print_dec(lock_stats.lock_waits);
+            shell_print(" lock waits (");
+            shell_print_dec(lock_stats.lock_waits ? lock_stats.lock_wait_cycles / lock_stats.lock_waits : 0);
+            shell_print(" cycles avg), ");
+            shell_print_dec(lock_stats.shootdowns);
+            shell_print(" TLB shootdowns\n");
+            shell_print("              ");
+            shell_print_dec(stats.steals);
+            shell_print(" stolen from other CPUs, ");
+            shell_print_dec(stats.stolen);
+            shell_print(" by them, ");
+            shell_print_dec(stats.hot_skips);
+            shell_print(" left as cache-hot\n");
+        }
+        sched_get_stats(0, &stats);
+        shell_print("Timeslice:    ");
+        shell_print_dec(sched_get_timeslice());
+        shell_print(" ms, ");
+        shell_print_dec(stats.ticks);
+        shell_print(" ticks so far\n");
+    } else if (!strcmp(cmd, "timeslice")) {
+        // timeslice [ms]: shows or sets the round-robin timeslice
+        if (argc > 1) {
+            sched_set_timeslice((unsigned int)parse_dec(argv[1], SCHED_DEFAULT_TIMESLICE_MS));
+        }
+        shell_print("Timeslice: ");
+        shell_print_dec(sched_get_timeslice());
+        shell_print(" ms\n");
     } else if (!strcmp(cmd, "pwd")) {
         // Print working directory
         const char *cwd = fs_get_current_dir();
@@ -303,10 +614,10 @@ static void shell_exec(const char *cmd, char *argv[], int argc) {
     } else if (!strcmp(cmd, "ls")) {
         // List files in the current directory
         size_t n = 0;
-        const struct fs_file *files = fs_list(&n);
+        const struct fs_file *const *files = fs_list(&n);
         for (size_t i = 0; i < n; i++) {
-            shell_print(files[i].name);
-            if (files[i].is_dir) shell_print("/");
+            shell_print(files[i]->name);
+            if (files[i]->is_dir) shell_print("/");
             shell_print("  ");
         }
         shell_print("\n");
@@ -368,7 +679,7 @@ static void shell_exec(const char *cmd, char *argv[], int argc) {
             shell_print("\n");
         }
         // If try_exec_elf_command returned true, the process ran (or failed during exec_elf)
-        // and exec_elf handled cleanup. Nothing more to do here.
+        // and has been reaped, or is running in the background. Nothing more to do here.
     }
 }
 
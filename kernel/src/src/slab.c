@@ -0,0 +1,348 @@
+#include "slab.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "serial.h"
+#include "lib/string.h"
+
+// Every slab and every large block starts on a frame boundary with a header
+// whose first field is a magic number, so kfree finds the owner of a pointer
+// by rounding it down to its frame.
+#define KMEM_SLAB_MAGIC 0x51AB51ABu
+#define KMALLOC_LARGE_MAGIC 0x1A26E1A2u
+#define KMEM_ALIGN 16
+
+struct kmem_slab {
+    uint32_t magic;
+    uint32_t in_use;            // Allocated slots
+    struct kmem_cache* cache;
+    struct kmem_slab* prev;     // Neighbours on the cache list the slab is on
+    struct kmem_slab* next;
+    void* free_list;            // Free slots, linked through their first word
+};
+
+#define KMEM_SLAB_HEADER ((sizeof(struct kmem_slab) + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1))
+
+struct kmalloc_large {
+    uint32_t magic;
+    uint32_t order;
+    uint64_t size;              // Bytes usable after the header
+};
+
+// Size classes served from slabs; larger requests go to kmalloc_large
+static const uint32_t kmalloc_sizes[] = { 16, 32, 64, 96, 128, 192, 256, 512, KMALLOC_MAX_SLAB };
+#define KMALLOC_NUM_CLASSES (sizeof(kmalloc_sizes) / sizeof(kmalloc_sizes[0]))
+
+static struct kmem_cache kmem_caches[KMEM_MAX_CACHES];
+static struct kmem_cache* kmalloc_caches[KMALLOC_NUM_CLASSES];
+static spinlock_t kmem_caches_lock = SPINLOCK_INIT;
+static struct kmalloc_large_stats kmalloc_large_stats;
+
+static void kmem_list_add(struct kmem_slab** list, struct kmem_slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void kmem_list_remove(struct kmem_slab** list, struct kmem_slab* slab) {
+    if (slab->prev) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// Takes a frame from the PMM and threads all of its slots onto the free list
+static struct kmem_slab* kmem_slab_create(struct kmem_cache* cache) {
+    void* frame = pmm_alloc_frame();
+    if (!frame) {
+        return NULL;
+    }
+    pmm_set_category(frame, 0, MEMSTAT_SLAB);
+    struct kmem_slab* slab = phys_to_virt((uint64_t)frame);
+    slab->magic = KMEM_SLAB_MAGIC;
+    slab->in_use = 0;
+    slab->cache = cache;
+    slab->free_list = NULL;
+    uint8_t* objects = (uint8_t*)slab + KMEM_SLAB_HEADER;
+    for (uint32_t i = cache->objects_per_slab; i-- > 0;) {
+        void** slot = (void**)(objects + i * cache->object_size);
+        *slot = slab->free_list;
+        slab->free_list = slot;
+    }
+    cache->slabs++;
+    return slab;
+}
+
+static void kmem_slab_destroy(struct kmem_cache* cache, struct kmem_slab* slab) {
+    slab->magic = 0;
+    cache->slabs--;
+    pmm_free_frame((void*)virt_to_phys(slab));
+}
+
+static struct kmem_slab* kmem_slab_of(const void* ptr) {
+    return (struct kmem_slab*)((uint64_t)ptr & ~(uint64_t)(PAGE_SIZE - 1));
+}
+
+struct kmem_cache* kmem_cache_create(const char* name, size_t size) {
+    if (size < sizeof(void*)) {
+        size = sizeof(void*);
+    }
+    size = (size + KMEM_ALIGN - 1) & ~(size_t)(KMEM_ALIGN - 1);
+    if (size > PAGE_SIZE - KMEM_SLAB_HEADER) {
+        serial_write("[kmem] Object size too large for a slab\n", 40);
+        return NULL;
+    }
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&kmem_caches_lock);
+    struct kmem_cache* cache = NULL;
+    for (size_t i = 0; i < KMEM_MAX_CACHES; i++) {
+        if (!kmem_caches[i].name[0]) {
+            cache = &kmem_caches[i];
+            break;
+        }
+    }
+    if (cache) {
+        memset(cache, 0, sizeof(*cache));
+        strncpy(cache->name, name, KMEM_NAME_LEN - 1);
+        if (!cache->name[0]) {
+            cache->name[0] = '?';
+        }
+        cache->object_size = size;
+        cache->objects_per_slab = (PAGE_SIZE - KMEM_SLAB_HEADER) / size;
+    }
+    spin_unlock(&kmem_caches_lock);
+    cpu_irq_restore(irq_flags);
+
+    if (!cache) {
+        serial_write("[kmem] Out of cache slots\n", 26);
+    }
+    return cache;
+}
+
+void* kmem_cache_alloc(struct kmem_cache* cache) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&cache->lock);
+
+    struct kmem_slab* slab = cache->partial;
+    if (!slab) {
+        slab = cache->empty;
+        if (slab) {
+            cache->empty = NULL;
+        } else {
+            slab = kmem_slab_create(cache);
+            if (!slab) {
+                spin_unlock(&cache->lock);
+                cpu_irq_restore(irq_flags);
+                return NULL;
+            }
+        }
+        kmem_list_add(&cache->partial, slab);
+    }
+
+    void** obj = slab->free_list;
+    slab->free_list = *obj;
+    slab->in_use++;
+    if (!slab->free_list) {
+        kmem_list_remove(&cache->partial, slab);
+        kmem_list_add(&cache->full, slab);
+    }
+    cache->allocs++;
+    cache->active++;
+
+    spin_unlock(&cache->lock);
+    cpu_irq_restore(irq_flags);
+    return obj;
+}
+
+void kmem_cache_free(struct kmem_cache* cache, void* obj) {
+    struct kmem_slab* slab = kmem_slab_of(obj);
+    if (slab->magic != KMEM_SLAB_MAGIC || slab->cache != cache) {
+        serial_write("[kmem] Free of an object not from this cache\n", 45);
+        return;
+    }
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&cache->lock);
+
+    if (slab->in_use == 0) {
+        spin_unlock(&cache->lock);
+        cpu_irq_restore(irq_flags);
+        serial_write("[kmem] Double free\n", 19);
+        return;
+    }
+
+    if (!slab->free_list) {
+        kmem_list_remove(&cache->full, slab);
+        kmem_list_add(&cache->partial, slab);
+    }
+    *(void**)obj = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+    cache->frees++;
+    cache->active--;
+
+    // Keep one empty slab for the next allocation, return the rest
+    if (slab->in_use == 0) {
+        kmem_list_remove(&cache->partial, slab);
+        if (!cache->empty) {
+            cache->empty = slab;
+        } else {
+            kmem_slab_destroy(cache, slab);
+        }
+    }
+
+    spin_unlock(&cache->lock);
+    cpu_irq_restore(irq_flags);
+}
+
+void kmem_init(void) {
+    static const char* const names[KMALLOC_NUM_CLASSES] = {
+        "kmalloc-16", "kmalloc-32", "kmalloc-64", "kmalloc-96", "kmalloc-128",
+        "kmalloc-192", "kmalloc-256", "kmalloc-512", "kmalloc-1024"
+    };
+    for (size_t i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        kmalloc_caches[i] = kmem_cache_create(names[i], kmalloc_sizes[i]);
+    }
+}
+
+// Blocks too big for a slab take a power-of-two run of frames from the buddy
+// allocator, with the header in front of the caller's memory
+static void* kmalloc_large(size_t size) {
+    if (size > ((size_t)PAGE_SIZE << PMM_MAX_ORDER)) {
+        return NULL;
+    }
+    size_t needed = size + sizeof(struct kmalloc_large);
+    unsigned int order = 0;
+    while (((size_t)PAGE_SIZE << order) < needed) {
+        if (++order > PMM_MAX_ORDER) {
+            return NULL;
+        }
+    }
+    void* frames = pmm_alloc_pages(order);
+    if (!frames) {
+        return NULL;
+    }
+    pmm_set_category(frames, order, MEMSTAT_KMALLOC_LARGE);
+    struct kmalloc_large* header = phys_to_virt((uint64_t)frames);
+    header->magic = KMALLOC_LARGE_MAGIC;
+    header->order = order;
+    header->size = ((size_t)PAGE_SIZE << order) - sizeof(struct kmalloc_large);
+    __atomic_fetch_add(&kmalloc_large_stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&kmalloc_large_stats.pages, (uint64_t)1 << order, __ATOMIC_RELAXED);
+    return header + 1;
+}
+
+void* kmalloc(size_t size) {
+    if (size > KMALLOC_MAX_SLAB) {
+        return kmalloc_large(size);
+    }
+    for (size_t i = 0; i < KMALLOC_NUM_CLASSES; i++) {
+        if (size <= kmalloc_sizes[i]) {
+            return kmalloc_caches[i] ? kmem_cache_alloc(kmalloc_caches[i]) : NULL;
+        }
+    }
+    return NULL;
+}
+
+void* kzalloc(size_t size) {
+    void* ptr = kmalloc(size);
+    if (ptr) {
+        memset(ptr, 0, size);
+    }
+    return ptr;
+}
+
+void kfree(void* ptr) {
+    if (!ptr) {
+        return;
+    }
+    struct kmem_slab* slab = kmem_slab_of(ptr);
+    if (slab->magic == KMEM_SLAB_MAGIC) {
+        kmem_cache_free(slab->cache, ptr);
+        return;
+    }
+
+    struct kmalloc_large* header = (struct kmalloc_large*)ptr - 1;
+    if ((void*)header != (void*)slab || header->magic != KMALLOC_LARGE_MAGIC) {
+        serial_write("[kmem] kfree of an invalid pointer\n", 35);
+        return;
+    }
+    unsigned int order = header->order;
+    header->magic = 0;
+    __atomic_fetch_sub(&kmalloc_large_stats.blocks, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_sub(&kmalloc_large_stats.pages, (uint64_t)1 << order, __ATOMIC_RELAXED);
+    pmm_free_pages((void*)virt_to_phys(header), order);
+}
+
+// Bytes the block at ptr can hold
+static size_t kmalloc_usable_size(void* ptr) {
+    struct kmem_slab* slab = kmem_slab_of(ptr);
+    if (slab->magic == KMEM_SLAB_MAGIC) {
+        return slab->cache->object_size;
+    }
+    return ((struct kmalloc_large*)ptr - 1)->size;
+}
+
+void* krealloc(void* ptr, size_t size) {
+    if (!ptr) {
+        return kmalloc(size);
+    }
+    if (size == 0) {
+        kfree(ptr);
+        return NULL;
+    }
+
+    size_t usable = kmalloc_usable_size(ptr);
+    if (size <= usable) {
+        return ptr;
+    }
+    void* moved = kmalloc(size);
+    if (!moved) {
+        return NULL;
+    }
+    memcpy(moved, ptr, usable);
+    kfree(ptr);
+    return moved;
+}
+
+bool kmem_cache_get_stats(size_t idx, struct kmem_cache_stats* stats) {
+    for (size_t i = 0; i < KMEM_MAX_CACHES; i++) {
+        struct kmem_cache* cache = &kmem_caches[i];
+        if (!cache->name[0] || idx-- > 0) {
+            continue;
+        }
+        uint64_t irq_flags = cpu_irq_save();
+        spin_lock(&cache->lock);
+        memcpy(stats->name, cache->name, KMEM_NAME_LEN);
+        stats->object_size = cache->object_size;
+        stats->active = cache->active;
+        stats->total = cache->slabs * cache->objects_per_slab;
+        stats->slabs = cache->slabs;
+        stats->allocs = cache->allocs;
+        stats->frees = cache->frees;
+        spin_unlock(&cache->lock);
+        cpu_irq_restore(irq_flags);
+        return true;
+    }
+    return false;
+}
+
+void kmalloc_get_large_stats(struct kmalloc_large_stats* stats) {
+    stats->blocks = __atomic_load_n(&kmalloc_large_stats.blocks, __ATOMIC_RELAXED);
+    stats->pages = __atomic_load_n(&kmalloc_large_stats.pages, __ATOMIC_RELAXED);
+}
+
+uint64_t kmem_get_used_frames(void) {
+    uint64_t frames = __atomic_load_n(&kmalloc_large_stats.pages, __ATOMIC_RELAXED);
+    for (size_t i = 0; i < KMEM_MAX_CACHES; i++) {
+        frames += __atomic_load_n(&kmem_caches[i].slabs, __ATOMIC_RELAXED);
+    }
+    return frames;
+}
@@ -0,0 +1,72 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "spinlock.h"
+
+// --- Kernel heap ---
+
+// Objects live in slabs: one PMM frame with a small header followed by
+// equal-size slots. A cache (struct kmem_cache) owns the slabs of one object
+// size and keeps them on partial/full lists so allocation and free are O(1).
+// kmalloc rounds requests up to one of a few built-in caches; anything larger
+// than KMALLOC_MAX_SLAB gets its own block of contiguous frames.
+
+#define KMEM_MAX_CACHES 32
+#define KMEM_NAME_LEN 24
+#define KMALLOC_MAX_SLAB 1024
+
+struct kmem_slab;
+
+struct kmem_cache {
+    char name[KMEM_NAME_LEN];   // Empty = slot unused
+    size_t object_size;         // Slot size, a multiple of 16
+    uint32_t objects_per_slab;
+    struct kmem_slab* partial;  // Slabs with free and used slots
+    struct kmem_slab* full;     // Slabs with no free slot
+    struct kmem_slab* empty;    // One spare slab, kept to avoid PMM churn
+    spinlock_t lock;
+    uint64_t allocs;
+    uint64_t frees;
+    uint64_t active;            // Objects currently allocated
+    uint64_t slabs;             // Frames owned by the cache
+};
+
+// Sets up the kmalloc caches. Call once after pmm_init.
+void kmem_init(void);
+
+// Creates a cache for objects of `size` bytes (at most a frame minus the slab
+// header). Returns NULL if the size is too large or no cache slot is left.
+struct kmem_cache* kmem_cache_create(const char* name, size_t size);
+void* kmem_cache_alloc(struct kmem_cache* cache);
+void kmem_cache_free(struct kmem_cache* cache, void* obj);
+
+// General-purpose allocation, 16 byte aligned. kfree(NULL) is a no-op.
+void* kmalloc(size_t size);
+void* kzalloc(size_t size);
+void kfree(void* ptr);
+// Grows or shrinks a block, keeping its contents up to the smaller size
+void* krealloc(void* ptr, size_t size);
+
+struct kmem_cache_stats {
+    char name[KMEM_NAME_LEN];
+    size_t object_size;
+    uint64_t active;    // Objects in use
+    uint64_t total;     // Slots in all slabs
+    uint64_t slabs;
+    uint64_t allocs;
+    uint64_t frees;
+};
+
+// Enumerates caches by index (returns false when done)
+bool kmem_cache_get_stats(size_t idx, struct kmem_cache_stats* stats);
+
+struct kmalloc_large_stats {
+    uint64_t blocks;    // Large blocks currently allocated
+    uint64_t pages;     // Frames they use
+};
+void kmalloc_get_large_stats(struct kmalloc_large_stats* stats);
+
+// Frames held by the kernel heap: slabs of all caches plus large blocks
+uint64_t kmem_get_used_frames(void);
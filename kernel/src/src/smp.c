@@ -0,0 +1,154 @@
+#include "smp.h"
+#include "apic.h"
+#include "cpu.h"
+#include "gdt.h"
+#include "idt.h"
+#include "vmm.h"
+#include "sched.h"
+#include "timer.h"
+#include "serial.h"
+#include <limine.h>
+
+// Defined in main.c
+extern volatile struct limine_smp_request smp_request;
+
+#define SMP_TLB_FLUSH_PCID 1   // Flush the current PCID
+#define SMP_TLB_FLUSH_ALL  2   // Flush everything, global entries included
+
+static uint32_t smp_apic_ids[MAX_CPUS];
+static volatile unsigned int smp_cpus = 1;
+static volatile bool smp_online[MAX_CPUS];
+
+// Ticket lock: take a ticket, wait until it is served
+static volatile uint32_t kernel_lock_next = 0;
+static volatile uint32_t kernel_lock_serving = 0;
+
+// Shootdown requests (SMP_TLB_*) waiting for each CPU
+static volatile uint32_t smp_tlb_pending[MAX_CPUS];
+
+static struct smp_stats smp_stats[MAX_CPUS];
+
+unsigned int smp_cpu_count(void) {
+    return smp_cpus;
+}
+
+uint32_t smp_apic_id(unsigned int cpu) {
+    return smp_apic_ids[cpu];
+}
+
+// Carries out the shootdown requested for this CPU, if any. Cleared only
+// once done: the requester waits for it.
+static void smp_tlb_handle(unsigned int cpu) {
+    uint32_t request = __atomic_load_n(&smp_tlb_pending[cpu], __ATOMIC_ACQUIRE);
+    if (!request) {
+        return;
+    }
+    vmm_flush_tlb_local((request & SMP_TLB_FLUSH_ALL) != 0);
+    __atomic_store_n(&smp_tlb_pending[cpu], 0, __ATOMIC_RELEASE);
+}
+
+void smp_tlb_interrupt(void) {
+    smp_tlb_handle(cpu_current_id());
+    lapic_eoi();
+}
+
+void kernel_lock(void) {
+    uint32_t ticket = __atomic_fetch_add(&kernel_lock_next, 1, __ATOMIC_RELAXED);
+    if (__atomic_load_n(&kernel_lock_serving, __ATOMIC_ACQUIRE) == ticket) {
+        return;
+    }
+    unsigned int cpu = cpu_current_id();
+    uint64_t start = cpu_rdtsc();
+    while (__atomic_load_n(&kernel_lock_serving, __ATOMIC_ACQUIRE) != ticket) {
+        // Interrupts are off: the holder may be waiting on a shootdown here
+        smp_tlb_handle(cpu);
+        asm volatile("pause");
+    }
+    smp_stats[cpu].lock_waits++;
+    smp_stats[cpu].lock_wait_cycles += cpu_rdtsc() - start;
+}
+
+void kernel_unlock(void) {
+    __atomic_store_n(&kernel_lock_serving, kernel_lock_serving + 1, __ATOMIC_RELEASE);
+}
+
+void smp_send_reschedule(unsigned int cpu) {
+    lapic_send_ipi(smp_apic_ids[cpu], IPI_RESCHEDULE_VECTOR);
+}
+
+void smp_tlb_shootdown(uint32_t cpus, bool global) {
+    if (!cpus) {
+        return;
+    }
+    uint32_t request = global ? SMP_TLB_FLUSH_ALL : SMP_TLB_FLUSH_PCID;
+    for (unsigned int cpu = 0; cpu < smp_cpus; cpu++) {
+        if (cpus & (1u << cpu)) {
+            __atomic_or_fetch(&smp_tlb_pending[cpu], request, __ATOMIC_RELEASE);
+            lapic_send_ipi(smp_apic_ids[cpu], IPI_TLB_SHOOTDOWN_VECTOR);
+        }
+    }
+    for (unsigned int cpu = 0; cpu < smp_cpus; cpu++) {
+        while ((cpus & (1u << cpu)) && __atomic_load_n(&smp_tlb_pending[cpu], __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+    }
+    smp_stats[cpu_current_id()].shootdowns++;
+}
+
+bool smp_get_stats(unsigned int cpu, struct smp_stats* stats) {
+    if (cpu >= smp_cpus) {
+        return false;
+    }
+    *stats = smp_stats[cpu];
+    return true;
+}
+
+// Where application processors start, on a stack Limine provides, with
+// interrupts off
+static void smp_ap_main(struct limine_smp_info* info) {
+    unsigned int cpu = (unsigned int)info->extra_argument;
+    cpu_local_init(cpu);
+    vmm_init_cpu();
+    gdt_init_cpu(cpu);
+    idt_init_cpu();
+    cpu_init();
+    lapic_init_cpu();
+    timer_init_cpu();
+    __atomic_store_n(&smp_online[cpu], true, __ATOMIC_RELEASE);
+    sched_start_cpu(); // Never returns
+}
+
+void smp_init(void) {
+    struct limine_smp_response* smp = smp_request.response;
+    if (!smp || !lapic_regs) {
+        serial_write("SMP: Running on the bootstrap processor only\n", 45);
+        return;
+    }
+    smp_apic_ids[0] = smp->bsp_lapic_id;
+    smp_online[0] = true;
+
+    // One at a time, so each is online before the next starts
+    for (uint64_t i = 0; i < smp->cpu_count; i++) {
+        struct limine_smp_info* info = smp->cpus[i];
+        if (info->lapic_id == smp->bsp_lapic_id) {
+            continue;
+        }
+        unsigned int cpu = smp_cpus;
+        if (cpu >= MAX_CPUS) {
+            serial_write("SMP: Too many CPUs, ignoring the rest\n", 38);
+            break;
+        }
+        smp_apic_ids[cpu] = info->lapic_id;
+        info->extra_argument = cpu;
+        __atomic_store_n(&info->goto_address, smp_ap_main, __ATOMIC_SEQ_CST);
+        while (!__atomic_load_n(&smp_online[cpu], __ATOMIC_ACQUIRE)) {
+            asm volatile("pause");
+        }
+        // Only now do shootdowns and placement consider it
+        smp_cpus = cpu + 1;
+    }
+
+    serial_write("SMP: 0x", 7);
+    serial_print_hex(smp_cpus);
+    serial_write(" CPUs online\n", 13);
+}
@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// --- Multiprocessing ---
+
+// smp_init starts the application processors Limine reports. Each one loads
+// its own GDT and TSS, the shared IDT and the kernel page tables, enables
+// its local APIC timer and then runs its idle task until the scheduler
+// hands it a process.
+//
+// The kernel itself is serialized by one lock: a CPU holds it whenever it
+// runs kernel code other than its idle loop, and takes it on entry from
+// user mode (syscalls, exceptions, preemption). User code runs on every CPU
+// in parallel. A context switch happens with the lock held and the process
+// switched to carries on holding it.
+
+// Starts the application processors. Call with the kernel lock held, after
+// sched_init and timer_init.
+void smp_init(void);
+
+// CPUs online; they are numbered from 0 (the bootstrap processor)
+unsigned int smp_cpu_count(void);
+
+// Local APIC ID of a CPU
+uint32_t smp_apic_id(unsigned int cpu);
+
+// The kernel lock (a ticket lock, so CPUs get it in arrival order). Only
+// taken with interrupts off.
+void kernel_lock(void);
+void kernel_unlock(void);
+
+// Interrupts a CPU halted in its idle loop so it looks at its run queue
+void smp_send_reschedule(unsigned int cpu);
+
+// Makes every CPU in the `cpus` bitmask flush its TLB entries of its current
+// PCID, or all entries (global ones included) if global is set, and waits
+// until they have. Called with the kernel lock held.
+void smp_tlb_shootdown(uint32_t cpus, bool global);
+
+// Handles IPI_TLB_SHOOTDOWN_VECTOR
+void smp_tlb_interrupt(void);
+
+struct smp_stats {
+    uint64_t shootdowns;       // smp_tlb_shootdown calls that sent IPIs
+    uint64_t lock_waits;       // Times kernel_lock found the lock taken
+    uint64_t lock_wait_cycles; // ... and cycles spent waiting for it
+};
+// Counters of one CPU; false past the last CPU online
+bool smp_get_stats(unsigned int cpu, struct smp_stats* stats);
@@ -0,0 +1,23 @@
+#pragma once
+
+#include <stdint.h>
+
+// Minimal test-and-test-and-set spinlock. Callers that can race with
+// interrupt handlers must disable interrupts (cpu_irq_save) before locking.
+typedef struct {
+    volatile uint32_t locked;
+} spinlock_t;
+
+#define SPINLOCK_INIT { 0 }
+
+static inline void spin_lock(spinlock_t *lock) {
+    while (__atomic_exchange_n(&lock->locked, 1, __ATOMIC_ACQUIRE)) {
+        while (lock->locked) {
+            asm volatile("pause");
+        }
+    }
+}
+
+static inline void spin_unlock(spinlock_t *lock) {
+    __atomic_store_n(&lock->locked, 0, __ATOMIC_RELEASE);
+}
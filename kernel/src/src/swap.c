@@ -0,0 +1,285 @@
+#include "swap.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "serial.h"
+#include "lib/string.h"
+
+#define SWAP_SECTORS_PER_SLOT (PAGE_SIZE / BLOCK_SECTOR_SIZE)
+#define SWAP_COUNT_MAX 0xFF
+
+struct swap_area {
+    struct block_device* dev; // NULL = unused
+    int priority;
+    uint64_t slots;
+    uint64_t used;
+    uint64_t hint;    // Where the search for a free slot starts
+    uint8_t* counts;  // References per slot, 0 = free
+};
+
+static struct swap_area swap_areas[SWAP_MAX_AREAS];
+
+// Protects the slot counts of every area
+static spinlock_t swap_lock = SPINLOCK_INIT;
+
+// Clock hand: the next page the reclaim scan looks at
+static unsigned int swap_hand_as = 0;
+static uint64_t swap_hand_page = 0;
+static bool swap_reclaiming = false;
+
+static struct swap_stats swap_stats;
+
+static inline struct swap_area* swap_entry_area(uint64_t entry) {
+    return &swap_areas[entry & (SWAP_MAX_AREAS - 1)];
+}
+
+static inline uint64_t swap_entry_slot(uint64_t entry) {
+    return entry >> SWAP_AREA_BITS;
+}
+
+bool swap_on(struct block_device* dev, int priority) {
+    int free_idx = -1;
+    for (int i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i].dev == dev) {
+            return false;
+        }
+        if (!swap_areas[i].dev && free_idx < 0) {
+            free_idx = i;
+        }
+    }
+    uint64_t slots = dev->sectors / SWAP_SECTORS_PER_SLOT;
+    if (free_idx < 0 || slots == 0) {
+        return false;
+    }
+    uint8_t* counts = kzalloc(slots);
+    if (!counts) {
+        return false;
+    }
+
+    struct swap_area* area = &swap_areas[free_idx];
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&swap_lock);
+    area->priority = priority;
+    area->slots = slots;
+    area->used = 0;
+    area->hint = 0;
+    area->counts = counts;
+    area->dev = dev;
+    spin_unlock(&swap_lock);
+    cpu_irq_restore(irq_flags);
+
+    pmm_set_reclaim(swap_reclaim);
+    serial_write("swap: Enabled on ", 17);
+    serial_write(dev->name, strlen(dev->name));
+    serial_write(", slots: 0x", 11);
+    serial_print_hex(slots);
+    serial_write("\n", 1);
+    return true;
+}
+
+// Takes a free slot from the highest-priority area that has one
+static bool swap_alloc_slot(uint64_t* entry) {
+    bool found = false;
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&swap_lock);
+    struct swap_area* best = NULL;
+    for (int i = 0; i < SWAP_MAX_AREAS; i++) {
+        struct swap_area* area = &swap_areas[i];
+        if (area->dev && area->used < area->slots && (!best || area->priority > best->priority)) {
+            best = area;
+        }
+    }
+    if (best) {
+        for (uint64_t n = 0; n < best->slots; n++) {
+            uint64_t slot = (best->hint + n) % best->slots;
+            if (best->counts[slot] == 0) {
+                best->counts[slot] = 1;
+                best->used++;
+                best->hint = slot + 1;
+                *entry = (slot << SWAP_AREA_BITS) | (uint64_t)(best - swap_areas);
+                found = true;
+                break;
+            }
+        }
+    }
+    spin_unlock(&swap_lock);
+    cpu_irq_restore(irq_flags);
+    return found;
+}
+
+bool swap_dup(uint64_t entry) {
+    struct swap_area* area = swap_entry_area(entry);
+    bool ok = false;
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&swap_lock);
+    uint8_t* count = &area->counts[swap_entry_slot(entry)];
+    if (*count < SWAP_COUNT_MAX) {
+        (*count)++;
+        ok = true;
+    }
+    spin_unlock(&swap_lock);
+    cpu_irq_restore(irq_flags);
+    return ok;
+}
+
+void swap_free(uint64_t entry) {
+    struct swap_area* area = swap_entry_area(entry);
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&swap_lock);
+    uint8_t* count = &area->counts[swap_entry_slot(entry)];
+    if (*count > 0 && --(*count) == 0) {
+        area->used--;
+        // Under the lock, before the slot can be reused: lets a compressing
+        // device (zram) give the memory back
+        blockdev_discard(area->dev, swap_entry_slot(entry) * SWAP_SECTORS_PER_SLOT,
+                         SWAP_SECTORS_PER_SLOT);
+    }
+    spin_unlock(&swap_lock);
+    cpu_irq_restore(irq_flags);
+}
+
+bool swap_in(uint64_t entry, void* frame) {
+    struct swap_area* area = swap_entry_area(entry);
+    if (!blockdev_read(area->dev, swap_entry_slot(entry) * SWAP_SECTORS_PER_SLOT,
+                       SWAP_SECTORS_PER_SLOT, phys_to_virt((uint64_t)frame))) {
+        serial_write("swap: Read error\n", 17);
+        return false;
+    }
+    swap_free(entry);
+    swap_stats.swap_ins++;
+    return true;
+}
+
+void swap_account_fault(uint64_t cycles) {
+    swap_stats.fault_cycles += cycles;
+    if (cycles > swap_stats.fault_max) {
+        swap_stats.fault_max = cycles;
+    }
+}
+
+// --- Reclaim ---
+
+// Only private user frames are swapped: shared ones (fork, page cache,
+// merged) would need every mapping found and updated
+static bool swap_candidate(uint64_t phys) {
+    return pmm_get_category((void*)phys) == MEMSTAT_USER && pmm_frame_sharers((void*)phys) == 0;
+}
+
+// Advances the clock hand to the next page inside an area. Returns false
+// when the hand wraps around to the first address space.
+static bool swap_next_page(struct address_space** as_out, uint64_t* page_out) {
+    while (swap_hand_as < VMM_MAX_ADDRESS_SPACES) {
+        struct address_space* as = vmm_get_address_space(swap_hand_as);
+        for (unsigned int i = 0; as && i < as->area_count; i++) {
+            const struct vmm_area* area = &as->areas[i];
+            if (area->end > swap_hand_page) {
+                uint64_t page = area->start > swap_hand_page ? area->start : swap_hand_page;
+                swap_hand_page = page + PAGE_SIZE;
+                *as_out = as;
+                *page_out = page;
+                return true;
+            }
+        }
+        swap_hand_as++;
+        swap_hand_page = 0;
+    }
+    swap_hand_as = 0;
+    return false;
+}
+
+// Writes one page out; returns false if swap is full or failed
+static bool swap_out(struct address_space* as, uint64_t page, uint64_t phys) {
+    uint64_t entry;
+    if (!swap_alloc_slot(&entry)) {
+        return false;
+    }
+    // A store from another CPU after the copy would be lost with the
+    // frame: the page stays read-only until the PTE points at the copy
+    uint64_t old_pte = vmm_write_protect(as, page);
+    struct swap_area* area = swap_entry_area(entry);
+    if (!blockdev_write(area->dev, swap_entry_slot(entry) * SWAP_SECTORS_PER_SLOT,
+                        SWAP_SECTORS_PER_SLOT, phys_to_virt(phys))) {
+        serial_write("swap: Write error\n", 18);
+        vmm_write_restore(as, page, old_pte);
+        swap_free(entry);
+        return false;
+    }
+    if (!vmm_swap_out_page(as, page, phys, entry)) {
+        swap_free(entry);
+        return true; // The page went away meanwhile; keep scanning
+    }
+    swap_stats.swap_outs++;
+    return true;
+}
+
+uint64_t swap_reclaim(uint64_t frames) {
+    // Reclaim runs inside pmm_alloc_frame; never recurse into it
+    if (swap_reclaiming) {
+        return 0;
+    }
+    swap_reclaiming = true;
+    uint64_t start = cpu_rdtsc();
+    uint64_t before = swap_stats.swap_outs;
+    swap_stats.reclaims++;
+
+    // Page tables are not locked; keep interrupt handlers off them
+    uint64_t irq_flags = cpu_irq_save();
+    // Two turns of the clock: the first may only clear accessed bits
+    unsigned int wraps = 0;
+    while (swap_stats.swap_outs - before < frames && wraps < 2) {
+        struct address_space* as;
+        uint64_t page;
+        if (!swap_next_page(&as, &page)) {
+            wraps++;
+            continue;
+        }
+        pte_t* pte = vmm_get_user_pte(as, page);
+        if (!pte) {
+            // No page table: nothing is mapped up to the next 2MiB boundary
+            swap_hand_page = (page | (PAGE_SIZE_2M - 1)) + 1;
+            continue;
+        }
+        if (!(*pte & PTE_PRESENT) || !swap_candidate(*pte & PTE_ADDR_MASK)) {
+            continue;
+        }
+        swap_stats.scanned++;
+        if (vmm_test_and_clear_accessed(as, page)) {
+            continue; // Used since the hand last passed: second chance
+        }
+        if (!swap_out(as, page, *pte & PTE_ADDR_MASK)) {
+            break;
+        }
+    }
+    cpu_irq_restore(irq_flags);
+
+    uint64_t freed = swap_stats.swap_outs - before;
+    swap_stats.out_cycles += cpu_rdtsc() - start;
+    swap_reclaiming = false;
+    return freed;
+}
+
+void swap_get_stats(struct swap_stats* stats) {
+    *stats = swap_stats;
+    stats->slots = 0;
+    stats->used = 0;
+    for (int i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i].dev) {
+            stats->slots += swap_areas[i].slots;
+            stats->used += swap_areas[i].used;
+        }
+    }
+}
+
+bool swap_get_area(unsigned int idx, struct swap_area_info* info) {
+    for (int i = 0; i < SWAP_MAX_AREAS; i++) {
+        if (swap_areas[i].dev && idx-- == 0) {
+            info->device = swap_areas[i].dev->name;
+            info->priority = swap_areas[i].priority;
+            info->slots = swap_areas[i].slots;
+            info->used = swap_areas[i].used;
+            return true;
+        }
+    }
+    return false;
+}
@@ -0,0 +1,64 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+// --- Swap ---
+
+// Private user pages can be written out to swap areas on block devices when
+// the PMM runs out of frames. A swapped-out page keeps a swap entry in its
+// (non-present) PTE, see pte_make_swap in vmm.h, and the page fault handler
+// reads it back on the next access.
+//
+// Pages to evict are picked by a clock over all user address spaces: a page
+// whose PTE_ACCESSED bit is set gets the bit cleared and a second chance,
+// one found with the bit still clear is written out.
+//
+// A swap entry names an area (low SWAP_AREA_BITS bits) and a page-sized slot
+// in it. Slots are reference counted so a fork can share them.
+
+#define SWAP_MAX_AREAS 4
+#define SWAP_AREA_BITS 2
+
+// Turns dev into a swap area and enables reclaim. Areas with a higher
+// priority fill up first. Returns false if the device is already in use,
+// too small, or no area slot or memory is left.
+bool swap_on(struct block_device* dev, int priority);
+
+// Writes up to `frames` cold pages out to swap and frees their frames.
+// Called by the PMM when it runs dry; returns the number of frames freed.
+uint64_t swap_reclaim(uint64_t frames);
+
+// Reads the page of entry into frame (physical address) and drops the
+// caller's reference to the slot. Returns false on an I/O error.
+bool swap_in(uint64_t entry, void* frame);
+// Adds a reference to a slot (fork); false if its count is saturated
+bool swap_dup(uint64_t entry);
+// Drops a reference to a slot (unmap, exit)
+void swap_free(uint64_t entry);
+
+// Records the cycles spent in one swap-in page fault
+void swap_account_fault(uint64_t cycles);
+
+struct swap_stats {
+    uint64_t slots;          // Slots in all areas
+    uint64_t used;           // Slots holding a page
+    uint64_t swap_outs;      // Pages written out
+    uint64_t swap_ins;       // Pages read back
+    uint64_t reclaims;       // Calls from the PMM
+    uint64_t scanned;        // PTEs looked at by the clock
+    uint64_t out_cycles;     // Total cycles writing pages out
+    uint64_t fault_cycles;   // Total cycles in swap-in faults
+    uint64_t fault_max;      // Slowest swap-in fault
+};
+void swap_get_stats(struct swap_stats* stats);
+
+struct swap_area_info {
+    const char* device;
+    int priority;
+    uint64_t slots;
+    uint64_t used;
+};
+// Enumerates active areas by index (returns false when done)
+bool swap_get_area(unsigned int idx, struct swap_area_info* info);
@@ -9,8 +9,11 @@
 #include "serial.h" // Needed for serial_write in fork syscall
 #include "flanterm.h" // Include the full definition of flanterm_context
 #include "vmm.h"     // For vmm_get_current_address_space and vmm_switch_address_space
-#include "shell.h"   // For shell_run
-#include "exec.h"    // For exec_elf
+#include "slab.h"    // For the file descriptor cache
+#include "memstat.h" // For memstat_get_meminfo
+#include "uaccess.h" // For copy_from_user, copy_to_user, strncpy_from_user
+#include "sched.h"   // For the current process, fork and exit
+#include "smp.h"     // For the kernel lock
 
 // Define user memory layout constants (copied from exec.c)
 #define USER_STACK_PAGES 8 // Number of pages for the stack (8 * 4KiB = 32KiB)
@@ -19,6 +22,13 @@
 // Bottom address so that exactly USER_STACK_PAGES pages are covered
 #define USER_STACK_BOTTOM_VADDR (USER_STACK_TOP_VADDR - ((USER_STACK_PAGES - 1) * PAGE_SIZE))
 
+// mmap places mappings in [USER_MMAP_BASE, USER_STACK_BOTTOM_VADDR); the heap
+// (brk) grows from the end of the program image up to USER_MMAP_BASE
+#define USER_MMAP_BASE 0x40000000
+
+// Bytes of console output staged on the syscall stack per flanterm_write
+#define SYSCALL_CONSOLE_CHUNK 256
+
 // External functions we'll need
 extern struct flanterm_context *ft_ctx;
 // extern void serial_write(const char *buf, size_t length); // Removed
@@ -34,11 +44,9 @@ extern void flanterm_flush(struct flanterm_context *ctx);
 // --- GDT Selectors (Ensure these match your GDT!) ---
 #define KERNEL_CODE_SELECTOR 0x08
 #define KERNEL_DATA_SELECTOR 0x10
-#define USER_CODE_SELECTOR   0x1B // From usermode_entry.asm (0x18 | 3)
-#define USER_DATA_SELECTOR   0x23 // From usermode_entry.asm (0x20 | 3)
 
-// External declaration for the assembly syscall entry point
-extern void syscall_asm_entry(void);
+// Per-CPU syscall entry points, from syscall_entry.asm
+extern void syscall_entry(void);
 
 // Helper function to write MSR
 static inline void wrmsr(uint32_t msr_id, uint64_t value) {
@@ -62,82 +70,44 @@ static inline uint64_t rdmsr(uint32_t msr_id) {
     return ((uint64_t)high << 32) | low;
 }
 
-// Simple file descriptor table
+// Each process has its own file descriptor table (struct process). Open
+// descriptors are allocated from fd_cache; NULL = fd unused.
 struct file_descriptor {
     struct fs_file *file;
     size_t position;
-    bool used;
-} fd_table[MAX_FDS];
-
-// Basic check: ensure address is below kernel space
-// TODO: Implement robust user memory validation using page tables.
-// This basic check is NOT sufficient for security or stability.
-#define KERNEL_VMA_BASE 0xffff800000000000
-
-static bool validate_user_memory(uint64_t vaddr, size_t size, bool write_access) {
-    // Check for null pointer or zero size
-    if (vaddr == 0 || size == 0) {
-        return false;
-    }
-
-    // Check for overflow
-    uint64_t end_addr;
-    if (__builtin_add_overflow(vaddr, size - 1, &end_addr)) {
-        return false; // Overflow occurred
-    }
-
-    // Basic check: ensure the entire range is below kernel base
-    if (vaddr >= KERNEL_VMA_BASE || end_addr >= KERNEL_VMA_BASE) {
-        return false;
-    }
-
-    // TODO: Add page table checks here!
-    // Iterate through pages covered by [vaddr, end_addr]
-    // For each page:
-    // 1. Translate virtual address to physical address using current process's page tables.
-    // 2. Check if the page table entry exists (present bit).
-    // 3. Check if the user access bit is set.
-    // 4. If write_access is true, check if the writeable bit is set.
-    // If any check fails, return false.
-
-    (void)write_access; // Mark as unused until page table checks are implemented
+};
+static struct kmem_cache *fd_cache;
 
-    return true; // Placeholder: Assume valid if basic checks pass
+// Returns the open file behind fd, or NULL (stdin/stdout/stderr included)
+static struct file_descriptor *fd_get(uint64_t fd) {
+    if (fd < 3 || fd >= MAX_FDS) return NULL;
+    return sched_current()->fds[fd];
 }
 
-// Optimized copy function using memcpy, with basic validation.
-// Returns number of bytes copied, or -1 on error (invalid address range).
-static int64_t copy_from_user(void *kdest, const void *user_src, size_t size) {
-    if (!validate_user_memory((uint64_t)user_src, size, false)) {
-        // Consider logging this error via a kernel mechanism if available,
-        // but avoid direct serial writes here.
-        return -1; // Indicate error (EFAULT)
+void syscall_close_fds(struct file_descriptor **fds) {
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (fds[i]) {
+            kmem_cache_free(fd_cache, fds[i]);
+            fds[i] = NULL;
+        }
     }
-
-    // TODO: Implement proper fault handling around this memcpy.
-    // If a page fault occurs during the copy, it should be handled gracefully.
-    memcpy(kdest, user_src, size);
-
-    return (int64_t)size;
 }
 
-// Optimized copy function using memcpy, with basic validation.
-// Returns number of bytes copied, or -1 on error (invalid address range).
-static int64_t copy_to_user(void *user_dest, const void *ksrc, size_t size) {
-    if (!validate_user_memory((uint64_t)user_dest, size, true)) {
-        // Consider logging this error via a kernel mechanism if available,
-        // but avoid direct serial writes here.
-        return -1; // Indicate error (EFAULT)
+bool syscall_clone_fds(struct file_descriptor **dst, struct file_descriptor *const *src) {
+    for (int i = 0; i < MAX_FDS; i++) {
+        if (!src[i]) {
+            continue;
+        }
+        dst[i] = kmem_cache_alloc(fd_cache);
+        if (!dst[i]) {
+            syscall_close_fds(dst);
+            return false;
+        }
+        *dst[i] = *src[i];
     }
-
-    // TODO: Implement proper fault handling around this memcpy.
-    // If a page fault occurs during the copy, it should be handled gracefully.
-    memcpy(user_dest, ksrc, size);
-
-    return (int64_t)size;
+    return true;
 }
 
-
 // Syscall implementations
 static int64_t sys_exit(uint64_t code, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
     (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
@@ -179,9 +149,8 @@ static int64_t sys_exit(uint64_t code, uint64_t arg2, uint64_t arg3, uint64_t ar
         flanterm_flush(ft_ctx);
     }
 
-    // Return a special value to indicate process exit
-    // This will be caught in the syscall handler
-    return 0xDEAD; // Special marker for process exit
+    // Frees the process and runs the next one
+    sched_exit((int64_t)code);
 }
 
 static int64_t sys_write(uint64_t fd, uint64_t buf_ptr, uint64_t count, uint64_t arg4, uint64_t arg5) {
@@ -191,56 +160,41 @@ static int64_t sys_write(uint64_t fd, uint64_t buf_ptr, uint64_t count, uint64_t
     if (count == 0) {
         return 0; // Writing 0 bytes is valid and does nothing
     }
-    // Basic validation of buf_ptr is done in copy_from_user
-
-    // Limit write size to prevent excessive kernel buffer usage for now.
-    // A better approach would handle large writes in chunks.
-    if (count > 4096) {
-        count = 4096;
-    }
+    // buf_ptr is validated by copy_from_user
 
     // Handle standard output / standard error
     if (fd == STDOUT_FD || fd == STDERR_FD) {
-        // Allocate a temporary kernel buffer
-        // NOTE: Using a fixed-size stack buffer is simple but risky for large counts.
-        // Consider dynamic allocation or a dedicated buffer pool for robustness.
-        char kbuf[4096]; // Use a kernel buffer matching the max count
-        size_t bytes_to_copy = count;
-
-        // Safely copy data from user space to kernel buffer
-        int64_t copied_bytes = copy_from_user(kbuf, (const void *)buf_ptr, bytes_to_copy);
-
-        if (copied_bytes < 0) {
-            return -1; // Return error (EFAULT)
+        // The terminal can't read user memory itself (SMAP), so the text
+        // goes through a small stack buffer, one chunk at a time
+        char kbuf[SYSCALL_CONSOLE_CHUNK];
+        size_t written = 0;
+        while (written < count) {
+            size_t chunk = count - written;
+            if (chunk > sizeof(kbuf)) {
+                chunk = sizeof(kbuf);
+            }
+            if (copy_from_user(kbuf, (const char *)buf_ptr + written, chunk) < 0) {
+                break; // EFAULT, reported below unless part was written
+            }
+            if (ft_ctx) { // Check if terminal context is available
+                flanterm_write(ft_ctx, kbuf, chunk);
+            }
+            written += chunk;
         }
-
-        // Write the data from the kernel buffer to the terminal
-        if (ft_ctx) { // Check if terminal context is available
-            flanterm_write(ft_ctx, kbuf, (size_t)copied_bytes);
+        if (ft_ctx && written > 0) {
             flanterm_flush(ft_ctx);
         }
 
-        return copied_bytes; // Return the number of bytes written
+        return written > 0 ? (int64_t)written : -1;
     }
-    // Handle file output
-    else if (fd >= 3 && fd < MAX_FDS && fd_table[fd].used) {
-        struct file_descriptor *desc = &fd_table[fd];
-        struct fs_file *file = desc->file;
-
-        // TODO: Implement file writing. Requires fs_write or similar.
-        // Need to copy data from user space first.
-        // char kbuf[4096]; // Or use dynamic allocation
-        // size_t bytes_to_write = count;
-        // if (bytes_to_write > sizeof(kbuf)) bytes_to_write = sizeof(kbuf);
-        // int64_t copied = copy_from_user(kbuf, (const void *)buf_ptr, bytes_to_write);
-        // if (copied < 0) return -1;
-        // int64_t written = fs_write(file, desc->position, kbuf, copied);
-        // if (written > 0) desc->position += written;
-        // return written;
-
-        (void)desc; // Mark unused until implemented
-        (void)file; // Mark unused until implemented
-        return -1; // File writing not implemented yet
+    // Handle file output: copied straight from the caller into the file
+    else if (fd_get(fd)) {
+        struct file_descriptor *desc = fd_get(fd);
+        int64_t written = fs_write_user(desc->file, desc->position, (const void *)buf_ptr, count);
+        if (written > 0) {
+            desc->position += written;
+        }
+        return written;
     }
 
     return -1; // Invalid fd or other error (EBADF)
@@ -257,63 +211,51 @@ static int64_t sys_read(uint64_t fd, uint64_t buf_ptr, uint64_t count, uint64_t
     // Read from standard input
     // ----------------------
     if (fd == STDIN_FD) {
+        // Input arrives one key at a time; each goes straight to the caller
         size_t read_bytes = 0;
-        char kbuf[4096];
-        size_t to_read = count > sizeof(kbuf) ? sizeof(kbuf) : count;
 
-        while (read_bytes < to_read) {
+        while (read_bytes < count) {
             char c = keyboard_read_char();
             if (!c)
                 continue;
             // Translate carriage return to newline for convenience
             if (c == '\r')
                 c = '\n';
-            kbuf[read_bytes++] = c;
+            if (copy_to_user((char *)buf_ptr + read_bytes, &c, 1) < 0)
+                return -1; // EFAULT
+            read_bytes++;
             if (c == '\n')
                 break;
         }
 
-        int64_t copied = copy_to_user((void *)buf_ptr, kbuf, read_bytes);
-        if (copied < 0)
-            return -1;
-        return copied;
+        return (int64_t)read_bytes;
     }
     // ----------------------
     // Read from an opened file
     // ----------------------
-    else if (fd >= 3 && fd < MAX_FDS && fd_table[fd].used) {
-        struct file_descriptor *desc = &fd_table[fd];
-        struct fs_file *file = desc->file;
-
-        // Calculate bytes to read using filesystem helper
-        size_t to_read = count;
-        if (to_read > 4096)
-            to_read = 4096;
-
-        char kbuf[4096];
-        size_t bytes_read = fs_read(file, desc->position, kbuf, to_read);
-
-        if (bytes_read == 0)
-            return 0; // EOF
+    else if (fd_get(fd)) {
+        struct file_descriptor *desc = fd_get(fd);
 
-        int64_t copied = copy_to_user((void *)buf_ptr, kbuf, bytes_read);
-        if (copied < 0)
+        // Copied straight from the file's backing store to the caller
+        int64_t bytes_read = fs_read_user(desc->file, desc->position, (void *)buf_ptr, count);
+        if (bytes_read < 0)
             return -1; // EFAULT
 
-        desc->position += bytes_read;
-        return copied;
+        desc->position += (size_t)bytes_read;
+        return bytes_read; // 0 at EOF
     }
 
     return -1; // Invalid fd (EBADF)
 }
 
 static int64_t sys_open(uint64_t path_ptr, uint64_t flags, uint64_t mode, uint64_t arg4, uint64_t arg5) {
-    (void)flags; (void)mode; (void)arg4; (void)arg5; // Mark unused (flags/mode ignored for now)
+    (void)mode; (void)arg4; (void)arg5; // Mark unused (mode ignored for now)
 
     // Find a free file descriptor (starting from 3)
+    struct file_descriptor **fd_table = sched_current()->fds;
     int fd = -1;
     for (int i = 3; i < MAX_FDS; i++) {
-        if (!fd_table[i].used) {
+        if (!fd_table[i]) {
             fd = i;
             break;
         }
@@ -323,38 +265,34 @@ static int64_t sys_open(uint64_t path_ptr, uint64_t flags, uint64_t mode, uint64
         return -1; // No free file descriptors (EMFILE)
     }
 
-    // Copy path from user space
-    // Assume max path length for simplicity. A better way involves dynamic allocation or checking size.
+    // Copy path from user space, stopping at its terminator
     char kpath[256];
-    // Need to determine path length first, or copy byte-by-byte until null terminator
-    // Simple approach: Assume null-terminated string within a reasonable limit
-    // This is UNSAFE if the user provides a non-null-terminated string or invalid pointer!
-    // TODO: Implement safe string copy from user space (e.g., strncpy_from_user)
-    int64_t copied_len = copy_from_user(kpath, (const void *)path_ptr, sizeof(kpath) - 1);
-    if (copied_len < 0) {
+    int64_t path_len = strncpy_from_user(kpath, (const char *)path_ptr, sizeof(kpath));
+    if (path_len < 0) {
         return -1; // EFAULT
     }
-    kpath[copied_len] = '\0'; // Ensure null termination
-
-    // Find the null terminator within the copied buffer to get actual length
-    size_t path_len = strnlen(kpath, sizeof(kpath));
-    if (path_len >= sizeof(kpath) -1) { // Check if null terminator was actually found within bounds
-        // Path might be too long or not null-terminated properly
-        return -1; // ENAMETOOLONG or EFAULT
+    if ((size_t)path_len == sizeof(kpath)) {
+        return -1; // ENAMETOOLONG
     }
 
     // Open the file using the kernel path
     struct fs_file *file = fs_open(kpath);
 
+    if (file == NULL && (flags & O_CREAT)) {
+        file = fs_create_file(kpath);
+    }
     if (file == NULL) {
-        // TODO: Handle file creation based on flags (O_CREAT)
         return -1; // File not found (ENOENT)
     }
 
     // Initialize the file descriptor
-    fd_table[fd].file = file;
-    fd_table[fd].position = 0;
-    fd_table[fd].used = true;
+    struct file_descriptor *desc = kmem_cache_alloc(fd_cache);
+    if (!desc) {
+        return -1; // ENOMEM
+    }
+    desc->file = file;
+    desc->position = 0;
+    fd_table[fd] = desc;
 
     return fd;
 }
@@ -363,11 +301,11 @@ static int64_t sys_close(uint64_t fd, uint64_t arg2, uint64_t arg3, uint64_t arg
     (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
 
     // Check if fd is valid and in use (excluding stdin, stdout, stderr)
-    if (fd >= 3 && fd < MAX_FDS && fd_table[fd].used) {
+    struct file_descriptor *desc = fd_get(fd);
+    if (desc) {
         // Mark as unused
-        fd_table[fd].used = false;
-        fd_table[fd].file = NULL; // Clear file pointer
-        fd_table[fd].position = 0;
+        sched_current()->fds[fd] = NULL;
+        kmem_cache_free(fd_cache, desc);
         // We don't actually 'close' the underlying fs_file here, assuming
         // the filesystem manages its lifetime. If needed, call fs_close(file).
         return 0; // Success
@@ -389,13 +327,10 @@ static int64_t sys_readdir(uint64_t index, uint64_t buf_ptr, uint64_t buf_size,
     if (buf_size < sizeof(struct dirent)) {
         return -1; // Buffer too small (EINVAL)
     }
-    if (!validate_user_memory(buf_ptr, sizeof(struct dirent), true)) {
-        return -1; // Invalid buffer pointer (EFAULT)
-    }
 
     // Get the list of files from the filesystem
     size_t nfiles = 0;
-    const struct fs_file *files = fs_list(&nfiles);
+    const struct fs_file *const *files = fs_list(&nfiles);
 
     // Check if the requested index is valid
     if (index >= nfiles) {
@@ -403,7 +338,7 @@ static int64_t sys_readdir(uint64_t index, uint64_t buf_ptr, uint64_t buf_size,
     }
 
     // Get the file info for the requested index
-    const struct fs_file *file_info = &files[index];
+    const struct fs_file *file_info = files[index];
 
     // Prepare the dirent structure in kernel space
     struct dirent kdirent;
@@ -424,32 +359,6 @@ static int64_t sys_readdir(uint64_t index, uint64_t buf_ptr, uint64_t buf_size,
 }
 
 
-// Structure to store process context for fork
-struct fork_context {
-    // Registers saved by syscall_asm_entry
-    uint64_t r15;
-    uint64_t r14;
-    uint64_t r13;
-    uint64_t r12;
-    uint64_t rbx;
-    uint64_t rbp;
-    // Return address (RIP) saved by syscall instruction
-    uint64_t rip;
-    // User stack pointer
-    uint64_t rsp;
-    // RFLAGS register
-    uint64_t rflags;
-};
-
-// Simple PID counter for fork
-static uint64_t next_pid = 1;
-
-// External declarations needed for fork
-extern void* syscall_stack_top; // From syscall_entry.asm
-extern uint64_t user_rsp_storage; // From syscall_entry.asm
-extern uint64_t user_rip_storage; // From syscall_entry.asm
-extern uint64_t user_rflags_storage; // From syscall_entry.asm
-
 // Implementation of the fork syscall
 static int64_t sys_fork(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
     (void)arg1; (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
@@ -457,149 +366,175 @@ static int64_t sys_fork(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t ar
     serial_write("[FORK] Starting fork syscall\n", 29);
 
     // 1. Get the current process's address space
-    pml4_t* parent_pml4 = vmm_get_current_address_space();
-    if (!parent_pml4) {
+    struct address_space* parent_as = vmm_get_current_address_space();
+    if (parent_as == &g_kernel_address_space) {
         serial_write("[FORK] Error: Failed to get parent address space\n", 48);
         return -1;
     }
 
     // 2. Create a new address space for the child process
-    pml4_t* child_pml4 = vmm_create_address_space();
-    if (!child_pml4) {
+    struct address_space* child_as = vmm_create_address_space();
+    if (!child_as) {
         serial_write("[FORK] Error: Failed to create child address space\n", 50);
         return -1;
     }
 
-    // 3. Save the current process context
-    struct fork_context context;
-    // Get user stack pointer and instruction pointer from syscall_entry.asm
-    context.rsp = user_rsp_storage;
-    context.rip = user_rip_storage;
-    context.rflags = user_rflags_storage;
-    
-    // Get callee-saved registers from the stack
-    // These were pushed in syscall_asm_entry in the order: rbp, rbx, r12, r13, r14, r15
-    // The stack layout at this point is:
-    // [syscall_stack_top - 8*1] -> r15
-    // [syscall_stack_top - 8*2] -> r14
-    // [syscall_stack_top - 8*3] -> r13
-    // [syscall_stack_top - 8*4] -> r12
-    // [syscall_stack_top - 8*5] -> rbx
-    // [syscall_stack_top - 8*6] -> rbp
-    uint64_t* stack_ptr = (uint64_t*)syscall_stack_top;
-    context.r15 = *(stack_ptr - 1);
-    context.r14 = *(stack_ptr - 2);
-    context.r13 = *(stack_ptr - 3);
-    context.r12 = *(stack_ptr - 4);
-    context.rbx = *(stack_ptr - 5);
-    context.rbp = *(stack_ptr - 6);
-
-    // 4. Copy the parent's memory to the child
-    // We need to iterate through the parent's address space and copy all user pages
-    // For simplicity, we'll copy all pages below KERNEL_VMA_BASE
-    // This is a simplified approach and would need to be improved for a real OS
-    
-    // Define the user address space range
-    uint64_t user_start = 0;
-    /*
-     * The original implementation attempted to iterate all pages up to
-     * KERNEL_VMA_BASE (0xffff800000000000). This results in an absurdly large
-     * loop (trillions of iterations) and effectively locks the kernel during
-     * fork.  User space in this project only occupies the lower 2GiB so limit
-     * the copy range accordingly.  This keeps the loop bounded to roughly half
-     * a million iterations while still covering all user pages.
-     */
-    uint64_t user_end = USER_STACK_TOP_VADDR + PAGE_SIZE;
-    uint64_t page_size = PAGE_SIZE;
-    
-    // Iterate through the user address space
-    for (uint64_t vaddr = user_start; vaddr < user_end; vaddr += page_size) {
-        // Get the physical address for this virtual address in the parent
-        uint64_t parent_phys = vmm_get_physical_address(parent_pml4, vaddr);
-        
-        // Skip if not mapped
-        if (parent_phys == 0) {
-            continue;
+    // 3. Share the parent's memory with the child. Pages are only copied
+    // when one of the two writes to them (copy-on-write), so fork costs one
+    // PTE per resident page instead of one page copy.
+    if (!vmm_clone_address_space(parent_as, child_as)) {
+        serial_write("[FORK] Error: Out of memory while sharing pages\n", 48);
+        vmm_destroy_address_space(child_as);
+        return -1;
+    }
+
+    // 4. Give the child a process table slot with the parent's registers
+    // (returning 0) and descriptors; it runs when the scheduler picks it
+    int64_t child_pid = sched_fork(child_as);
+    if (child_pid < 0) {
+        serial_write("[FORK] Error: No process slot for the child\n", 44);
+        vmm_destroy_address_space(child_as);
+        return -1;
+    }
+
+    serial_write("[FORK] Fork successful, child PID: 0x", 37);
+    serial_print_hex((uint64_t)child_pid);
+    serial_write("\n", 1);
+    return child_pid;
+}
+
+// yield(): lets the next runnable process run first. Returns 0.
+static int64_t sys_yield(uint64_t arg1, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    (void)arg1; (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
+
+    sched_yield();
+    return 0;
+}
+
+// Rounds a length up to whole pages
+static inline uint64_t page_align_up(uint64_t len) {
+    return (len + PAGE_SIZE - 1) & PAGE_MASK;
+}
+
+// mmap(addr, length, prot, flags, fd_offset)
+// Only five arguments reach the kernel, so a file mapping passes the page
+// aligned file offset with the fd in its low 12 bits. Mappings are private
+// and populated lazily by the page fault handler.
+// Returns the address of the mapping, or -1 on error.
+static int64_t sys_mmap(uint64_t addr, uint64_t length, uint64_t prot, uint64_t flags, uint64_t fd_offset) {
+    struct address_space* as = vmm_get_current_address_space();
+    if (as == &g_kernel_address_space || length == 0 ||
+        length > USER_STACK_BOTTOM_VADDR - USER_MMAP_BASE) {
+        return -1; // EINVAL
+    }
+    uint64_t size = page_align_up(length);
+
+    struct vmm_area area = { .flags = PTE_PRESENT | PTE_USER };
+    if (prot & PROT_WRITE) area.flags |= PTE_WRITABLE;
+    if (!(prot & PROT_EXEC)) area.flags |= PTE_NX;
+
+    struct fs_file *file = NULL;
+    uint64_t offset = fd_offset & PAGE_MASK;
+    if (!(flags & MAP_ANONYMOUS)) {
+        uint64_t fd = fd_offset & (PAGE_SIZE - 1);
+        struct file_descriptor *desc = fd_get(fd);
+        if (!desc) {
+            return -1; // EBADF
         }
-        
-        // Allocate a new physical frame for the child
-        void* child_phys = pmm_alloc_frame();
-        if (!child_phys) {
-            serial_write("[FORK] Error: Out of memory during page copy\n", 45);
-            // TODO: Clean up already allocated pages
-            return -1;
+        file = desc->file;
+        // ext2 files have no data in memory to map
+        if (file->fs_type != FS_TYPE_INITRAMFS || offset > file->size) {
+            return -1; // EINVAL
         }
-        
-        // Copy the page content
-        // Convert physical addresses to kernel virtual addresses for access
-        void* parent_virt = phys_to_virt(parent_phys);
-        void* child_virt = phys_to_virt((uint64_t)child_phys);
-        memcpy(child_virt, parent_virt, page_size);
-        
-        // Get the page flags from the parent
-        // For simplicity, we'll use the same flags
-        // In a real OS, you might want to handle copy-on-write here
-        uint64_t flags = PTE_PRESENT | PTE_USER;
-        
-        // Check if the page is writable in the parent
-        // This is a simplified approach - in a real OS you would get the actual flags
-        if (vaddr >= USER_STACK_BOTTOM_VADDR && vaddr <= USER_STACK_TOP_VADDR) {
-            // Stack pages are writable
-            flags |= PTE_WRITABLE;
+    }
+
+    uint64_t start;
+    if (flags & MAP_FIXED) {
+        // Compared this way round so addr + size cannot wrap; the length
+        // check above keeps the subtraction from wrapping
+        if ((addr & (PAGE_SIZE - 1)) || addr < PAGE_SIZE || addr > USER_STACK_BOTTOM_VADDR - size) {
+            return -1; // EINVAL
         }
-        
-        // Map the page in the child's address space
-        if (!vmm_map_page(child_pml4, vaddr, (uint64_t)child_phys, flags)) {
-            serial_write("[FORK] Error: Failed to map page in child\n", 42);
-            pmm_free_frame(child_phys);
-            // TODO: Clean up already allocated pages
-            return -1;
+        // A fixed mapping replaces whatever was there
+        if (!vmm_remove_range(as, addr, addr + size)) {
+            return -1; // ENOMEM
         }
-    }
-    
-    // 5. Assign a PID to the child
-    uint64_t child_pid = next_pid++;
-    
-    // 6. Set up the child to return 0 from fork
-    // This is done by modifying the saved context that will be restored when the child runs
-    
-    // 7. Return the child's PID to the parent
-    serial_write("[FORK] Fork successful, child PID: ", 34);
-    // Convert PID to string and print it
-    char pid_str[20];
-    int i = 0;
-    uint64_t temp = child_pid;
-    if (temp == 0) {
-        pid_str[i++] = '0';
+        start = addr;
     } else {
-        // Count digits
-        int digits = 0;
-        uint64_t temp_copy = temp;
-        while (temp_copy > 0) {
-            temp_copy /= 10;
-            digits++;
+        start = vmm_find_free_range(as, USER_MMAP_BASE, USER_STACK_BOTTOM_VADDR, size);
+        if (!start) {
+            return -1; // ENOMEM
         }
-        
-        // Convert to string (backwards)
-        i = digits - 1;
-        while (temp > 0) {
-            pid_str[i--] = '0' + (temp % 10);
-            temp /= 10;
+    }
+
+    area.start = start;
+    area.end = start + size;
+    if (file) {
+        area.file = file;
+        area.file_offset = offset;
+        area.file_vaddr = start;
+        area.file_size = file->size - offset < length ? file->size - offset : length;
+        area.cached = !(prot & PROT_WRITE);
+    }
+    if (!vmm_add_area(as, &area)) {
+        return -1; // ENOMEM
+    }
+    return (int64_t)start;
+}
+
+// munmap(addr, length): returns 0, or -1 if the range is invalid
+static int64_t sys_munmap(uint64_t addr, uint64_t length, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    (void)arg3; (void)arg4; (void)arg5; // Mark unused
+
+    struct address_space* as = vmm_get_current_address_space();
+    if (as == &g_kernel_address_space || (addr & (PAGE_SIZE - 1)) || length == 0 ||
+        addr >= USER_STACK_TOP_VADDR + PAGE_SIZE ||
+        length > USER_STACK_TOP_VADDR + PAGE_SIZE - addr) {
+        return -1; // EINVAL
+    }
+    return vmm_remove_range(as, addr, addr + page_align_up(length)) ? 0 : -1;
+}
+
+// brk(addr): moves the program break to addr and returns the new break. If
+// addr is 0 or the move fails, the break is unchanged and is returned.
+static int64_t sys_brk(uint64_t new_brk, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
+
+    struct address_space* as = vmm_get_current_address_space();
+    if (as == &g_kernel_address_space || new_brk == 0 || as->brk_start == 0 ||
+        new_brk < as->brk_start || new_brk > USER_MMAP_BASE) {
+        return (int64_t)as->brk;
+    }
+
+    uint64_t old_top = page_align_up(as->brk);
+    uint64_t new_top = page_align_up(new_brk);
+    if (new_top > old_top) {
+        // Joins the heap area below, if any
+        struct vmm_area heap = {
+            .start = old_top,
+            .end = new_top,
+            .flags = PTE_PRESENT | PTE_USER | PTE_WRITABLE | PTE_NX,
+        };
+        if (!vmm_add_area(as, &heap)) {
+            return (int64_t)as->brk;
+        }
+    } else if (new_top < old_top) {
+        if (!vmm_remove_range(as, new_top, old_top)) {
+            return (int64_t)as->brk;
         }
-        i = digits;
     }
-    pid_str[i] = '\0';
-    serial_write(pid_str, i);
-    serial_write("\n", 1);
-    
-    // Store the child's context and address space for later use
-    // In a real OS, you would have a process table to store this information
-    // For simplicity, we'll just return the PID and handle the child execution separately
-    
-    // TODO: Implement a proper process table and scheduler
-    // For now, we'll use a simple approach where the child executes after the parent returns
-    
-    return child_pid;
+    as->brk = new_brk;
+    return (int64_t)new_brk;
+}
+
+// meminfo(buf): fills a struct meminfo (see memstat.h) with the current
+// memory use by category. Returns 0, or -1 if buf is not writable.
+static int64_t sys_meminfo(uint64_t buf_ptr, uint64_t arg2, uint64_t arg3, uint64_t arg4, uint64_t arg5) {
+    (void)arg2; (void)arg3; (void)arg4; (void)arg5; // Mark unused
+
+    struct meminfo info;
+    memstat_get_meminfo(&info);
+    return copy_to_user((void*)buf_ptr, &info, sizeof(info)) < 0 ? -1 : 0;
 }
 
 // Syscall function pointers
@@ -612,11 +547,16 @@ static syscall_fn_t syscall_table[] = {
     [SYS_CLOSE]   = sys_close,
     [SYS_READDIR] = sys_readdir,
     [SYS_FORK]    = sys_fork, // Add the fork syscall handler
+    [SYS_MMAP]    = sys_mmap,
+    [SYS_MUNMAP]  = sys_munmap,
+    [SYS_BRK]     = sys_brk,
+    [SYS_MEMINFO] = sys_meminfo,
+    [SYS_YIELD]   = sys_yield,
     // Add other syscalls here as they are implemented
 };
 
 // Calculate table size dynamically, but ensure it's large enough for highest syscall number
-#define MAX_SYSCALL_NUM SYS_FORK
+#define MAX_SYSCALL_NUM SYS_YIELD
 #define SYSCALL_TABLE_SIZE (MAX_SYSCALL_NUM + 1)
 
 // Main syscall handler - called from assembly
@@ -628,20 +568,12 @@ __attribute__((visibility("default"))) int64_t syscall(int64_t num, uint64_t arg
         return -1; // Or a specific error code like ENOSYS
     }
 
-    // Dispatch to the appropriate syscall handler
+    // Dispatch to the appropriate syscall handler. Handlers run under the
+    // kernel lock; exit never comes back here.
     syscall_fn_t handler = syscall_table[num];
+    kernel_lock();
     int64_t result = handler(arg1, arg2, arg3, arg4, arg5);
-
-    // Check for special exit marker from sys_exit
-    if (result == 0xDEAD && num == SYS_EXIT) {
-        // This indicates the process should terminate and return to the shell.
-        // The actual context switch back to the shell needs to be handled
-        // after the syscall returns to the assembly stub, or via a scheduler.
-        // For now, we rely on the shell loop re-invoking shell_run.
-        // We still need to return something to the iretq instruction.
-        // Returning 0 is conventional for exit, though it won't be used by the exiting process.
-        return 0;
-    }
+    kernel_unlock();
 
     return result;
 }
@@ -654,7 +586,7 @@ void syscall_init(void) {
     wrmsr(MSR_EFER, efer);
 
     // Set SYSCALL target RIP (LSTAR MSR)
-    wrmsr(MSR_LSTAR, (uint64_t)syscall_asm_entry);
+    wrmsr(MSR_LSTAR, (uint64_t)syscall_entry);
 
     // Set SYSCALL target CS/SS (STAR MSR)
     // According to AMD manual Vol 2, section 4.6:
@@ -679,18 +611,15 @@ void syscall_init(void) {
     // Clear IF (Interrupt Flag) to disable interrupts during syscall
     // Clear DF (Direction Flag) for string operations
     // Clear TF (Trap Flag) to disable single-stepping
-    wrmsr(MSR_FMASK, 0x700); // Clear IF (bit 9), DF (bit 10), TF (bit 8)
+    // Clear AC (Alignment Check) so user mode cannot switch SMAP off for the kernel
+    wrmsr(MSR_FMASK, 0x40700); // Clear AC (bit 18), IF (bit 9), DF (bit 10), TF (bit 8)
 
-    // Initialize file descriptor table (stdin, stdout, stderr are implicitly handled)
-    for (int i = 0; i < MAX_FDS; i++) {
-        fd_table[i].used = false;
-        fd_table[i].file = NULL;
-        fd_table[i].position = 0;
+    // Descriptors live in the process table; stdin, stdout and stderr are
+    // implicit
+    if (!fd_cache) {
+        fd_cache = kmem_cache_create("file_descriptor", sizeof(struct file_descriptor));
     }
 
-    // Initialize PID counter
-    next_pid = 1;
-
     // Note: No serial prints here
 }
 
@@ -2,6 +2,7 @@
 
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 // Syscall numbers
 #define SYS_EXIT       0
@@ -11,6 +12,22 @@
 #define SYS_CLOSE      4
 #define SYS_READDIR    5 // New syscall for reading directory entries
 #define SYS_FORK       6 // Fork syscall
+#define SYS_MMAP       7 // Map anonymous memory or a file
+#define SYS_MUNMAP     8 // Unmap a range
+#define SYS_BRK        9 // Move the program break
+#define SYS_MEMINFO    10 // Memory use by category (struct meminfo)
+#define SYS_YIELD      11 // Give the CPU to the next runnable process
+
+// mmap protection and flags (Linux values)
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+
+// open flags (Linux values)
+#define O_CREAT        0x40
 
 // File descriptor constants
 #define STDIN_FD  0
@@ -28,6 +45,25 @@ struct dirent {
     // Add other fields like type if needed later
 };
 
+// GDT selectors user mode runs with (RPL 3)
+#define USER_CODE_SELECTOR   0x1B
+#define USER_DATA_SELECTOR   0x23
+
+// What the syscall entry saves on the process's kernel stack, lowest
+// address first; syscall_return restores it and irets to user mode
+struct syscall_frame {
+    uint64_t r15, r14, r13, r12, rbx, rbp;
+    uint64_t rax;                       // Return value
+    uint64_t rip, cs, rflags, rsp, ss;  // iretq frame
+};
+
+struct file_descriptor;
+
+// Closes every descriptor of a process's table
+void syscall_close_fds(struct file_descriptor **fds);
+// Gives a child (fork) its own copy of every descriptor; false if out of memory
+bool syscall_clone_fds(struct file_descriptor **dst, struct file_descriptor *const *src);
+
 // Standard C function signature for syscalls
 typedef int64_t (*syscall_fn_t)(uint64_t, uint64_t, uint64_t, uint64_t, uint64_t);
 
@@ -1,12 +1,16 @@
 [bits 64]
 
-global syscall_asm_entry
+global syscall_entry
 extern syscall
 
 ; Define GDT selectors for user mode (adjust if your GDT differs)
 USER_CODE_SELECTOR equ 0x18 | 3 ; Selector 3 (0x18), RPL=3 -> 0x1b
 USER_DATA_SELECTOR equ 0x20 | 3 ; Selector 4 (0x20), RPL=3 -> 0x23
 
+; Offsets in struct cpu_local (cpu.h), reached through GS
+CPU_LOCAL_KERNEL_RSP equ 8
+CPU_LOCAL_USER_RSP   equ 16
+
 ; This function is called by the SYSCALL instruction
 ; Parameters are passed in registers according to the x86_64 ABI:
 ; - RAX: syscall number
@@ -17,39 +21,32 @@ USER_DATA_SELECTOR equ 0x20 | 3 ; Selector 4 (0x20), RPL=3 -> 0x23
 ; - R8:  arg5
 ; - R9:  arg6 (not used in our implementation)
 
-section .bss
-align 16
-syscall_stack_bottom:
-    resb 8192 ; 8KB kernel stack for syscalls
-syscall_stack_top:
-user_rsp_storage: resq 1 ; Storage for user RSP
-user_rip_storage: resq 1 ; Storage for user RIP (from RCX)
-user_rflags_storage: resq 1 ; Storage for user RFLAGS (from R11)
-
-; Export these symbols for use in the fork syscall
-global syscall_stack_top
-global user_rsp_storage
-global user_rip_storage
-global user_rflags_storage
-
 section .text
 
-syscall_asm_entry:
-    ; Swap GS base to kernel space if using FS/GS base switching (optional, depends on setup)
-    ; swapgs ; Uncomment if needed
-
-    ; Switch to kernel stack
-    mov [user_rsp_storage], rsp ; Save user RSP
-    mov rsp, syscall_stack_top   ; Load kernel RSP
-
-    ; Save registers needed by C ABI and syscall
-    ; Callee-saved: rbx, rbp, r12-r15
-    ; Syscall clobbers: rcx, r11
-    ; Need to save user rip (rcx) and rflags (r11) for iretq
-    mov [user_rip_storage], rcx     ; Save user RIP
-    mov [user_rflags_storage], r11 ; Save user RFLAGS
-
-    ; Save callee-saved GPRs
+; On entry the kernel stack of the process gets a struct syscall_frame
+; (syscall.h): an iretq frame back to user mode, RAX, then the callee-saved
+; registers. fork copies it for the child; new processes start out with one
+; and enter user mode through syscall_return.
+global syscall_return
+
+syscall_entry:
+    ; GS to this CPU's struct cpu_local (FMASK keeps interrupts off)
+    swapgs
+
+    ; Switch to the process's kernel stack
+    mov [gs:CPU_LOCAL_USER_RSP], rsp
+    mov rsp, [gs:CPU_LOCAL_KERNEL_RSP]
+    push qword USER_DATA_SELECTOR
+    push qword [gs:CPU_LOCAL_USER_RSP]
+
+    ; Rest of the iretq frame (SS and RSP are pushed): RFLAGS (from R11),
+    ; CS, RIP (from RCX)
+    push r11
+    push qword USER_CODE_SELECTOR
+    push rcx
+
+    ; Slot for the return value, then the callee-saved GPRs
+    push rax
     push rbp
     push rbx
     push r12
@@ -73,38 +70,33 @@ syscall_asm_entry:
     mov rsi, rdi    ; C arg1 <- syscall arg1 (RDI)
     mov rdi, rax    ; C num  <- syscall num (RAX)
 
-    ; Align the stack to 16 bytes before calling C function
-    ; Check current RSP alignment. RSP & 0xF should be 0 for alignment.
-    ; Current RSP = kernel_stack_top - 6*8 (callee-saved) = kernel_stack_top - 48
-    ; If kernel_stack_top is 16-byte aligned, RSP is currently aligned.
-    ; No explicit alignment needed if kernel_stack_top is correctly aligned.
-
-    ; Call the C handler
+    ; 12 qwords below a 16-byte aligned stack top keep RSP aligned for the call
     call syscall
 
     ; RAX contains the return value from syscall() C function
+    mov [rsp + 48], rax
 
-    ; Restore callee-saved GPRs
+syscall_return:
+    ; Restore callee-saved GPRs and the return value
     pop r15
     pop r14
     pop r13
     pop r12
     pop rbx
     pop rbp
-
-    ; Kernel stack pointer is now back to kernel_stack_top.
-    ; Construct the iretq frame:
-    ; iretq expects: [RIP] [CS] [RFLAGS] [RSP] [SS]
-    push qword USER_DATA_SELECTOR ; User SS
-    push qword [user_rsp_storage] ; User RSP (restored)
-    push qword [user_rflags_storage] ; User RFLAGS
-    push qword USER_CODE_SELECTOR ; User CS
-    push qword [user_rip_storage] ; User RIP
-
-    ; DO NOT restore user RSP here, iretq does it.
-    ; DO NOT swapgs here if used, iretq handles it implicitly based on target CS descriptor type.
-
-    ; Return to userspace using iretq
-    ; RAX contains the return value from syscall() C function
+    pop rax
+
+    ; The caller-saved GPRs still hold kernel values: clear them so nothing
+    ; (pointers, stack addresses) leaks to userspace
+    xor ecx, ecx
+    xor edx, edx
+    xor esi, esi
+    xor edi, edi
+    xor r8d, r8d
+    xor r9d, r9d
+    xor r10d, r10d
+    xor r11d, r11d
+
+    ; Back to the user's GS base, then to userspace using iretq
+    swapgs
     iretq
-
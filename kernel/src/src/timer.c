@@ -0,0 +1,108 @@
+#include "timer.h"
+#include "apic.h"
+#include "cpu.h"
+#include "sched.h"
+#include "serial.h"
+
+#define PIC1_COMMAND 0x20
+#define PIC1_DATA    0x21
+#define PIC2_COMMAND 0xA0
+#define PIC2_DATA    0xA1
+#define PIC_ICW1_INIT_ICW4 0x11
+#define PIC_ICW4_8086      0x01
+
+#define PIT_CHANNEL2 0x42
+#define PIT_COMMAND  0x43
+#define PIT_BASE_HZ  1193182
+#define PIT_MODE_ONESHOT_CH2 0xB0  // Channel 2, lobyte/hibyte, mode 0 (terminal count)
+#define PIT_GATE_PORT  0x61        // Bit 0: channel 2 gate, bit 1: speaker, bit 5: channel 2 output
+#define PIT_GATE2      0x01
+#define PIT_SPEAKER    0x02
+#define PIT_OUT2       0x20
+
+#define TIMER_CALIBRATE_MS 10
+
+static volatile uint64_t timer_ticks = 0;
+static uint32_t timer_lapic_count = 0; // Local APIC timer ticks per period, 0 = no timer
+
+static inline void outb(uint16_t port, uint8_t val) {
+    __asm__ volatile ("outb %0, %1" : : "a"(val), "Nd"(port));
+}
+
+static inline uint8_t inb(uint16_t port) {
+    uint8_t ret;
+    __asm__ volatile ("inb %1, %0" : "=a"(ret) : "Nd"(port));
+    return ret;
+}
+
+// A write to an unused port gives the old PIC time to settle
+static inline void io_wait(void) {
+    outb(0x80, 0);
+}
+
+static void pic_remap(void) {
+    outb(PIC1_COMMAND, PIC_ICW1_INIT_ICW4); io_wait();
+    outb(PIC2_COMMAND, PIC_ICW1_INIT_ICW4); io_wait();
+    outb(PIC1_DATA, PIC_VECTOR_BASE); io_wait();      // Master vector offset
+    outb(PIC2_DATA, PIC_VECTOR_BASE + 8); io_wait();  // Slave vector offset
+    outb(PIC1_DATA, 4); io_wait();                    // Slave on IRQ 2
+    outb(PIC2_DATA, 2); io_wait();                    // Slave cascade identity
+    outb(PIC1_DATA, PIC_ICW4_8086); io_wait();
+    outb(PIC2_DATA, PIC_ICW4_8086); io_wait();
+
+    outb(PIC1_DATA, 0xFF); // All masked
+    outb(PIC2_DATA, 0xFF);
+}
+
+// Local APIC timer ticks in TIMER_CALIBRATE_MS, timed by PIT channel 2
+// counting down once with its gate held high
+static uint32_t timer_calibrate(void) {
+    uint8_t gate = inb(PIT_GATE_PORT) & ~(PIT_SPEAKER | PIT_GATE2);
+    outb(PIT_GATE_PORT, gate);
+    outb(PIT_COMMAND, PIT_MODE_ONESHOT_CH2);
+    uint16_t count = PIT_BASE_HZ * TIMER_CALIBRATE_MS / 1000;
+    outb(PIT_CHANNEL2, count & 0xFF);
+    outb(PIT_CHANNEL2, count >> 8);
+
+    outb(PIT_GATE_PORT, gate | PIT_GATE2);
+    lapic_timer_oneshot(0xFFFFFFFF);
+    while (!(inb(PIT_GATE_PORT) & PIT_OUT2)) {
+        asm volatile("pause");
+    }
+    uint32_t elapsed = 0xFFFFFFFF - lapic_timer_remaining();
+    lapic_timer_oneshot(0);
+    outb(PIT_GATE_PORT, gate);
+    return elapsed;
+}
+
+void timer_init(void) {
+    pic_remap();
+    if (!lapic_init()) {
+        serial_write("Timer: No local APIC, processes are not preempted\n", 50);
+        return;
+    }
+    timer_lapic_count = timer_calibrate() / (TIMER_CALIBRATE_MS * TIMER_HZ / 1000);
+    timer_init_cpu();
+    serial_write("Timer: Local APIC timer at 1000Hz, count 0x", 43);
+    serial_print_hex(timer_lapic_count);
+    serial_write("\n", 1);
+}
+
+void timer_init_cpu(void) {
+    if (timer_lapic_count) {
+        lapic_timer_periodic(timer_lapic_count);
+    }
+}
+
+void timer_interrupt(struct registers* regs) {
+    if (cpu_current_id() == 0) {
+        timer_ticks++;
+    }
+    // Acknowledge first: the scheduler may switch away before returning
+    lapic_eoi();
+    sched_tick(regs->cs == USER_CODE_SELECTOR);
+}
+
+uint64_t timer_get_ticks(void) {
+    return timer_ticks;
+}
@@ -0,0 +1,27 @@
+#pragma once
+
+#include <stdint.h>
+#include "idt.h"
+
+// --- Timer interrupt ---
+
+// Every CPU's local APIC timer fires LAPIC_TIMER_VECTOR TIMER_HZ times a
+// second and drives that CPU's scheduler. The timer's rate is calibrated
+// once against PIT channel 2. The legacy PIC is remapped so IRQs 0-15 would
+// arrive on vectors 32-47, and masked: the keyboard and mouse are polled.
+
+#define TIMER_HZ 1000
+
+// Calibrates the local APIC timer and starts it on the bootstrap
+// processor. Interrupts stay off until something (user mode, an idle loop)
+// runs with RFLAGS.IF set.
+void timer_init(void);
+
+// Starts the timer on an application processor
+void timer_init_cpu(void);
+
+// Handles LAPIC_TIMER_VECTOR, called from isr_handler
+void timer_interrupt(struct registers* regs);
+
+// Ticks of the bootstrap processor's timer since timer_init
+uint64_t timer_get_ticks(void);
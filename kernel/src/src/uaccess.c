@@ -0,0 +1,119 @@
+#include "uaccess.h"
+
+// End of the canonical lower half; user ranges must end at or below it
+#define UACCESS_USER_END 0x0000800000000000ULL
+
+// Bounds of the exception table, from linker.ld
+extern const struct exception_table_entry __ex_table_start[];
+extern const struct exception_table_entry __ex_table_end[];
+
+// Records that the instruction at label `insn` may fault and that execution
+// then continues at label `fixup`
+#define UACCESS_EX_ENTRY(insn, fixup) \
+    ".pushsection __ex_table, \"a\"\n" \
+    ".balign 8\n" \
+    ".quad " #insn ", " #fixup "\n" \
+    ".popsection\n"
+
+bool uaccess_fixup(struct registers *regs) {
+    if (regs->cs & 3) {
+        return false; // Only kernel code has fixups
+    }
+    for (const struct exception_table_entry *entry = __ex_table_start;
+         entry < __ex_table_end; entry++) {
+        if (entry->insn == regs->rip) {
+            regs->rip = entry->fixup;
+            return true;
+        }
+    }
+    return false;
+}
+
+static bool uaccess_range_ok(const void *user_ptr, size_t size) {
+    uint64_t end;
+    if (__builtin_add_overflow((uint64_t)user_ptr, size, &end)) {
+        return false;
+    }
+    return end <= UACCESS_USER_END;
+}
+
+// Copies n bytes and returns how many were left when a fault stopped the
+// copy (0 on success). rep movsb is restartable: on a fault rcx holds the
+// remaining count, and the fixup simply resumes after the instruction.
+static size_t uaccess_copy(void *dst, const void *src, size_t n) {
+    asm volatile(
+        "1: rep movsb\n"
+        "2:\n"
+        UACCESS_EX_ENTRY(1b, 2b)
+        : "+D"(dst), "+S"(src), "+c"(n)
+        :
+        : "memory");
+    return n;
+}
+
+// Reads one user byte; the fixup makes it return false instead
+static inline bool uaccess_get_byte(const char *user_ptr, char *out) {
+    bool ok = true;
+    char c;
+    asm volatile(
+        "1: movb (%[ptr]), %[c]\n"
+        "2:\n"
+        ".pushsection .text.fixup, \"ax\"\n"
+        "3: movb $0, %[ok]\n"
+        "   xorb %[c], %[c]\n"
+        "   jmp 2b\n"
+        ".popsection\n"
+        UACCESS_EX_ENTRY(1b, 3b)
+        : [c] "=q"(c), [ok] "+qm"(ok)
+        : [ptr] "r"(user_ptr));
+    *out = c;
+    return ok;
+}
+
+int64_t copy_from_user(void *kdest, const void *user_src, size_t size) {
+    if (!uaccess_range_ok(user_src, size)) {
+        return -1; // EFAULT
+    }
+    uaccess_begin();
+    size_t left = uaccess_copy(kdest, user_src, size);
+    uaccess_end();
+    return left ? -1 : (int64_t)size;
+}
+
+int64_t copy_to_user(void *user_dest, const void *ksrc, size_t size) {
+    if (!uaccess_range_ok(user_dest, size)) {
+        return -1; // EFAULT
+    }
+    uaccess_begin();
+    size_t left = uaccess_copy(user_dest, ksrc, size);
+    uaccess_end();
+    return left ? -1 : (int64_t)size;
+}
+
+int64_t strncpy_from_user(char *kdest, const char *user_src, size_t size) {
+    if ((uint64_t)user_src >= UACCESS_USER_END) {
+        return -1; // EFAULT
+    }
+    // Never read past the user half, even if size would allow it
+    size_t limit = size;
+    if (limit > UACCESS_USER_END - (uint64_t)user_src) {
+        limit = UACCESS_USER_END - (uint64_t)user_src;
+    }
+
+    int64_t result = limit == size ? (int64_t)size : -1;
+    uaccess_begin();
+    for (size_t i = 0; i < limit; i++) {
+        char c;
+        if (!uaccess_get_byte(user_src + i, &c)) {
+            result = -1;
+            break;
+        }
+        kdest[i] = c;
+        if (c == '\0') {
+            result = (int64_t)i;
+            break;
+        }
+    }
+    uaccess_end();
+    return result;
+}
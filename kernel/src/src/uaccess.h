@@ -0,0 +1,51 @@
+#pragma once
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdbool.h>
+#include "cpu.h"
+#include "idt.h"
+
+// --- Kernel access to user memory ---
+
+// The helpers below touch user memory directly and let the MMU do the
+// validation: every instruction that may fault on a user address is listed
+// in the exception table (section __ex_table) with a fixup address. When one
+// faults and demand paging cannot resolve it, the #PF/#GP handler resumes at
+// the fixup, which reports the failure to the caller instead of crashing.
+// The only software check is that the range lies in the user half.
+//
+// With SMAP enabled the kernel cannot touch user pages at all unless
+// RFLAGS.AC is set, so the helpers bracket their accesses with stac/clac.
+
+struct exception_table_entry {
+    uint64_t insn;   // Address of an instruction allowed to fault
+    uint64_t fixup;  // Where execution continues if it does
+};
+
+// Opens/closes a window in which the kernel may access user pages
+static inline void uaccess_begin(void) {
+    if (cpu_smap_enabled) {
+        asm volatile("stac" : : : "memory");
+    }
+}
+
+static inline void uaccess_end(void) {
+    if (cpu_smap_enabled) {
+        asm volatile("clac" : : : "memory");
+    }
+}
+
+// Redirects a kernel fault raised by a user access to its fixup. Returns
+// false if the faulting instruction has no exception table entry.
+bool uaccess_fixup(struct registers *regs);
+
+// Copy between kernel and user memory. Return size on success, -1 if any
+// part of the user range is outside the user half or not accessible.
+int64_t copy_from_user(void *kdest, const void *user_src, size_t size);
+int64_t copy_to_user(void *user_dest, const void *ksrc, size_t size);
+
+// Copies a NUL-terminated string of at most size bytes (terminator included).
+// Returns the string length, size if no terminator was found within size
+// bytes (kdest is then not terminated), or -1 on a bad address.
+int64_t strncpy_from_user(char *kdest, const char *user_src, size_t size);
@@ -1,13 +0,0 @@
-#pragma once
-
-#include <stdint.h>
-
-#ifdef __cplusplus
-extern "C" {
-#endif
-
-void usermode_return_handler(int code);
-
-#ifdef __cplusplus
-}
-#endif
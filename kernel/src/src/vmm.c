@@ -1,5 +1,11 @@
 #include "vmm.h"
+#include "pagecache.h"
+#include "fs.h"
+#include "swap.h"
 #include "serial.h"
+#include "cpu.h"
+#include "smp.h"
+#include "slab.h"
 #include "lib/string.h"
 #include <stdbool.h>
 #include <stddef.h>
@@ -7,45 +13,6 @@
 
 // Extern declarations for Limine requests defined in main.c
 extern volatile struct limine_hhdm_request hhdm_request;
-extern volatile struct limine_memmap_request memmap_request;
-extern volatile struct limine_kernel_address_request kernel_address_request;
-
-// --- Physical Memory Manager (PMM) --- 
-
-// Reference to the memory map request (defined in main.c)
-// extern volatile struct limine_memmap_request memmap_request;
-// Reference to the kernel address request (defined in main.c)
-// extern volatile struct limine_kernel_address_request kernel_address_request;
-// Reference to the HHDM request (defined in main.c)
-// extern volatile struct limine_hhdm_request hhdm_request;
-
-// Simple bitmap-based physical memory allocator
-// TODO: Find a better place for the bitmap itself!
-// For now, let's assume a max physical address and put the bitmap somewhere safe.
-// We need to calculate the required bitmap size based on the highest available address.
-#define PMM_MAX_PHYS_ADDR (4ULL * 1024 * 1024 * 1024) // Assume max 4GiB for now
-#define PMM_BITMAP_SIZE ((PMM_MAX_PHYS_ADDR / PAGE_SIZE) / 8) // Bytes needed
-
-// WARNING: Placing the bitmap at a fixed address is DANGEROUS.
-// This needs to be dynamically placed in a safe area identified by the memmap.
-// This is just a placeholder for initial implementation.
-static uint8_t pmm_bitmap[PMM_BITMAP_SIZE] __attribute__((aligned(PAGE_SIZE)));
-
-static size_t pmm_last_alloc_index = 0;
-static uint64_t pmm_highest_address = 0;
-
-// Helper functions for bitmap manipulation
-static inline void pmm_bitmap_set(size_t bit) {
-    pmm_bitmap[bit / 8] |= (1 << (bit % 8));
-}
-
-static inline void pmm_bitmap_unset(size_t bit) {
-    pmm_bitmap[bit / 8] &= ~(1 << (bit % 8));
-}
-
-static inline bool pmm_bitmap_test(size_t bit) {
-    return (pmm_bitmap[bit / 8] & (1 << (bit % 8))) != 0;
-}
 
 // --- Helper Functions ---
 
@@ -67,196 +34,204 @@ void* phys_to_virt(uint64_t phys_addr) {
     return (void*)(phys_addr + hhdm_offset);
 }
 
-void pmm_init(void) {
-    if (memmap_request.response == NULL) {
-        serial_write("PMM Error: No memory map response from Limine!\n", 47);
-        // TODO: Halt or handle error appropriately
-        for(;;); 
-    }
-
-    struct limine_memmap_entry **entries = memmap_request.response->entries;
-    uint64_t entry_count = memmap_request.response->entry_count;
-
-    // 1. Initialize bitmap: mark all memory as used initially.
-    memset(pmm_bitmap, 0xFF, PMM_BITMAP_SIZE);
-
-    serial_write("PMM: Initializing...\n", 22);
-
-    // 2. Iterate through memory map and mark usable frames as free.
-    for (uint64_t i = 0; i < entry_count; i++) {
-        struct limine_memmap_entry *entry = entries[i];
-
-        // Debug print entry info
-        // serial_write("  Memmap Entry: Base=0x", 23);
-        // serial_print_hex(entry->base);
-        // serial_write(", Length=0x", 12);
-        // serial_print_hex(entry->length);
-        // serial_write(", Type=", 8);
-        // serial_print_hex(entry->type);
-        // serial_write("\n", 1);
-
-        if (entry->type == LIMINE_MEMMAP_USABLE) {
-            // Mark all full frames within this usable range as free
-            uint64_t start_frame = (entry->base + PAGE_SIZE - 1) / PAGE_SIZE; // Align up
-            uint64_t end_frame = (entry->base + entry->length) / PAGE_SIZE; // Align down
-
-            for (uint64_t frame = start_frame; frame < end_frame; frame++) {
-                size_t bit_index = frame;
-                if ((frame * PAGE_SIZE) >= PMM_MAX_PHYS_ADDR) continue; // Skip if beyond our bitmap limit
-                
-                pmm_bitmap_unset(bit_index);
-                
-                // Track highest available address for bitmap sizing later
-                if ((frame + 1) * PAGE_SIZE > pmm_highest_address) {
-                    pmm_highest_address = (frame + 1) * PAGE_SIZE;
-                }
-            }
-            // serial_write("    Marked frames ", 18);
-            // serial_print_hex(start_frame);
-            // serial_write(" to ", 4);
-            // serial_print_hex(end_frame - 1);
-            // serial_write(" as usable.\n", 13);
-        }
-    }
-    
-    // 3. Mark kernel memory as used.
-    if (kernel_address_request.response == NULL) {
-        serial_write("PMM Error: No kernel address response from Limine!\n", 51);
-        // TODO: Halt or handle error appropriately
-        for(;;);
+// Converts an HHDM virtual address back to its physical address
+uint64_t virt_to_phys(const void* virt_addr) {
+    return (uint64_t)virt_addr - (uint64_t)phys_to_virt(0);
+}
+
+// --- Virtual Memory Management (VMM) ---
+
+// Global variable holding the physical address of the kernel's top-level PML4 table
+pml4_t* g_kernel_pml4 = NULL;
+
+static bool vmm_has_1g_pages = false; // CPUID.80000001h:EDX[26]
+
+// Frame of zeros mapped read-only for anonymous pages that were only read.
+// It belongs to the kernel: mappings of it are never counted or freed.
+static uint64_t vmm_zero_frame = 0;
+
+// --- Address spaces and PCIDs ---
+
+struct address_space g_kernel_address_space;
+static struct address_space vmm_address_spaces[VMM_MAX_ADDRESS_SPACES];
+
+// Address space loaded on each CPU. Switches and page table changes happen
+// under the kernel lock, so another CPU's entry can be relied on.
+static struct address_space* vmm_cpu_as[MAX_CPUS] = {
+    [0 ... MAX_CPUS - 1] = &g_kernel_address_space
+};
+
+static bool vmm_pcid_enabled = false;     // CR4.PCIDE is set
+static uint64_t vmm_pcid_generation = 1;  // Bumped when PCIDs run out
+static uint16_t vmm_pcid_next = 1;        // Next unused PCID in this generation
+// Generation each CPU's TLB was last flushed for; a CPU behind flushes
+// everything on its next switch, as PCIDs may have been handed out again
+static uint64_t vmm_cpu_pcid_generation[MAX_CPUS] = {
+    [0 ... MAX_CPUS - 1] = 1
+};
+
+// Flushes every TLB entry, global ones and those of all PCIDs included
+static void vmm_flush_tlb_all(void) {
+    uint64_t cr4 = cpu_read_cr4();
+    if (cr4 & CR4_PGE) {
+        cpu_write_cr4(cr4 & ~CR4_PGE);
+        cpu_write_cr4(cr4);
+    } else {
+        uint64_t cr3_val;
+        asm volatile ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3_val) : : "memory");
     }
-    
-    uint64_t kernel_phys_base = kernel_address_request.response->physical_base;
-    uint64_t kernel_virt_base = kernel_address_request.response->virtual_base;
-    
-    // We need the *size* of the kernel. Limine doesn't directly provide this,
-    // we often get it from linker symbols (_kernel_start, _kernel_end).
-    // For now, let's make a reasonable guess or use a placeholder size.
-    // Assume the kernel occupies memory from its physical base up to the start
-    // of the bitmap we statically placed. THIS IS A HACK.
-    // A better way involves linker script symbols.
-    extern uint8_t _kernel_end[]; // Symbol from linker script (needs to be defined there)
-    uint64_t kernel_size = (uint64_t)_kernel_end - kernel_virt_base; // Calculate size based on virtual addresses
-    // Ensure a minimum size if the symbol isn't right or calculation is off
-    if (kernel_size == 0 || kernel_size > (512 * 1024 * 1024)) { // Sanity check (e.g., > 512MiB is suspicious)
-        serial_write("PMM Warning: Kernel size calculation seems off. Using 16MiB placeholder.\n", 70);
-        kernel_size = 16 * 1024 * 1024; // Use a 16MiB placeholder size
-    }
-
-    uint64_t kernel_start_frame = kernel_phys_base / PAGE_SIZE;
-    uint64_t kernel_end_frame = (kernel_phys_base + kernel_size + PAGE_SIZE - 1) / PAGE_SIZE;
-    
-    serial_write("PMM: Marking kernel frames [", 27);
-    serial_print_hex(kernel_start_frame);
-    serial_write(" - ", 3);
-    serial_print_hex(kernel_end_frame - 1);
-    serial_write("] (phys 0x", 11);
-    serial_print_hex(kernel_phys_base);
-    serial_write(") as used...\n", 14);
-    
-    for (uint64_t frame = kernel_start_frame; frame < kernel_end_frame; frame++) {
-        size_t bit_index = frame;
-        if ((frame * PAGE_SIZE) >= PMM_MAX_PHYS_ADDR) continue; // Skip if beyond our bitmap limit
-        if (!pmm_bitmap_test(bit_index)) {
-             //serial_write("PMM Info: Kernel frame ", 24);
-             //serial_print_hex(frame);
-             //serial_write(" was free, marking used.\n", 26);
-        }
-        pmm_bitmap_set(bit_index);
-    }
-    
-    // TODO: Mark bitmap memory itself as used! Requires knowing where bitmap is.
-    uint64_t bitmap_phys_addr = (uint64_t)pmm_bitmap; // HACK: Assumes identity mapping / HHDM
-    uint64_t bitmap_start_frame = bitmap_phys_addr / PAGE_SIZE;
-    uint64_t bitmap_end_frame = (bitmap_phys_addr + PMM_BITMAP_SIZE + PAGE_SIZE - 1) / PAGE_SIZE;
-    serial_write("PMM: Marking bitmap frames [", 27);
-    serial_print_hex(bitmap_start_frame);
-    serial_write(" - ", 3);
-    serial_print_hex(bitmap_end_frame - 1);
-    serial_write("] (phys 0x", 11);
-    serial_print_hex(bitmap_phys_addr);
-    serial_write(") as used...\n", 14);
-    for (uint64_t frame = bitmap_start_frame; frame < bitmap_end_frame; frame++) {
-        size_t bit_index = frame;
-        if ((frame * PAGE_SIZE) >= PMM_MAX_PHYS_ADDR) continue;
-        if (!pmm_bitmap_test(bit_index)) {
-            // serial_write("PMM Info: Bitmap frame ", 23);
-            // serial_print_hex(frame);
-            // serial_write(" was free, marking used.\n", 26);
-        }
-        pmm_bitmap_set(bit_index);
-    }
-
-    serial_write("PMM: Initialization complete. Highest address: 0x", 49);
-    serial_print_hex(pmm_highest_address);
-    serial_write("\n", 1);
-    
-    // Reset last alloc index for the first allocation
-    pmm_last_alloc_index = 0;
-}
-
-// Allocates one physical 4KiB frame
-// Returns physical address of the frame, or NULL if out of memory
-void* pmm_alloc_frame(void) {
-    size_t max_bits = (pmm_highest_address / PAGE_SIZE);
-    
-    // Simple linear scan for a free bit (can be optimized)
-    for (size_t i = 0; i < max_bits; ++i) {
-        size_t current_index = (pmm_last_alloc_index + i) % max_bits;
-        
-        // Skip low memory (below 1MB often problematic)
-        if (current_index * PAGE_SIZE < 0x100000) continue; 
-        
-        if (!pmm_bitmap_test(current_index)) {
-            pmm_bitmap_set(current_index);
-            pmm_last_alloc_index = current_index + 1; // Start next search from here
-            uint64_t phys_addr = (uint64_t)current_index * PAGE_SIZE;
-            // serial_write("PMM Alloc: 0x", 14);
-            // serial_print_hex(phys_addr);
-            // serial_write("\n", 1);
-            return (void*)phys_addr;
-        }
-    }
-    
-    serial_write("PMM Error: Out of physical memory!\n", 35);
-    return NULL; // Out of memory
-}
-
-// Frees a physical frame
-void pmm_free_frame(void* frame_addr) {
-    uint64_t phys_addr = (uint64_t)frame_addr;
-    if (phys_addr % PAGE_SIZE != 0) {
-        serial_write("PMM Error: Attempted to free non-page-aligned address 0x", 57);
-        serial_print_hex(phys_addr);
-        serial_write("\n", 1);
+}
+
+void vmm_flush_tlb_local(bool global) {
+    if (global) {
+        vmm_flush_tlb_all();
+    } else {
+        // Reloading CR3 without the no-flush bit drops the current PCID's entries
+        uint64_t cr3_val;
+        asm volatile ("mov %%cr3, %0; mov %0, %%cr3" : "=r"(cr3_val) : : "memory");
+    }
+}
+
+// The address space using pml4, or NULL
+static struct address_space* vmm_find_address_space(pml4_t* pml4) {
+    if (pml4 == g_kernel_address_space.pml4) {
+        return &g_kernel_address_space;
+    }
+    for (int i = 0; i < VMM_MAX_ADDRESS_SPACES; i++) {
+        if (vmm_address_spaces[i].in_use && vmm_address_spaces[i].pml4 == pml4) {
+            return &vmm_address_spaces[i];
+        }
+    }
+    return NULL;
+}
+
+// Every online CPU but this one
+static uint32_t vmm_other_cpus(void) {
+    return ((1u << smp_cpu_count()) - 1) & ~(1u << cpu_current_id());
+}
+
+// Changes in the shared kernel half reach every CPU at once
+static void vmm_flush_kernel_half(void) {
+    vmm_flush_tlb_all();
+    smp_tlb_shootdown(vmm_other_cpus(), true);
+}
+
+// Handles the user half of pml4 on the CPUs other than this one: those with
+// it loaded get a shootdown, the rest flush its PCID when they next load it
+// (and so does this CPU if it does not have it loaded now)
+static void vmm_flush_other_cpus(pml4_t* pml4) {
+    struct address_space* as = vmm_find_address_space(pml4);
+    if (!as) {
         return;
     }
-    
-    size_t bit_index = phys_addr / PAGE_SIZE;
-    if (bit_index * PAGE_SIZE >= pmm_highest_address) {
-        serial_write("PMM Error: Attempted to free address outside managed range 0x", 61);
-        serial_print_hex(phys_addr);
-        serial_write("\n", 1);
+    unsigned int self = cpu_current_id();
+    uint32_t loaded = 0;
+    for (unsigned int cpu = 0; cpu < smp_cpu_count(); cpu++) {
+        if (vmm_cpu_as[cpu] == as) {
+            loaded |= 1u << cpu;
+        }
+    }
+    as->tlb_stale_cpus |= ~loaded;
+    smp_tlb_shootdown(loaded & ~(1u << self), false);
+}
+
+// Invalidates the TLB entry for virt_addr in the address space using pml4.
+// invlpg only reaches this CPU's current PCID (and global entries).
+static void vmm_flush_page(pml4_t* pml4, uint64_t virt_addr) {
+    if (virt_addr >= VMM_KERNEL_HALF) {
+        // Kernel half is shared by every address space
+        vmm_flush_kernel_half();
         return;
     }
-    
-    if (!pmm_bitmap_test(bit_index)) {
-        serial_write("PMM Warning: Attempted to double-free frame 0x", 46);
-        serial_print_hex(phys_addr);
-        serial_write("\n", 1);
-        // Proceed with unsetting anyway, maybe?
+    if (pml4 == vmm_cpu_as[cpu_current_id()]->pml4) {
+        asm volatile ("invlpg (%0)" :: "r" (virt_addr) : "memory");
     }
-    
-    pmm_bitmap_unset(bit_index);
-    // serial_write("PMM Free: 0x", 13);
-    // serial_print_hex(phys_addr);
-    // serial_write("\n", 1);
+    vmm_flush_other_cpus(pml4);
 }
 
-// --- Virtual Memory Management (VMM) ---
+// Invalidates every non-global TLB entry of the address space using pml4
+// (all entries if the change was in the shared kernel half)
+static void vmm_flush_address_space(pml4_t* pml4, bool kernel_half) {
+    if (kernel_half) {
+        vmm_flush_kernel_half();
+        return;
+    }
+    if (pml4 == vmm_cpu_as[cpu_current_id()]->pml4) {
+        vmm_flush_tlb_local(false);
+    }
+    vmm_flush_other_cpus(pml4);
+}
 
-// Global variable holding the physical address of the kernel's top-level PML4 table
-pml4_t* g_kernel_pml4 = NULL;
+// Invalidations collected while a range is being changed, issued once at
+// the end by vmm_tlb_batch_flush
+struct vmm_tlb_batch {
+    pml4_t* pml4;
+    uint64_t count;
+    uint64_t addrs[VMM_TLB_BATCH_MAX];
+};
+
+static void vmm_tlb_batch_add(struct vmm_tlb_batch* batch, uint64_t virt_addr) {
+    if (batch->count < VMM_TLB_BATCH_MAX) {
+        batch->addrs[batch->count] = virt_addr;
+    }
+    batch->count++;
+}
+
+// Small batches get one invlpg per page; past VMM_TLB_BATCH_MAX pages a
+// single flush of the whole address space is cheaper
+static void vmm_tlb_batch_flush(struct vmm_tlb_batch* batch) {
+    if (batch->count == 0) {
+        return;
+    }
+    // The kernel half is loaded everywhere
+    bool kernel_half = batch->addrs[0] >= VMM_KERNEL_HALF;
+    bool loaded = kernel_half || batch->pml4 == vmm_cpu_as[cpu_current_id()]->pml4;
+    if (batch->count > VMM_TLB_BATCH_MAX || !loaded) {
+        vmm_flush_address_space(batch->pml4, kernel_half);
+    } else {
+        for (uint64_t i = 0; i < batch->count; i++) {
+            asm volatile ("invlpg (%0)" :: "r" (batch->addrs[i]) : "memory");
+        }
+        if (kernel_half) {
+            smp_tlb_shootdown(vmm_other_cpus(), true);
+        } else {
+            vmm_flush_other_cpus(batch->pml4);
+        }
+    }
+    batch->count = 0;
+}
+
+// Gives an address space a PCID from the current generation, starting a new
+// generation (and flushing the TLB) when all IDs have been handed out
+static void vmm_assign_pcid(struct address_space* as) {
+    if (vmm_pcid_next >= PCID_COUNT) {
+        vmm_pcid_generation++;
+        vmm_pcid_next = 1;
+        vmm_flush_tlb_all();
+        vmm_cpu_pcid_generation[cpu_current_id()] = vmm_pcid_generation;
+    }
+    as->pcid = vmm_pcid_next++;
+    as->pcid_generation = vmm_pcid_generation;
+    // A fresh PCID has no TLB entries on CPUs that caught up with this
+    // generation, and the others flush everything before loading it
+    as->tlb_stale_cpus = 0;
+}
+
+// Sets the global bit on every leaf of the kernel half so kernel
+// translations survive CR3 switches. The PML4 entries (and thus these
+// tables) are shared by all address spaces.
+static void vmm_mark_kernel_global(uint64_t table_phys, int level) {
+    uint64_t* entries = phys_to_virt(table_phys);
+    int start = (level == 4) ? 256 : 0;
+    for (int i = start; i < 512; i++) {
+        if (!(entries[i] & PTE_PRESENT)) continue;
+        if (level == 1 || (level < 4 && (entries[i] & PTE_HUGE))) {
+            entries[i] |= PTE_GLOBAL;
+        } else {
+            vmm_mark_kernel_global(entries[i] & PTE_ADDR_MASK, level - 1);
+        }
+    }
+}
 
 // TODO: Implement VMM functions using PMM
 
@@ -270,10 +245,62 @@ void vmm_init(void) {
     serial_print_hex((uint64_t)g_kernel_pml4);
     serial_write("\n", 1);
 
-    // Perform other VMM initialization if needed
+    uint32_t eax, ebx, ecx, edx;
+    cpu_cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpu_cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        vmm_has_1g_pages = (edx & (1u << 26)) != 0;
+    }
+    if (vmm_has_1g_pages) {
+        serial_write("VMM: 1GiB pages supported\n", 26);
+    } else {
+        serial_write("VMM: 1GiB pages not supported, using 2MiB\n", 42);
+    }
+
+    // Create the kernel window's PDPT now: address spaces copy the kernel
+    // half of the PML4 when they are created, so later additions would be
+    // invisible to them
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)g_kernel_pml4);
+    pml4e_t* window = &pml4_virt->entries[(VMM_KERNEL_WINDOW_BASE >> 39) & 0x1FF];
+    if (!(*window & PTE_PRESENT)) {
+        void* pdpt_phys = pmm_alloc_zeroed_frame();
+        if (!pdpt_phys) {
+            serial_write("VMM Error: Failed to allocate kernel window PDPT!\n", 50);
+            for(;;);
+        }
+        pmm_set_category(pdpt_phys, 0, MEMSTAT_PAGE_TABLES);
+        *window = (uint64_t)pdpt_phys | PTE_PRESENT | PTE_WRITABLE;
+    }
+
+    vmm_zero_frame = (uint64_t)pmm_alloc_zeroed_frame();
+    if (!vmm_zero_frame) {
+        serial_write("VMM Error: Failed to allocate the zero page!\n", 45);
+        for(;;);
+    }
+
+    g_kernel_address_space.pml4 = g_kernel_pml4;
+    g_kernel_address_space.pcid = 0;
+    g_kernel_address_space.pcid_generation = 0;
+    g_kernel_address_space.in_use = true;
+
+    vmm_mark_kernel_global((uint64_t)g_kernel_pml4, 4);
+    uint64_t cr4 = cpu_read_cr4() | CR4_PGE;
+
+    // PCIDE may only be set while CR3 selects PCID 0
+    cpu_cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (ecx & (1u << 17)) {
+        asm volatile ("mov %0, %%cr3" : : "r"((uint64_t)g_kernel_pml4) : "memory");
+        cr4 |= CR4_PCIDE;
+        vmm_pcid_enabled = true;
+        serial_write("VMM: PCID enabled\n", 18);
+    } else {
+        serial_write("VMM: PCID not supported\n", 24);
+    }
+    cpu_write_cr4(cr4);
+    vmm_flush_tlb_all();
 }
 
-pml4_t* vmm_create_address_space(void) {
+struct address_space* vmm_create_address_space(void) {
     // Get the physical address of the current kernel PML4
     // uint64_t kernel_pml4_phys_addr;
     // asm volatile ("mov %%cr3, %0" : "=r"(kernel_pml4_phys_addr));
@@ -287,22 +314,34 @@ pml4_t* vmm_create_address_space(void) {
     }
     uint64_t kernel_pml4_phys_addr = (uint64_t)g_kernel_pml4;
 
-    // Allocate a frame for the new PML4 table
-    pml4_t* user_pml4_phys = (pml4_t*)pmm_alloc_frame();
+    struct address_space* as = NULL;
+    for (int i = 0; i < VMM_MAX_ADDRESS_SPACES; i++) {
+        if (!vmm_address_spaces[i].in_use) {
+            as = &vmm_address_spaces[i];
+            break;
+        }
+    }
+    if (!as) {
+        serial_write("VMM Error: Too many address spaces!\n", 36);
+        return NULL;
+    }
+
+    // Allocate a zeroed frame for the new PML4 table
+    pml4_t* user_pml4_phys = (pml4_t*)pmm_alloc_zeroed_frame();
     if (!user_pml4_phys) {
         serial_write("VMM Error: Failed to allocate PML4 frame!\n", 43);
         return NULL;
     }
+    pmm_set_category(user_pml4_phys, 0, MEMSTAT_PAGE_TABLES);
 
     // Get virtual addresses for both PML4s using HHDM
     pml4_t* kernel_pml4_virt = (pml4_t*)phys_to_virt(kernel_pml4_phys_addr);
     pml4_t* user_pml4_virt = (pml4_t*)phys_to_virt((uint64_t)user_pml4_phys);
 
-    // Zero out the new user PML4 table
-    memset(user_pml4_virt, 0, PAGE_SIZE);
-
     // Copy kernel mappings (higher half, e.g., entries 256-511)
-    // Adjust the range if your kernel isn't purely in the higher half
+    // Adjust the range if your kernel isn't purely in the higher half.
+    // The leaves below these entries were made global in vmm_init, so they
+    // stay in the TLB across switches to and from this address space.
     serial_write("VMM: Copying kernel mappings...\n", 31);
     for (int i = 256; i < 512; i++) {
         if (kernel_pml4_virt->entries[i] & PTE_PRESENT) {
@@ -313,10 +352,717 @@ pml4_t* vmm_create_address_space(void) {
     serial_write("VMM: Created new address space (PML4) at phys 0x", 49);
     serial_print_hex((uint64_t)user_pml4_phys);
     serial_write("\n", 1);
-    return user_pml4_phys; // Return physical address
+
+    as->pml4 = user_pml4_phys;
+    as->pcid = 0;
+    as->pcid_generation = 0; // PCID is assigned on first switch
+    as->tlb_stale_cpus = 0;
+    as->areas = NULL;
+    as->area_count = 0;
+    as->area_capacity = 0;
+    as->area_pages = 0;
+    as->pages_faulted = 0;
+    as->cow_copies = 0;
+    as->pages_cached = 0;
+    as->pages_swapped_in = 0;
+    as->brk_start = 0;
+    as->brk = 0;
+    as->in_use = true;
+    return as;
+}
+
+// --- Virtual memory areas ---
+
+// Index of the first area ending above addr (areas are sorted and disjoint)
+static unsigned int vmm_area_index(struct address_space* as, uint64_t addr) {
+    unsigned int lo = 0, hi = as->area_count;
+    while (lo < hi) {
+        unsigned int mid = (lo + hi) / 2;
+        if (as->areas[mid].end <= addr) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+struct vmm_area* vmm_find_area(struct address_space* as, uint64_t addr) {
+    unsigned int i = vmm_area_index(as, addr);
+    if (i < as->area_count && as->areas[i].start <= addr) {
+        return &as->areas[i];
+    }
+    return NULL;
+}
+
+// Adjacent anonymous areas with the same protection are kept as one, so a
+// growing heap or a run of mmaps does not use up the table
+static bool vmm_areas_mergeable(const struct vmm_area* a, const struct vmm_area* b) {
+    return !a->file && !b->file && a->flags == b->flags;
+}
+
+// Makes room for count areas, growing the table if needed
+static bool vmm_reserve_areas(struct address_space* as, unsigned int count) {
+    if (count <= as->area_capacity) {
+        return true;
+    }
+    unsigned int capacity = as->area_capacity ? as->area_capacity * 2 : VMM_AREAS_INITIAL;
+    while (capacity < count) {
+        capacity *= 2;
+    }
+    if (capacity > VMM_MAX_AREAS) {
+        capacity = VMM_MAX_AREAS;
+    }
+    struct vmm_area* areas = NULL;
+    if (count <= capacity) {
+        areas = krealloc(as->areas, capacity * sizeof(as->areas[0]));
+    }
+    if (!areas) {
+        serial_write("VMM Error: Memory area table full!\n", 35);
+        return false;
+    }
+    as->areas = areas;
+    as->area_capacity = capacity;
+    return true;
+}
+
+static bool vmm_insert_area(struct address_space* as, const struct vmm_area* area) {
+    unsigned int i = vmm_area_index(as, area->start);
+    if (i < as->area_count && as->areas[i].start < area->end) {
+        serial_write("VMM Error: Overlapping memory area at 0x", 40);
+        serial_print_hex(area->start);
+        serial_write("\n", 1);
+        return false;
+    }
+
+    bool merge_below = i > 0 && as->areas[i - 1].end == area->start &&
+                       vmm_areas_mergeable(&as->areas[i - 1], area);
+    bool merge_above = i < as->area_count && as->areas[i].start == area->end &&
+                       vmm_areas_mergeable(&as->areas[i], area);
+    if (merge_below && merge_above) {
+        as->areas[i - 1].end = as->areas[i].end;
+        memmove(&as->areas[i], &as->areas[i + 1], (as->area_count - i - 1) * sizeof(as->areas[0]));
+        as->area_count--;
+    } else if (merge_below) {
+        as->areas[i - 1].end = area->end;
+    } else if (merge_above) {
+        as->areas[i].start = area->start;
+    } else {
+        if (!vmm_reserve_areas(as, as->area_count + 1)) {
+            return false;
+        }
+        memmove(&as->areas[i + 1], &as->areas[i], (as->area_count - i) * sizeof(as->areas[0]));
+        as->areas[i] = *area;
+        as->area_count++;
+    }
+    as->area_pages += (area->end - area->start) / PAGE_SIZE;
+    return true;
+}
+
+// The backing bytes of a file area, starting at file_vaddr. Only valid
+// until the file is next written to.
+static const uint8_t* vmm_area_data(const struct vmm_area* area) {
+    return (const uint8_t*)area->file->data + area->file_offset;
+}
+
+// Copies the file bytes of area that fall in page to frame_virt
+static void vmm_fill_page(uint8_t* frame_virt, const struct vmm_area* area, uint64_t page) {
+    if (!area->file) {
+        return;
+    }
+    uint64_t copy_start = area->file_vaddr > page ? area->file_vaddr : page;
+    uint64_t copy_end = area->file_vaddr + area->file_size;
+    if (copy_end > page + PAGE_SIZE) {
+        copy_end = page + PAGE_SIZE;
+    }
+    if (copy_start < copy_end) {
+        memcpy(frame_virt + (copy_start - page),
+               vmm_area_data(area) + (copy_start - area->file_vaddr),
+               copy_end - copy_start);
+    }
+}
+
+bool vmm_add_area(struct address_space* as, const struct vmm_area* area) {
+    return vmm_insert_area(as, area);
+}
+
+bool vmm_add_segment(struct address_space* as, const struct vmm_area* area) {
+    struct vmm_area upper = *area;
+    struct vmm_area* below = vmm_find_area(as, upper.start);
+
+    // ELF segments that are not page aligned share a page: split it off both
+    // into an area of its own with the union of their permissions, populated
+    // now since no single backing describes it
+    if (below && below->start < upper.start && below->end == upper.start + PAGE_SIZE) {
+        uint64_t page = upper.start;
+        struct vmm_area shared = {
+            .start = page,
+            .end = page + PAGE_SIZE,
+            .flags = PTE_PRESENT | PTE_USER | ((below->flags | upper.flags) & PTE_WRITABLE) |
+                     (below->flags & upper.flags & PTE_NX),
+        };
+        void* frame = pmm_alloc_zeroed_frame();
+        if (!frame) {
+            return false;
+        }
+        pmm_set_category(frame, 0, MEMSTAT_USER);
+        vmm_fill_page(phys_to_virt((uint64_t)frame), below, page);
+        vmm_fill_page(phys_to_virt((uint64_t)frame), &upper, page);
+        if (!vmm_map_page(as->pml4, page, (uint64_t)frame, shared.flags)) {
+            pmm_free_frame(frame);
+            return false;
+        }
+        below->end = page;
+        as->area_pages--;
+        upper.start = page + PAGE_SIZE;
+        // The page stays mapped even if this fails; teardown frees it
+        if (!vmm_insert_area(as, &shared)) {
+            return false;
+        }
+        if (upper.start == upper.end) {
+            return true; // The whole segment fit in the shared page
+        }
+    }
+    return vmm_insert_area(as, &upper);
+}
+
+bool vmm_remove_range(struct address_space* as, uint64_t start, uint64_t end) {
+    unsigned int i = vmm_area_index(as, start);
+    // Punching a hole in one area splits it in two
+    if (i < as->area_count && as->areas[i].start < start && as->areas[i].end > end &&
+        !vmm_reserve_areas(as, as->area_count + 1)) {
+        return false;
+    }
+
+    while (i < as->area_count && as->areas[i].start < end) {
+        struct vmm_area* area = &as->areas[i];
+        uint64_t cut_start = area->start > start ? area->start : start;
+        uint64_t cut_end = area->end < end ? area->end : end;
+        as->area_pages -= (cut_end - cut_start) / PAGE_SIZE;
+        if (area->start < cut_start && area->end > cut_end) {
+            // The file coordinates are absolute, so both halves keep them
+            memmove(&as->areas[i + 2], &as->areas[i + 1], (as->area_count - i - 1) * sizeof(as->areas[0]));
+            as->areas[i + 1] = *area;
+            as->areas[i + 1].start = cut_end;
+            area->end = cut_start;
+            as->area_count++;
+            break;
+        } else if (area->start < cut_start) {
+            area->end = cut_start;
+            i++;
+        } else if (area->end > cut_end) {
+            area->start = cut_end;
+            break;
+        } else {
+            memmove(&as->areas[i], &as->areas[i + 1], (as->area_count - i - 1) * sizeof(as->areas[0]));
+            as->area_count--;
+        }
+    }
+
+    vmm_unmap_range(as->pml4, start, end - start, true);
+    return true;
+}
+
+uint64_t vmm_find_free_range(struct address_space* as, uint64_t base, uint64_t limit, uint64_t size) {
+    // First fit: walk the areas above base until one starts past the gap
+    uint64_t candidate = base;
+    for (unsigned int i = vmm_area_index(as, base); i < as->area_count; i++) {
+        if (as->areas[i].start >= candidate + size) {
+            break;
+        }
+        if (as->areas[i].end > candidate) {
+            candidate = as->areas[i].end;
+        }
+    }
+    if (candidate + size > limit || candidate + size < candidate) {
+        return 0;
+    }
+    return candidate;
+}
+
+static pt_t* vmm_range_pt(pml4_t* pml4, uint64_t virt_addr, uint64_t end, bool create, uint64_t* span_end);
+
+// Gives the faulting address space a private, writable copy of a
+// copy-on-write page. The last owner simply takes the frame over, and the
+// zero page is replaced by a fresh zeroed frame.
+static bool vmm_resolve_cow(struct address_space* as, uint64_t page) {
+    uint64_t span_end;
+    pt_t* pt_virt = vmm_range_pt(as->pml4, page, page + PAGE_SIZE, false, &span_end);
+    if (!pt_virt) {
+        return false;
+    }
+    pte_t* pte = &pt_virt->entries[(page >> 12) & 0x1FF];
+    if (!(*pte & PTE_PRESENT) || !(*pte & PTE_COW)) {
+        return false; // A genuine write to a read-only page
+    }
+
+    uint64_t old_phys = *pte & PTE_ADDR_MASK;
+    uint64_t flags = (*pte & ~(PTE_ADDR_MASK | PTE_COW)) | PTE_WRITABLE;
+    if (old_phys == vmm_zero_frame) {
+        void* frame = pmm_alloc_zeroed_frame();
+        if (!frame) {
+            return false;
+        }
+        pmm_set_category(frame, 0, MEMSTAT_USER);
+        *pte = (uint64_t)frame | flags;
+    } else if (pmm_frame_sharers((void*)old_phys) == 0) {
+        // Last owner: the frame is private (again), including a merged one
+        pmm_set_category((void*)old_phys, 0, MEMSTAT_USER);
+        *pte = old_phys | flags;
+    } else {
+        void* frame = pmm_alloc_frame();
+        if (!frame) {
+            return false;
+        }
+        pmm_set_category(frame, 0, MEMSTAT_USER);
+        memcpy(phys_to_virt((uint64_t)frame), phys_to_virt(old_phys), PAGE_SIZE);
+        *pte = (uint64_t)frame | flags;
+        pmm_frame_release((void*)old_phys);
+        as->cow_copies++;
+    }
+    vmm_flush_page(as->pml4, page);
+    return true;
+}
+
+// Reads a swapped-out page back into a fresh private frame
+static bool vmm_swap_in(struct address_space* as, const struct vmm_area* area, pte_t* pte) {
+    uint64_t start = cpu_rdtsc();
+    uint64_t entry = pte_swap_entry(*pte);
+    // May reclaim, but never this page: it is not present
+    void* frame = pmm_alloc_frame();
+    if (!frame) {
+        return false;
+    }
+    pmm_set_category(frame, 0, MEMSTAT_USER);
+    if (!swap_in(entry, frame)) {
+        pmm_free_frame(frame);
+        return false;
+    }
+    // The page was not present, so there is no stale TLB entry to flush
+    *pte = (uint64_t)frame | area->flags;
+    as->pages_faulted++;
+    as->pages_swapped_in++;
+    swap_account_fault(cpu_rdtsc() - start);
+    return true;
+}
+
+bool vmm_handle_page_fault(uint64_t fault_addr, uint64_t err_code) {
+    struct address_space* as = vmm_cpu_as[cpu_current_id()];
+    if (as == &g_kernel_address_space || fault_addr >= VMM_KERNEL_HALF) {
+        return false;
+    }
+    if (err_code & PF_ERR_PRESENT) {
+        // The page is there; only a write to a copy-on-write page is fixable
+        if (!(err_code & PF_ERR_WRITE)) {
+            return false;
+        }
+        // While this fault waited for the kernel lock, another CPU may have
+        // made the page writable again (vmm_write_restore) or swapped it out
+        pte_t* pte = vmm_get_user_pte(as, fault_addr & PAGE_MASK);
+        if (pte && (*pte & PTE_PRESENT) && (*pte & PTE_WRITABLE)) {
+            return true; // Retry the store
+        }
+        if (!pte || (*pte & PTE_PRESENT)) {
+            return vmm_resolve_cow(as, fault_addr & PAGE_MASK);
+        }
+        // Not present any more: handled as a fault on a missing page
+    }
+
+    uint64_t page = fault_addr & PAGE_MASK;
+    struct vmm_area* area = vmm_find_area(as, page);
+    if (!area) {
+        return false;
+    }
+    uint64_t flags = area->flags;
+    if ((err_code & PF_ERR_WRITE) && !(flags & PTE_WRITABLE)) {
+        return false;
+    }
+    if ((err_code & PF_ERR_FETCH) && (flags & PTE_NX)) {
+        return false;
+    }
+
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (pte && pte_is_swap(*pte)) {
+        return vmm_swap_in(as, area, pte);
+    }
+
+    // A read of a page with no file bytes in it maps the zero page; the
+    // first write replaces it with a private frame
+    bool has_file_bytes = area->file && page < area->file_vaddr + area->file_size &&
+                          page + PAGE_SIZE > area->file_vaddr;
+    if (!(err_code & PF_ERR_WRITE) && !has_file_bytes && vmm_zero_frame) {
+        uint64_t zero_flags = flags;
+        if (flags & PTE_WRITABLE) {
+            zero_flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+        }
+        if (!vmm_map_page(as->pml4, page, vmm_zero_frame, zero_flags)) {
+            return false;
+        }
+        as->pages_faulted++;
+        return true;
+    }
+
+    // Read-only file pages are shared through the page cache
+    if (area->cached && !(flags & PTE_WRITABLE)) {
+        uint64_t file_start = area->file_offset;
+        void* cached = pagecache_get(area->file, (const uint8_t*)area->file->data,
+                                     file_start + (page - area->file_vaddr),
+                                     file_start, file_start + area->file_size);
+        if (cached) {
+            if (!vmm_map_page(as->pml4, page, (uint64_t)cached, flags)) {
+                pmm_frame_release(cached);
+                return false;
+            }
+            as->pages_faulted++;
+            as->pages_cached++;
+            return true;
+        }
+    }
+
+    void* frame = pmm_alloc_zeroed_frame();
+    if (!frame) {
+        return false;
+    }
+    pmm_set_category(frame, 0, MEMSTAT_USER);
+    vmm_fill_page(phys_to_virt((uint64_t)frame), area, page);
+
+    // The page was not present, so there is no stale TLB entry to flush
+    if (!vmm_map_page(as->pml4, page, (uint64_t)frame, flags)) {
+        pmm_free_frame(frame);
+        return false;
+    }
+    as->pages_faulted++;
+    return true;
+}
+
+// --- Page table walking ---
+
+// Drops an address space's reference to a mapped user frame
+static void vmm_release_frame(uint64_t phys_addr) {
+    if (phys_addr != vmm_zero_frame) {
+        pmm_frame_release((void*)phys_addr);
+    }
+}
+
+// Drops what a user PTE holds: its frame, or its swap slot
+static void vmm_release_pte(pte_t pte) {
+    if (pte & PTE_PRESENT) {
+        vmm_release_frame(pte & PTE_ADDR_MASK);
+    } else if (pte_is_swap(pte)) {
+        swap_free(pte_swap_entry(pte));
+    }
+}
+
+// Frees a page table and the tables below it. The 4KiB frames mapped by the
+// PTs (and swap slots held by them) are freed too when free_frames is set;
+// huge leaves never are (user memory is only mapped 4KiB at a time).
+// level is 1 for a PT, 2 for a PD and 3 for a PDPT.
+static void vmm_free_table(uint64_t table_phys, int level, bool free_frames) {
+    if (level > 1 || free_frames) {
+        uint64_t* entries = phys_to_virt(table_phys);
+        for (int i = 0; i < 512; i++) {
+            if (level == 1) {
+                vmm_release_pte(entries[i]); // Frame or swap slot
+            } else if ((entries[i] & PTE_PRESENT) && !(entries[i] & PTE_HUGE)) {
+                vmm_free_table(entries[i] & PTE_ADDR_MASK, level - 1, free_frames);
+            }
+        }
+    }
+    pmm_free_frame((void*)table_phys);
+}
+
+void vmm_destroy_address_space(struct address_space* as) {
+    if (!as || as == &g_kernel_address_space || !as->in_use) {
+        return;
+    }
+    if (vmm_cpu_as[cpu_current_id()] == as) {
+        vmm_switch_address_space(&g_kernel_address_space);
+    }
+
+    // Entries 256-511 are the kernel's shared tables: leave them alone
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)as->pml4);
+    for (int i = 0; i < 256; i++) {
+        if (pml4_virt->entries[i] & PTE_PRESENT) {
+            vmm_free_table(pml4_virt->entries[i] & PTE_ADDR_MASK, 3, true);
+            pml4_virt->entries[i] = 0;
+        }
+    }
+    pmm_free_frame(as->pml4);
+    kfree(as->areas);
+    as->areas = NULL;
+    as->area_count = 0;
+    as->area_capacity = 0;
+
+    // The PCID is not handed out again before the next generation flush, so
+    // any TLB entries left behind under it are harmless
+    as->pml4 = NULL;
+    as->in_use = false;
+}
+
+// Shares one present parent page with the child, write-protecting it in the
+// parent if it was writable
+static bool vmm_clone_page(pte_t* pte, uint64_t virt_addr, struct address_space* child,
+                           struct vmm_tlb_batch* batch) {
+    uint64_t phys_addr = *pte & PTE_ADDR_MASK;
+    uint64_t flags = *pte & ~PTE_ADDR_MASK;
+    if (phys_addr == vmm_zero_frame) {
+        // Already read-only (and COW if the area is writable) in the parent
+        return vmm_map_page(child->pml4, virt_addr, phys_addr, flags);
+    }
+    if (!pmm_frame_share((void*)phys_addr)) {
+        // Too many owners already: give the child its own copy now
+        void* frame = pmm_alloc_frame();
+        if (!frame) return false;
+        pmm_set_category(frame, 0, MEMSTAT_USER);
+        memcpy(phys_to_virt((uint64_t)frame), phys_to_virt(phys_addr), PAGE_SIZE);
+        if (!vmm_map_page(child->pml4, virt_addr, (uint64_t)frame, flags)) {
+            pmm_free_frame(frame);
+            return false;
+        }
+        return true;
+    }
+    if (flags & PTE_WRITABLE) {
+        flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+        *pte = phys_addr | flags;
+        vmm_tlb_batch_add(batch, virt_addr);
+    }
+    if (!vmm_map_page(child->pml4, virt_addr, phys_addr, flags)) {
+        pmm_frame_release((void*)phys_addr);
+        return false;
+    }
+    return true;
+}
+
+// Gives the child a reference to the swap slot of a swapped-out parent page
+static bool vmm_clone_swap(pte_t pte, uint64_t virt_addr, struct address_space* child) {
+    uint64_t span_end;
+    pt_t* pt_virt = vmm_range_pt(child->pml4, virt_addr, virt_addr + PAGE_SIZE, true, &span_end);
+    if (!pt_virt || !swap_dup(pte_swap_entry(pte))) {
+        return false;
+    }
+    pt_virt->entries[(virt_addr >> 12) & 0x1FF] = pte;
+    return true;
+}
+
+bool vmm_clone_address_space(struct address_space* parent, struct address_space* child) {
+    // child is fresh, and parent's areas are already sorted and disjoint
+    if (!vmm_reserve_areas(child, parent->area_count)) {
+        return false;
+    }
+    memcpy(child->areas, parent->areas, parent->area_count * sizeof(parent->areas[0]));
+    child->area_count = parent->area_count;
+    child->area_pages = parent->area_pages;
+    child->brk_start = parent->brk_start;
+    child->brk = parent->brk;
+
+    // Only the areas can hold user pages, so walk their page tables instead
+    // of the whole lower half
+    struct vmm_tlb_batch batch = { .pml4 = parent->pml4 };
+    bool ok = true;
+    for (unsigned int i = 0; i < parent->area_count && ok; i++) {
+        uint64_t virt_addr = parent->areas[i].start;
+        uint64_t end = parent->areas[i].end;
+        while (virt_addr < end && ok) {
+            uint64_t span_end;
+            pt_t* pt_virt = vmm_range_pt(parent->pml4, virt_addr, end, false, &span_end);
+            if (!pt_virt) {
+                virt_addr = span_end; // Nothing faulted in here yet
+                continue;
+            }
+            for (; virt_addr < span_end && ok; virt_addr += PAGE_SIZE) {
+                pte_t* pte = &pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+                if (*pte & PTE_PRESENT) {
+                    ok = vmm_clone_page(pte, virt_addr, child, &batch);
+                } else if (pte_is_swap(*pte)) {
+                    ok = vmm_clone_swap(*pte, virt_addr, child);
+                }
+            }
+        }
+    }
+    // Write-protected parent pages must not stay writable in the TLB, even
+    // when the clone gave up half way
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
+void vmm_count_pages(struct address_space* as, struct vmm_page_counts* counts) {
+    counts->zero = 0;
+    counts->shared = 0;
+    counts->private = 0;
+    counts->swapped = 0;
+    for (unsigned int i = 0; i < as->area_count; i++) {
+        uint64_t virt_addr = as->areas[i].start;
+        uint64_t end = as->areas[i].end;
+        while (virt_addr < end) {
+            uint64_t span_end;
+            pt_t* pt_virt = vmm_range_pt(as->pml4, virt_addr, end, false, &span_end);
+            if (!pt_virt) {
+                virt_addr = span_end;
+                continue;
+            }
+            for (; virt_addr < span_end; virt_addr += PAGE_SIZE) {
+                pte_t pte = pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+                if (pte_is_swap(pte)) {
+                    counts->swapped++;
+                    continue;
+                }
+                if (!(pte & PTE_PRESENT)) continue;
+                uint64_t phys_addr = pte & PTE_ADDR_MASK;
+                if (phys_addr == vmm_zero_frame) {
+                    counts->zero++;
+                } else if (pmm_frame_sharers((void*)phys_addr) > 0) {
+                    counts->shared++;
+                } else {
+                    counts->private++;
+                }
+            }
+        }
+    }
+}
+
+struct address_space* vmm_get_address_space(unsigned int idx) {
+    if (idx >= VMM_MAX_ADDRESS_SPACES || !vmm_address_spaces[idx].in_use) {
+        return NULL;
+    }
+    return &vmm_address_spaces[idx];
+}
+
+pte_t* vmm_get_user_pte(struct address_space* as, uint64_t page) {
+    uint64_t span_end;
+    pt_t* pt_virt = vmm_range_pt(as->pml4, page, page + PAGE_SIZE, false, &span_end);
+    if (!pt_virt) {
+        return NULL;
+    }
+    return &pt_virt->entries[(page >> 12) & 0x1FF];
+}
+
+// Flags of a shared mapping of a page mapped with flags
+static uint64_t vmm_cow_flags(uint64_t flags) {
+    if (flags & PTE_WRITABLE) {
+        flags = (flags & ~PTE_WRITABLE) | PTE_COW;
+    }
+    return flags;
+}
+
+uint64_t vmm_write_protect(struct address_space* as, uint64_t page) {
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (!pte || !(*pte & PTE_PRESENT)) {
+        return 0;
+    }
+    uint64_t old = *pte;
+    if (old & PTE_WRITABLE) {
+        *pte = (old & PTE_ADDR_MASK) | vmm_cow_flags(old & ~PTE_ADDR_MASK);
+        // Stores through a cached translation would still go through
+        vmm_flush_page(as->pml4, page);
+    }
+    return old;
+}
+
+void vmm_write_restore(struct address_space* as, uint64_t page, uint64_t old) {
+    if (!(old & PTE_WRITABLE)) {
+        return;
+    }
+    pte_t* pte = vmm_get_user_pte(as, page);
+    uint64_t hw_bits = PTE_ACCESSED | PTE_DIRTY;
+    uint64_t protected = (old & PTE_ADDR_MASK) | vmm_cow_flags(old & ~PTE_ADDR_MASK);
+    if (!pte || (*pte & ~hw_bits) != (protected & ~hw_bits)) {
+        return; // Changed meanwhile: merged, swapped, unmapped or written
+    }
+    *pte = old | (*pte & hw_bits);
+    vmm_flush_page(as->pml4, page);
+}
+
+bool vmm_merge_page(struct address_space* as, uint64_t page, uint64_t old_phys, uint64_t new_phys) {
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (!pte || !(*pte & PTE_PRESENT) || (*pte & PTE_ADDR_MASK) != old_phys) {
+        return false;
+    }
+    if (new_phys == 0) {
+        new_phys = vmm_zero_frame;
+    } else if (!pmm_frame_share((void*)new_phys)) {
+        return false;
+    }
+    *pte = new_phys | vmm_cow_flags(*pte & ~PTE_ADDR_MASK);
+    vmm_flush_page(as->pml4, page);
+    vmm_release_frame(old_phys);
+    return true;
+}
+
+bool vmm_test_and_clear_accessed(struct address_space* as, uint64_t page) {
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (!pte || !(*pte & PTE_PRESENT) || !(*pte & PTE_ACCESSED)) {
+        return false;
+    }
+    *pte &= ~PTE_ACCESSED;
+    // Otherwise a cached translation would let accesses skip setting it again
+    vmm_flush_page(as->pml4, page);
+    return true;
+}
+
+bool vmm_swap_out_page(struct address_space* as, uint64_t page, uint64_t old_phys, uint64_t entry) {
+    pte_t* pte = vmm_get_user_pte(as, page);
+    if (!pte || !(*pte & PTE_PRESENT) || (*pte & PTE_ADDR_MASK) != old_phys) {
+        return false;
+    }
+    *pte = pte_make_swap(entry);
+    vmm_flush_page(as->pml4, page);
+    vmm_release_frame(old_phys);
+    return true;
+}
+
+// Replaces a huge entry (level 3 = 1GiB PDPTE, level 2 = 2MiB PDE) with a
+// table of 512 entries mapping the same physical range with the same flags.
+static bool vmm_split_huge(uint64_t* entry, uint64_t virt_addr, int level) {
+    uint64_t old = *entry;
+    void* table_phys = pmm_alloc_frame();
+    if (!table_phys) {
+        serial_write("VMM Error: Out of memory splitting huge page\n", 45);
+        return false;
+    }
+    pmm_set_category(table_phys, 0, MEMSTAT_PAGE_TABLES);
+    uint64_t* table = phys_to_virt((uint64_t)table_phys);
+
+    if (level == 3) {
+        // 1GiB -> 512 x 2MiB: flags and PAT position stay the same
+        uint64_t base = old & PTE_ADDR_MASK_1G;
+        uint64_t flags = old & ~PTE_ADDR_MASK_1G;
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + (uint64_t)i * PAGE_SIZE_2M) | flags;
+        }
+    } else {
+        // 2MiB -> 512 x 4KiB: drop PS and move PAT back to bit 7
+        uint64_t base = old & PTE_ADDR_MASK_2M;
+        uint64_t flags = old & ~PTE_ADDR_MASK_2M & ~(PTE_HUGE | PTE_HUGE_PAT);
+        if (old & PTE_HUGE_PAT) {
+            flags |= PTE_PAT;
+        }
+        for (int i = 0; i < 512; i++) {
+            table[i] = (base + (uint64_t)i * PAGE_SIZE) | flags;
+        }
+    }
+
+    // The table inherits the huge page's permissions; the leaves enforce them
+    *entry = (uint64_t)table_phys | PTE_PRESENT | PTE_WRITABLE | (old & PTE_USER);
+    asm volatile ("invlpg (%0)" :: "r" (virt_addr) : "memory");
+    return true;
+}
+
+// Returns the table that *entry points to. If the entry is empty a zeroed
+// table is allocated when create is set; if it maps a huge page the page is
+// split. Returns NULL if there is no table (or no memory for one).
+static uint64_t* vmm_next_table(uint64_t* entry, uint64_t virt_addr, int level, bool create) {
+    if (!(*entry & PTE_PRESENT)) {
+        if (!create) return NULL;
+        void* table_phys = pmm_alloc_zeroed_frame();
+        if (!table_phys) return NULL; // Out of memory
+        pmm_set_category(table_phys, 0, MEMSTAT_PAGE_TABLES);
+        *entry = (uint64_t)table_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER; // Assume user accessible for now
+    } else if (level < 4 && (*entry & PTE_HUGE)) {
+        if (!vmm_split_huge(entry, virt_addr, level)) return NULL;
+    }
+    return phys_to_virt(*entry & PTE_ADDR_MASK);
 }
 
-// Placeholder - needs actual implementation
 bool vmm_map_page(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags) {
     // 1. Calculate indices for each level
     uint64_t pml4_index = (virt_addr >> 39) & 0x1FF;
@@ -327,59 +1073,28 @@ bool vmm_map_page(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t
     // Get virtual address of the PML4 table itself
     pml4_t* pml4_virt = phys_to_virt((uint64_t)pml4);
 
-    // 2. Walk PML4
-    pml4e_t* pml4e = &pml4_virt->entries[pml4_index];
-    pdpt_t* pdpt_virt;
-    if (!(*pml4e & PTE_PRESENT)) {
-        // PDPT not present, allocate one
-        void* pdpt_phys = pmm_alloc_frame();
-        if (!pdpt_phys) return false; // Out of memory
-        pdpt_virt = phys_to_virt((uint64_t)pdpt_phys);
-        memset(pdpt_virt, 0, PAGE_SIZE);
-        *pml4e = (uint64_t)pdpt_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER; // Assume user accessible for now
-    } else {
-        pdpt_virt = phys_to_virt(*pml4e & PAGE_MASK);
-    }
-
-    // 3. Walk PDPT
-    pdpte_t* pdpte = &pdpt_virt->entries[pdpt_index];
-    pd_t* pd_virt;
-    if (!(*pdpte & PTE_PRESENT)) {
-        // PD not present, allocate one
-        void* pd_phys = pmm_alloc_frame();
-        if (!pd_phys) return false; // Out of memory
-        pd_virt = phys_to_virt((uint64_t)pd_phys);
-        memset(pd_virt, 0, PAGE_SIZE);
-        *pdpte = (uint64_t)pd_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
-    } else {
-        // TODO: Check if this is a 1GiB huge page? Not handled here.
-        pd_virt = phys_to_virt(*pdpte & PAGE_MASK);
-    }
-
-    // 4. Walk PD
-    pde_t* pde = &pd_virt->entries[pd_index];
-    pt_t* pt_virt;
-    if (!(*pde & PTE_PRESENT)) {
-        // PT not present, allocate one
-        void* pt_phys = pmm_alloc_frame();
-        if (!pt_phys) return false; // Out of memory
-        pt_virt = phys_to_virt((uint64_t)pt_phys);
-        memset(pt_virt, 0, PAGE_SIZE);
-        *pde = (uint64_t)pt_phys | PTE_PRESENT | PTE_WRITABLE | PTE_USER;
-    } else {
-        // TODO: Check if this is a 2MiB huge page? Not handled here.
-        pt_virt = phys_to_virt(*pde & PAGE_MASK);
-    }
+    // 2. Walk PML4 -> PDPT -> PD -> PT, allocating tables and splitting
+    // huge pages that cover virt_addr
+    pdpt_t* pdpt_virt = (pdpt_t*)vmm_next_table(&pml4_virt->entries[pml4_index], virt_addr, 4, true);
+    if (!pdpt_virt) return false;
+    pd_t* pd_virt = (pd_t*)vmm_next_table(&pdpt_virt->entries[pdpt_index], virt_addr, 3, true);
+    if (!pd_virt) return false;
+    pt_t* pt_virt = (pt_t*)vmm_next_table(&pd_virt->entries[pd_index], virt_addr, 2, true);
+    if (!pt_virt) return false;
 
-    // 5. Set the PTE entry in the Page Table
+    // 3. Set the PTE entry in the Page Table
     pte_t* pte = &pt_virt->entries[pt_index];
-    if (*pte & PTE_PRESENT) {
+    bool was_present = (*pte & PTE_PRESENT) != 0;
+    if (was_present) {
         // TODO: Should we allow re-mapping? Maybe log a warning?
         serial_write("VMM Warning: Re-mapping existing page at virt 0x", 47);
         serial_print_hex(virt_addr);
         serial_write("\n", 1);
     }
     *pte = phys_addr | flags; // Apply the provided flags (PTE_PRESENT must be included in flags)
+    if (was_present) {
+        vmm_flush_page(pml4, virt_addr);
+    }
 
     // serial_write("VMM Map: virt 0x", 16);
     // serial_print_hex(virt_addr);
@@ -392,38 +1107,83 @@ bool vmm_map_page(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t
     return true; 
 }
 
-void vmm_unmap_page(pml4_t* pml4, uint64_t virt_addr) {
+bool vmm_map_huge(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags) {
+    if (size == PAGE_SIZE_1G && !vmm_has_1g_pages) {
+        // No 1GiB pages on this CPU: use 512 2MiB pages instead
+        for (uint64_t off = 0; off < PAGE_SIZE_1G; off += PAGE_SIZE_2M) {
+            if (!vmm_map_huge(pml4, virt_addr + off, phys_addr + off, PAGE_SIZE_2M, flags)) {
+                return false;
+            }
+        }
+        return true;
+    }
+    if ((size != PAGE_SIZE_2M && size != PAGE_SIZE_1G) ||
+        (virt_addr & (size - 1)) || (phys_addr & (size - 1))) {
+        serial_write("VMM Error: Bad huge page size or alignment\n", 43);
+        return false;
+    }
+
     uint64_t pml4_index = (virt_addr >> 39) & 0x1FF;
     uint64_t pdpt_index = (virt_addr >> 30) & 0x1FF;
     uint64_t pd_index   = (virt_addr >> 21) & 0x1FF;
-    uint64_t pt_index   = (virt_addr >> 12) & 0x1FF;
 
-    pml4_t* pml4_virt = phys_to_virt((uint64_t)pml4);
-    pml4e_t* pml4e = &pml4_virt->entries[pml4_index];
-    if (!(*pml4e & PTE_PRESENT)) {
-        return;
+    // Huge entries keep PAT at bit 12 since bit 7 is the page size bit
+    uint64_t huge_flags = (flags & ~PTE_PAT) | PTE_HUGE;
+    if (flags & PTE_PAT) {
+        huge_flags |= PTE_HUGE_PAT;
     }
 
-    pdpt_t* pdpt_virt = phys_to_virt(*pml4e & PAGE_MASK);
-    pdpte_t* pdpte = &pdpt_virt->entries[pdpt_index];
-    if (!(*pdpte & PTE_PRESENT)) {
-        return;
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)pml4);
+    pdpt_t* pdpt_virt = (pdpt_t*)vmm_next_table(&pml4_virt->entries[pml4_index], virt_addr, 4, true);
+    if (!pdpt_virt) return false;
+
+    uint64_t* entry;
+    int level;
+    if (size == PAGE_SIZE_1G) {
+        entry = &pdpt_virt->entries[pdpt_index];
+        level = 3;
+    } else {
+        pd_t* pd_virt = (pd_t*)vmm_next_table(&pdpt_virt->entries[pdpt_index], virt_addr, 3, true);
+        if (!pd_virt) return false;
+        entry = &pd_virt->entries[pd_index];
+        level = 2;
     }
 
-    pd_t* pd_virt = phys_to_virt(*pdpte & PAGE_MASK);
-    pde_t* pde = &pd_virt->entries[pd_index];
-    if (!(*pde & PTE_PRESENT)) {
-        return;
+    uint64_t old = *entry;
+    *entry = phys_addr | huge_flags;
+    if (old & PTE_PRESENT) {
+        if (old & PTE_HUGE) {
+            vmm_flush_page(pml4, virt_addr);
+        } else {
+            // A page table used to cover this range; its 4KiB mappings are gone
+            vmm_free_table(old & PTE_ADDR_MASK, level - 1, false);
+            vmm_flush_tlb_all();
+        }
     }
+    return true;
+}
+
+void vmm_unmap_page(pml4_t* pml4, uint64_t virt_addr) {
+    uint64_t pml4_index = (virt_addr >> 39) & 0x1FF;
+    uint64_t pdpt_index = (virt_addr >> 30) & 0x1FF;
+    uint64_t pd_index   = (virt_addr >> 21) & 0x1FF;
+    uint64_t pt_index   = (virt_addr >> 12) & 0x1FF;
+
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)pml4);
+    pdpt_t* pdpt_virt = (pdpt_t*)vmm_next_table(&pml4_virt->entries[pml4_index], virt_addr, 4, false);
+    if (!pdpt_virt) return;
+    pd_t* pd_virt = (pd_t*)vmm_next_table(&pdpt_virt->entries[pdpt_index], virt_addr, 3, false);
+    if (!pd_virt) return;
+    pt_t* pt_virt = (pt_t*)vmm_next_table(&pd_virt->entries[pd_index], virt_addr, 2, false);
+    if (!pt_virt) return;
 
-    pt_t* pt_virt = phys_to_virt(*pde & PAGE_MASK);
     pte_t* pte = &pt_virt->entries[pt_index];
     if (!(*pte & PTE_PRESENT)) {
         return;
     }
 
     *pte = 0;
-    asm volatile ("invlpg (%0)" :: "r" (virt_addr) : "memory");
+    vmm_flush_page(pml4, virt_addr);
 }
 
 uint64_t vmm_get_physical_address(pml4_t* pml4, uint64_t virt_addr) {
@@ -437,36 +1197,420 @@ uint64_t vmm_get_physical_address(pml4_t* pml4, uint64_t virt_addr) {
     if (!(pml4e & PTE_PRESENT)) {
         return 0;
     }
-    pdpt_t* pdpt_virt = phys_to_virt(pml4e & PAGE_MASK);
+    pdpt_t* pdpt_virt = phys_to_virt(pml4e & PTE_ADDR_MASK);
     pdpte_t pdpte = pdpt_virt->entries[pdpt_index];
     if (!(pdpte & PTE_PRESENT)) {
         return 0;
     }
-    pd_t* pd_virt = phys_to_virt(pdpte & PAGE_MASK);
+    if (pdpte & PTE_HUGE) {
+        return (pdpte & PTE_ADDR_MASK_1G) | (virt_addr & (PAGE_SIZE_1G - 1));
+    }
+    pd_t* pd_virt = phys_to_virt(pdpte & PTE_ADDR_MASK);
     pde_t pde = pd_virt->entries[pd_index];
     if (!(pde & PTE_PRESENT)) {
         return 0;
     }
-    pt_t* pt_virt = phys_to_virt(pde & PAGE_MASK);
+    if (pde & PTE_HUGE) {
+        return (pde & PTE_ADDR_MASK_2M) | (virt_addr & (PAGE_SIZE_2M - 1));
+    }
+    pt_t* pt_virt = phys_to_virt(pde & PTE_ADDR_MASK);
     pte_t pte = pt_virt->entries[pt_index];
     if (!(pte & PTE_PRESENT)) {
         return 0;
     }
 
-    uint64_t phys_page = pte & PAGE_MASK;
+    uint64_t phys_page = pte & PTE_ADDR_MASK;
     return phys_page | (virt_addr & ~PAGE_MASK);
 }
 
-void vmm_switch_address_space(pml4_t* pml4) {
-    uint64_t pml4_phys = (uint64_t)pml4; // Assuming pml4 holds the physical address
-    serial_write("VMM: Switching CR3 to 0x", 25);
-    serial_print_hex(pml4_phys);
-    serial_write("\n", 1);
-    asm volatile ("mov %0, %%cr3" : : "r"(pml4_phys) : "memory");
+// --- Range operations ---
+
+// Returns the page table covering virt_addr and sets *span_end to the end of
+// the 2MiB it covers, capped at end. Missing tables are allocated (and huge
+// pages split) when create is set; otherwise NULL means nothing is mapped
+// up to *span_end.
+static pt_t* vmm_range_pt(pml4_t* pml4, uint64_t virt_addr, uint64_t end, bool create, uint64_t* span_end) {
+    uint64_t next = (virt_addr & ~(PAGE_SIZE_2M - 1)) + PAGE_SIZE_2M;
+    *span_end = (next == 0 || next > end) ? end : next;
+
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)pml4);
+    pdpt_t* pdpt_virt = (pdpt_t*)vmm_next_table(&pml4_virt->entries[(virt_addr >> 39) & 0x1FF], virt_addr, 4, create);
+    if (!pdpt_virt) return NULL;
+    pd_t* pd_virt = (pd_t*)vmm_next_table(&pdpt_virt->entries[(virt_addr >> 30) & 0x1FF], virt_addr, 3, create);
+    if (!pd_virt) return NULL;
+    return (pt_t*)vmm_next_table(&pd_virt->entries[(virt_addr >> 21) & 0x1FF], virt_addr, 2, create);
 }
 
-pml4_t* vmm_get_current_address_space(void) {
-    uint64_t cr3_val;
-    asm volatile ("mov %%cr3, %0" : "=r"(cr3_val));
-    return (pml4_t*)(cr3_val & PAGE_MASK); // CR3 contains flags too, mask them off
+bool vmm_map_range(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags) {
+    struct vmm_tlb_batch batch = { .pml4 = pml4 };
+    uint64_t end = virt_addr + size;
+    bool ok = true;
+
+    while (virt_addr < end) {
+        uint64_t span_end;
+        pt_t* pt_virt = vmm_range_pt(pml4, virt_addr, end, true, &span_end);
+        if (!pt_virt) {
+            ok = false; // Out of memory for a page table
+            break;
+        }
+        for (; virt_addr < span_end; virt_addr += PAGE_SIZE, phys_addr += PAGE_SIZE) {
+            pte_t* pte = &pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+            if (*pte & PTE_PRESENT) {
+                vmm_tlb_batch_add(&batch, virt_addr);
+            }
+            *pte = phys_addr | flags;
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
+bool vmm_alloc_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, uint64_t flags) {
+    struct vmm_tlb_batch batch = { .pml4 = pml4 };
+    uint64_t end = virt_addr + size;
+    bool ok = true;
+
+    while (ok && virt_addr < end) {
+        uint64_t span_end;
+        pt_t* pt_virt = vmm_range_pt(pml4, virt_addr, end, true, &span_end);
+        if (!pt_virt) {
+            ok = false;
+            break;
+        }
+        for (; virt_addr < span_end; virt_addr += PAGE_SIZE) {
+            pte_t* pte = &pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+            if (*pte & PTE_PRESENT) {
+                // Shared page: widen to the union of both permissions
+                pte_t merged = *pte | (flags & PTE_WRITABLE);
+                if (!(flags & PTE_NX)) {
+                    merged &= ~PTE_NX;
+                }
+                if (merged != *pte) {
+                    *pte = merged;
+                    vmm_tlb_batch_add(&batch, virt_addr);
+                }
+                continue;
+            }
+            void* frame = pmm_alloc_zeroed_frame();
+            if (!frame) {
+                ok = false;
+                break;
+            }
+            pmm_set_category(frame, 0, MEMSTAT_USER);
+            *pte = (uint64_t)frame | flags;
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+    return ok;
+}
+
+void vmm_unmap_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, bool free_frames) {
+    struct vmm_tlb_batch batch = { .pml4 = pml4 };
+    uint64_t end = virt_addr + size;
+
+    while (virt_addr < end) {
+        uint64_t span_end;
+        pt_t* pt_virt = vmm_range_pt(pml4, virt_addr, end, false, &span_end);
+        if (!pt_virt) {
+            virt_addr = span_end; // Nothing mapped here
+            continue;
+        }
+        for (; virt_addr < span_end; virt_addr += PAGE_SIZE) {
+            pte_t* pte = &pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+            if (pte_is_swap(*pte)) {
+                // Not in the TLB; only the slot needs dropping
+                if (free_frames) {
+                    swap_free(pte_swap_entry(*pte));
+                }
+                *pte = 0;
+                continue;
+            }
+            if (!(*pte & PTE_PRESENT)) continue;
+            if (free_frames) {
+                vmm_release_frame(*pte & PTE_ADDR_MASK);
+            }
+            *pte = 0;
+            vmm_tlb_batch_add(&batch, virt_addr);
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+}
+
+void vmm_protect_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, uint64_t flags) {
+    struct vmm_tlb_batch batch = { .pml4 = pml4 };
+    uint64_t end = virt_addr + size;
+
+    while (virt_addr < end) {
+        uint64_t span_end;
+        pt_t* pt_virt = vmm_range_pt(pml4, virt_addr, end, false, &span_end);
+        if (!pt_virt) {
+            virt_addr = span_end;
+            continue;
+        }
+        for (; virt_addr < span_end; virt_addr += PAGE_SIZE) {
+            pte_t* pte = &pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+            if (!(*pte & PTE_PRESENT)) continue;
+            pte_t updated = (*pte & PTE_ADDR_MASK) | flags;
+            if (updated != *pte) {
+                *pte = updated;
+                vmm_tlb_batch_add(&batch, virt_addr);
+            }
+        }
+    }
+
+    vmm_tlb_batch_flush(&batch);
+}
+
+bool vmm_write_range(pml4_t* pml4, uint64_t virt_addr, const void* src, uint64_t len) {
+    const uint8_t* in = src;
+    uint64_t end = virt_addr + len;
+
+    while (virt_addr < end) {
+        uint64_t span_end;
+        pt_t* pt_virt = vmm_range_pt(pml4, virt_addr, end, false, &span_end);
+        if (!pt_virt) return false;
+        while (virt_addr < span_end) {
+            pte_t pte = pt_virt->entries[(virt_addr >> 12) & 0x1FF];
+            if (!(pte & PTE_PRESENT)) return false;
+            uint64_t offset = virt_addr & (PAGE_SIZE - 1);
+            uint64_t chunk = PAGE_SIZE - offset;
+            if (chunk > end - virt_addr) {
+                chunk = end - virt_addr;
+            }
+            memcpy((uint8_t*)phys_to_virt(pte & PTE_ADDR_MASK) + offset, in, chunk);
+            in += chunk;
+            virt_addr += chunk;
+        }
+    }
+    return true;
+}
+
+// --- Kernel window ---
+
+static uint64_t vmm_window_next = VMM_KERNEL_WINDOW_BASE; // Bump pointer
+
+// Reserves size bytes of kernel window, 2MiB aligned so huge pages fit
+static uint64_t vmm_alloc_window(uint64_t size) {
+    size = (size + PAGE_SIZE_2M - 1) & ~(PAGE_SIZE_2M - 1);
+    if (vmm_window_next + size > VMM_KERNEL_WINDOW_BASE + VMM_KERNEL_WINDOW_SIZE) {
+        serial_write("VMM Error: Kernel window exhausted\n", 35);
+        return 0;
+    }
+    uint64_t virt = vmm_window_next;
+    vmm_window_next += size;
+    return virt;
+}
+
+void* vmm_map_physical(uint64_t phys_addr, uint64_t size, uint64_t flags) {
+    // Keep the same offset within a 2MiB page on both sides so the middle of
+    // the range can use 2MiB (or 1GiB) entries
+    uint64_t phys_start = phys_addr & ~(PAGE_SIZE_2M - 1);
+    uint64_t phys_end = (phys_addr + size + PAGE_SIZE - 1) & PAGE_MASK;
+    uint64_t virt_start = vmm_alloc_window(phys_end - phys_start);
+    if (!virt_start) return NULL;
+    flags |= PTE_GLOBAL; // Kernel half, see vmm_mark_kernel_global
+
+    uint64_t phys = phys_addr & PAGE_MASK;
+    while (phys < phys_end) {
+        uint64_t virt = virt_start + (phys - phys_start);
+        uint64_t left = phys_end - phys;
+        bool ok;
+        if (!(phys & (PAGE_SIZE_1G - 1)) && !(virt & (PAGE_SIZE_1G - 1)) && left >= PAGE_SIZE_1G) {
+            ok = vmm_map_huge(g_kernel_pml4, virt, phys, PAGE_SIZE_1G, flags);
+            phys += PAGE_SIZE_1G;
+        } else if (!(phys & (PAGE_SIZE_2M - 1)) && left >= PAGE_SIZE_2M) {
+            ok = vmm_map_huge(g_kernel_pml4, virt, phys, PAGE_SIZE_2M, flags);
+            phys += PAGE_SIZE_2M;
+        } else {
+            ok = vmm_map_page(g_kernel_pml4, virt, phys, flags);
+            phys += PAGE_SIZE;
+        }
+        if (!ok) {
+            serial_write("VMM Error: Failed to map physical range\n", 40);
+            return NULL;
+        }
+    }
+    return (void*)(virt_start + (phys_addr - phys_start));
+}
+
+// Undoes a vmm_alloc_kernel_buffer that ran out of memory at end: unmaps
+// [virt_start, end) and frees its 2MiB blocks, frames and page tables.
+// virt_start is 2MiB aligned, so each step covers one page directory entry.
+// The window itself is not reused.
+static void vmm_free_kernel_buffer(uint64_t virt_start, uint64_t end) {
+    pml4_t* pml4_virt = phys_to_virt((uint64_t)g_kernel_pml4);
+    for (uint64_t virt = virt_start; virt < end; virt += PAGE_SIZE_2M) {
+        pml4e_t pml4e = pml4_virt->entries[(virt >> 39) & 0x1FF];
+        if (!(pml4e & PTE_PRESENT)) continue;
+        pdpt_t* pdpt_virt = phys_to_virt(pml4e & PTE_ADDR_MASK);
+        pdpte_t pdpte = pdpt_virt->entries[(virt >> 30) & 0x1FF];
+        if (!(pdpte & PTE_PRESENT)) continue;
+        pd_t* pd_virt = phys_to_virt(pdpte & PTE_ADDR_MASK);
+        pde_t* pde = &pd_virt->entries[(virt >> 21) & 0x1FF];
+        if (!(*pde & PTE_PRESENT)) continue;
+
+        if (*pde & PTE_HUGE) {
+            pmm_free_pages((void*)(*pde & PTE_ADDR_MASK_2M), 9);
+        } else {
+            pt_t* pt_virt = phys_to_virt(*pde & PTE_ADDR_MASK);
+            for (unsigned int i = 0; i < 512; i++) {
+                if (pt_virt->entries[i] & PTE_PRESENT) {
+                    pmm_free_frame((void*)(pt_virt->entries[i] & PTE_ADDR_MASK));
+                }
+            }
+            pmm_free_frame((void*)(*pde & PTE_ADDR_MASK));
+        }
+        *pde = 0;
+    }
+    vmm_flush_address_space(g_kernel_pml4, true);
+}
+
+void* vmm_alloc_kernel_buffer(uint64_t size, enum memstat_category cat) {
+    size = (size + PAGE_SIZE - 1) & PAGE_MASK;
+    uint64_t virt_start = vmm_alloc_window(size);
+    if (!virt_start) return NULL;
+
+    uint64_t flags = PTE_PRESENT | PTE_WRITABLE | PTE_NX | PTE_GLOBAL;
+    uint64_t off = 0;
+    while (off < size) {
+        uint64_t virt = virt_start + off;
+        if (size - off >= PAGE_SIZE_2M) {
+            // Order 9 = 512 frames = one 2MiB page, naturally aligned
+            void* block = pmm_alloc_pages(9);
+            if (block) {
+                pmm_set_category(block, 9, cat);
+                if (!vmm_map_huge(g_kernel_pml4, virt, (uint64_t)block, PAGE_SIZE_2M, flags)) {
+                    pmm_free_pages(block, 9);
+                    vmm_free_kernel_buffer(virt_start, virt);
+                    return NULL;
+                }
+                memset((void*)virt, 0, PAGE_SIZE_2M);
+                off += PAGE_SIZE_2M;
+                continue;
+            }
+            // Too fragmented for a 2MiB block: fall through to 4KiB frames
+        }
+        void* frame = pmm_alloc_zeroed_frame();
+        if (!frame) {
+            vmm_free_kernel_buffer(virt_start, virt);
+            return NULL;
+        }
+        pmm_set_category(frame, 0, cat);
+        if (!vmm_map_page(g_kernel_pml4, virt, (uint64_t)frame, flags)) {
+            pmm_free_frame(frame);
+            // The page table for virt may already exist; it goes too
+            vmm_free_kernel_buffer(virt_start, virt + PAGE_SIZE);
+            return NULL;
+        }
+        off += PAGE_SIZE;
+    }
+    return (void*)virt_start;
+}
+
+// Loads CR3 for as, tagging it with its PCID if pcid is set. The TLB
+// benchmark passes its own mode instead of vmm_pcid_enabled.
+static void vmm_load_address_space(struct address_space* as, bool pcid) {
+    uint64_t irq = cpu_irq_save();
+    unsigned int cpu = cpu_current_id();
+    uint64_t cr3 = (uint64_t)as->pml4;
+    if (pcid) {
+        if (vmm_cpu_pcid_generation[cpu] != vmm_pcid_generation) {
+            // Another CPU started a new generation: old IDs are being reused
+            vmm_flush_tlb_all();
+            vmm_cpu_pcid_generation[cpu] = vmm_pcid_generation;
+        }
+        if (as != &g_kernel_address_space && as->pcid_generation != vmm_pcid_generation) {
+            vmm_assign_pcid(as);
+        }
+        cr3 |= as->pcid;
+        if (as->tlb_stale_cpus & (1u << cpu)) {
+            as->tlb_stale_cpus &= ~(1u << cpu); // Flush this PCID's entries as CR3 loads
+        } else {
+            cr3 |= CR3_NOFLUSH;
+        }
+    }
+    asm volatile ("mov %0, %%cr3" : : "r"(cr3) : "memory");
+    vmm_cpu_as[cpu] = as;
+    cpu_irq_restore(irq);
+}
+
+void vmm_switch_address_space(struct address_space* as) {
+    vmm_load_address_space(as, vmm_pcid_enabled);
+}
+
+struct address_space* vmm_get_current_address_space(void) {
+    return vmm_cpu_as[cpu_current_id()];
+}
+
+void vmm_init_cpu(void) {
+    // Same page tables as the bootstrap processor; PCIDE may only be set
+    // while CR3 selects PCID 0
+    asm volatile ("mov %0, %%cr3" : : "r"((uint64_t)g_kernel_pml4) : "memory");
+    uint64_t cr4 = cpu_read_cr4() | CR4_PGE;
+    if (vmm_pcid_enabled) {
+        cr4 |= CR4_PCIDE;
+    }
+    cpu_write_cr4(cr4);
+    vmm_flush_tlb_all();
+
+    unsigned int cpu = cpu_current_id();
+    vmm_cpu_as[cpu] = &g_kernel_address_space;
+    vmm_cpu_pcid_generation[cpu] = vmm_pcid_generation;
+}
+
+bool vmm_pcid_supported(void) {
+    return vmm_pcid_enabled;
+}
+
+// --- TLB benchmark ---
+
+#define VMM_TLB_BENCH_BASE 0x100000000ULL // Above the user stack, outside the user layout
+
+uint64_t vmm_tlb_benchmark(uint64_t pages, uint64_t rounds, bool use_pcid) {
+    if (pages == 0 || rounds == 0 || (use_pcid && !vmm_pcid_enabled)) {
+        return 0;
+    }
+    struct address_space* as = vmm_create_address_space();
+    if (!as) return 0;
+
+    uint64_t mapped = 0;
+    for (; mapped < pages; mapped++) {
+        void* frame = pmm_alloc_frame();
+        if (!frame) break;
+        pmm_set_category(frame, 0, MEMSTAT_USER);
+        if (!vmm_map_page(as->pml4, VMM_TLB_BENCH_BASE + mapped * PAGE_SIZE, (uint64_t)frame,
+                          PTE_PRESENT | PTE_WRITABLE | PTE_NX)) {
+            pmm_free_frame(frame);
+            break;
+        }
+    }
+
+    struct address_space* prev = vmm_cpu_as[cpu_current_id()];
+    uint64_t irq = cpu_irq_save();
+    vmm_flush_tlb_all();
+
+    uint64_t cycles = 0;
+    for (uint64_t r = 0; r <= rounds; r++) {
+        uint64_t start = cpu_rdtsc();
+        vmm_load_address_space(as, use_pcid);
+        for (uint64_t i = 0; i < mapped; i++) {
+            (void)*(volatile uint8_t*)(VMM_TLB_BENCH_BASE + i * PAGE_SIZE);
+        }
+        vmm_load_address_space(prev, use_pcid);
+        if (r > 0) { // Round 0 warms the TLB and caches
+            cycles += cpu_rdtsc() - start;
+        }
+    }
+
+    // PCID 0 may now hold the benchmark's translations: start clean, and
+    // reload prev in the mode every other CPU uses
+    vmm_flush_tlb_all();
+    vmm_switch_address_space(prev);
+    cpu_irq_restore(irq);
+
+    vmm_destroy_address_space(as);
+    return cycles / rounds;
 }
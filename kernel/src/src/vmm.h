@@ -3,6 +3,7 @@
 #include <stdint.h>
 #include <stddef.h>
 #include <stdbool.h>
+#include "memstat.h"
 
 // --- Page Table Entry Flags ---
 #define PTE_PRESENT         (1ULL << 0)  // Present
@@ -14,11 +15,38 @@
 #define PTE_DIRTY           (1ULL << 6)  // Dirty
 #define PTE_PAT             (1ULL << 7)  // Page Attribute Table
 #define PTE_GLOBAL          (1ULL << 8)  // Global
+#define PTE_COW             (1ULL << 9)  // Available to software: read-only copy-on-write page
+#define PTE_SWAP            (1ULL << 10) // Software, non-present PTEs only: page is in swap
 #define PTE_NX              (1ULL << 63) // No Execute (Execute Disable)
 
+// In a PDPTE/PDE, bit 7 is the Page Size bit: the entry maps a 1GiB/2MiB page
+// directly and the PAT bit moves up to bit 12
+#define PTE_HUGE            (1ULL << 7)  // Page Size (huge page)
+#define PTE_HUGE_PAT        (1ULL << 12) // PAT bit of a huge page entry
+
+// Physical address bits of an entry (strips flags and NX)
+#define PTE_ADDR_MASK       0x000FFFFFFFFFF000ULL
+#define PTE_ADDR_MASK_2M    0x000FFFFFFFE00000ULL
+#define PTE_ADDR_MASK_1G    0x000FFFFFC0000000ULL
+
 #define PAGE_SIZE 4096
 #define PAGE_MASK (~(PAGE_SIZE - 1))
 
+// A page written out to swap keeps its swap entry (see swap.h) in the
+// address bits of its non-present PTE
+static inline bool pte_is_swap(uint64_t pte) {
+    return !(pte & PTE_PRESENT) && (pte & PTE_SWAP);
+}
+static inline uint64_t pte_make_swap(uint64_t entry) {
+    return (entry << 12) | PTE_SWAP;
+}
+static inline uint64_t pte_swap_entry(uint64_t pte) {
+    return (pte & PTE_ADDR_MASK) >> 12;
+}
+#define PAGE_SIZE_2M 0x200000ULL
+#define VMM_KERNEL_HALF 0xFFFF800000000000ULL // First canonical higher-half address
+#define PAGE_SIZE_1G 0x40000000ULL
+
 // Structure for a Page Map Level 4 Entry (PML4E) and Page Directory Pointer Table Entry (PDPTE)
 // Also used for Page Directory Entry (PDE) pointing to a Page Table (PT)
 typedef uint64_t pml4e_t;
@@ -45,36 +73,318 @@ typedef struct {
     pte_t entries[512];
 } __attribute__((aligned(PAGE_SIZE))) pt_t;
 
-// --- Physical Memory Management (Placeholder) ---
-void pmm_init(void); // TODO: Needs memory map info from Limine
-void* pmm_alloc_frame(void); // Allocates one physical 4KiB frame
+// --- Physical Memory Management (buddy allocator, see pmm.c) ---
+#define PMM_MAX_ORDER 10 // Largest block is 2^10 frames (4MiB)
+
+void pmm_init(void); // Seeds the free lists from the Limine memory map
+void* pmm_alloc_frame(void); // Allocates one physical 4KiB frame (order-0 fast path)
 void pmm_free_frame(void* frame);
 
+// Allocates 2^order physically contiguous frames aligned to their size
+// Returns the physical address of the first frame, or NULL if out of memory
+void* pmm_alloc_pages(unsigned int order);
+// Frees a block returned by pmm_alloc_pages with the same order
+void pmm_free_pages(void* addr, unsigned int order);
+
+// Per-CPU frame magazine counters. refills/allocs and drains/frees give the
+// fraction of order-0 operations that had to take the global PMM lock.
+struct pmm_magazine_stats {
+    uint64_t allocs;   // Frames handed out from the magazine
+    uint64_t frees;    // Frames returned to the magazine
+    uint64_t refills;  // Batches pulled from the buddy allocator
+    uint64_t drains;   // Batches pushed back to the buddy allocator
+    uint64_t cached;   // Frames currently held by the magazine
+};
+void pmm_get_magazine_stats(unsigned int cpu, struct pmm_magazine_stats *stats);
+
+// Allocates one zero-filled frame, from the pre-zeroed pool when possible
+void* pmm_alloc_zeroed_frame(void);
+// Zeroes one frame into the pool if it is not full; call when idle.
+// Returns true if a frame was zeroed.
+bool pmm_zero_idle_work(void);
+
+// Pre-zeroed pool counters. hits are zeroed allocations served without a
+// memset on the caller's path; misses had to zero synchronously.
+struct pmm_zero_pool_stats {
+    uint64_t hits;
+    uint64_t misses;
+    uint64_t idle_zeroed; // Frames zeroed by pmm_zero_idle_work
+    uint64_t pooled;      // Frames currently in the pool
+};
+void pmm_get_zero_pool_stats(struct pmm_zero_pool_stats *stats);
+
+// Number of frames currently allocated (not free, cached or pooled)
+uint64_t pmm_get_used_frames(void);
+// Number of frames the PMM manages
+uint64_t pmm_get_total_frames(void);
+
+// Called when the PMM is out of frames, with the number it would like
+// freed; returns the number actually freed into the allocator. At most one
+// hook, typically swap_reclaim. While it runs, pmm_alloc_frame can dip into
+// a small reserve so the hook itself can allocate.
+typedef uint64_t (*pmm_reclaim_fn)(uint64_t frames);
+void pmm_set_reclaim(pmm_reclaim_fn fn);
+
+// Moves an allocated block (2^order frames, as allocated) to another memstat
+// category. New blocks start out in MEMSTAT_KERNEL; freeing uncharges them.
+void pmm_set_category(void* frame, unsigned int order, enum memstat_category cat);
+// Category of an allocated block (pass its first frame)
+enum memstat_category pmm_get_category(void* frame);
+
+// Frames mapped by more than one address space (copy-on-write after fork).
+// Adds an owner to an allocated frame; returns false if the share count is
+// saturated, in which case the caller must copy the frame instead.
+bool pmm_frame_share(void* frame);
+// Owners beyond the first; 0 means the caller is the only owner
+unsigned int pmm_frame_sharers(void* frame);
+// Drops one owner, freeing the frame when it was the last
+void pmm_frame_release(void* frame);
+
 // --- Virtual Memory Management ---
 
-// Creates a new, empty PML4 table (kernel mappings might be added later)
-pml4_t* vmm_create_address_space(void);
+// CR3 bit 63: keep the TLB entries tagged with the loaded PCID
+#define CR3_NOFLUSH (1ULL << 63)
+#define PCID_COUNT 4096 // PCID is 12 bits; 0 belongs to the kernel
+
+// Page fault error code bits
+#define PF_ERR_PRESENT (1ULL << 0) // Protection violation (page was present)
+#define PF_ERR_WRITE   (1ULL << 1) // Write access
+#define PF_ERR_USER    (1ULL << 2) // Access from CPL 3
+#define PF_ERR_FETCH   (1ULL << 4) // Instruction fetch
+
+struct fs_file;
+
+// A virtual memory area: a page-aligned range of an address space with one
+// protection and one backing (an ELF segment, or anonymous memory such as
+// the stack). Nothing is mapped up front: the page fault handler allocates a
+// zeroed frame on first touch and copies in the bytes of
+// [file_vaddr, file_vaddr + file_size) that fall in the page.
+//
+// The file's bytes are looked up through the file at fault time, never kept
+// as a pointer: writing to the file may move its buffer.
+struct vmm_area {
+    uint64_t start;           // Page aligned
+    uint64_t end;             // Page aligned, exclusive
+    uint64_t flags;           // PTE flags for pages faulted in
+    const struct fs_file* file; // Backing file, NULL for anonymous memory
+    uint64_t file_offset;     // File offset of the byte at file_vaddr
+    uint64_t file_vaddr;
+    uint64_t file_size;
+    // Read-only pages of a cached area come from the page cache and are
+    // shared by every process mapping the same file. file_offset must be
+    // congruent to file_vaddr modulo PAGE_SIZE.
+    bool cached;
+};
+
+// The area table starts small and doubles on demand up to VMM_MAX_AREAS
+#define VMM_AREAS_INITIAL 16
+#define VMM_MAX_AREAS 4096
+
+// An address space: a PML4 and the PCID that tags its TLB entries.
+// PCIDs are handed out lazily on switch and belong to a generation; when the
+// IDs run out the generation is bumped, the whole TLB is flushed and every
+// address space picks up a new PCID on its next switch.
+struct address_space {
+    pml4_t* pml4;             // Physical address of the PML4
+    uint16_t pcid;            // Valid while pcid_generation is current
+    uint64_t pcid_generation; // 0 = no PCID assigned yet
+    uint32_t tlb_stale_cpus;  // CPUs to flush its PCID on next switch: mappings
+                              // changed while they did not have it loaded
+    bool in_use;
+    struct vmm_area* areas;   // Sorted by start, disjoint (kmalloc'd)
+    unsigned int area_count;
+    unsigned int area_capacity;
+    uint64_t area_pages;      // Pages covered by areas
+    uint64_t pages_faulted;   // Pages populated by vmm_handle_page_fault
+    uint64_t cow_copies;      // Shared pages copied on a write fault
+    uint64_t pages_cached;    // Faulted-in pages shared from the page cache
+    uint64_t pages_swapped_in; // Pages read back from swap by faults
+    uint64_t brk_start;       // Start of the heap (end of the program image)
+    uint64_t brk;             // Current program break
+};
+
+#define VMM_MAX_ADDRESS_SPACES 64
+
+// The kernel's address space (PCID 0)
+extern struct address_space g_kernel_address_space;
+
+// Creates a new address space sharing the kernel's higher-half mappings
+struct address_space* vmm_create_address_space(void);
+
+// Adds a demand-paged area. Returns false if the table is full or the
+// range overlaps an existing area.
+bool vmm_add_area(struct address_space* as, const struct vmm_area* area);
+
+// Adds an ELF segment as vmm_add_area does, except that it may start on the
+// last page of the segment below it (segments sharing a page): that page
+// becomes an area of its own with both permissions, populated immediately.
+bool vmm_add_segment(struct address_space* as, const struct vmm_area* area);
+
+// Returns the area containing addr, or NULL (binary search)
+struct vmm_area* vmm_find_area(struct address_space* as, uint64_t addr);
+
+// Removes [start, end) (page aligned) from the areas, trimming or splitting
+// the ones that overlap it, and unmaps and frees the pages in it. Returns
+// false if splitting an area would overflow the table.
+bool vmm_remove_range(struct address_space* as, uint64_t start, uint64_t end);
+
+// Returns the lowest address >= base where size bytes are free of areas and
+// end at or below limit, or 0 if there is no such gap
+uint64_t vmm_find_free_range(struct address_space* as, uint64_t base, uint64_t limit, uint64_t size);
+
+// Gives child (a fresh address space) the areas of parent and maps every page
+// parent has faulted in into child, sharing the frames. Writable pages become read-only PTE_COW
+// in both; the first write copies the page (see vmm_handle_page_fault).
+// Returns false if memory ran out; child must then be destroyed.
+bool vmm_clone_address_space(struct address_space* parent, struct address_space* child);
+
+// Resident pages of an address space by backing. zero pages map the shared
+// zero frame; shared pages have other owners (fork, page cache). swapped
+// pages are not resident but hold a swap entry.
+struct vmm_page_counts {
+    uint64_t zero;
+    uint64_t shared;
+    uint64_t private;
+    uint64_t swapped;
+};
+void vmm_count_pages(struct address_space* as, struct vmm_page_counts* counts);
+
+// --- Page merging and swapping (used by ksm.c and swap.c) ---
+
+// Returns the user address space in slot idx, or NULL if the slot is free
+struct address_space* vmm_get_address_space(unsigned int idx);
+
+// Returns the PTE mapping page in as, or NULL if no page table covers it
+pte_t* vmm_get_user_pte(struct address_space* as, uint64_t page);
+
+// Write-protects a present page while the caller copies or compares its
+// frame, so no store from another CPU can slip in unseen: a writable page
+// becomes PTE_COW and is flushed from every TLB. Returns the PTE from
+// before (0 if not present) for vmm_write_restore.
+uint64_t vmm_write_protect(struct address_space* as, uint64_t page);
+
+// Makes a page vmm_write_protect returned `old` for writable again, unless
+// its PTE has changed since
+void vmm_write_restore(struct address_space* as, uint64_t page, uint64_t old);
+
+// Replaces the mapping of old_phys at page with new_phys (0 = the shared
+// zero frame), write-protected as in vmm_write_protect, and drops the
+// reference to old_phys. Takes an owner of new_phys. Returns false, leaving
+// the page alone, if page no longer maps old_phys or new_phys has too many
+// owners.
+bool vmm_merge_page(struct address_space* as, uint64_t page, uint64_t old_phys, uint64_t new_phys);
+
+// Clears the accessed bit of a present page; returns whether it was set
+bool vmm_test_and_clear_accessed(struct address_space* as, uint64_t page);
+
+// Replaces the mapping of old_phys at page with swap entry `entry` and
+// drops the reference to old_phys. Returns false if page no longer maps
+// old_phys.
+bool vmm_swap_out_page(struct address_space* as, uint64_t page, uint64_t old_phys, uint64_t entry);
+
+// Resolves a page fault in the current address space by populating the page
+// from its area (reads of pages without file bytes map the zero page), or by
+// making a copy-on-write page private on a write. Returns
+// false if the access is invalid (no area, or a write/fetch the area does
+// not allow) or memory ran out.
+bool vmm_handle_page_fault(uint64_t fault_addr, uint64_t err_code);
+
+// Frees every frame mapped in the lower half, all lower-half page tables and
+// the PML4, then releases the address space. Switches to the kernel address
+// space first if as is loaded.
+void vmm_destroy_address_space(struct address_space* as);
 
 // Maps a virtual address to a physical address in the given PML4
 // Allocates page tables as needed
 // Returns true on success, false on failure (e.g., out of memory)
 bool vmm_map_page(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t flags);
 
-// Unmaps a virtual address
+// Maps one 2MiB or 1GiB page (size is PAGE_SIZE_2M or PAGE_SIZE_1G).
+// virt_addr and phys_addr must be aligned to size. flags use the 4KiB PTE
+// layout; PTE_PAT is moved to the huge-page position. 1GiB requests fall back
+// to 2MiB pages on CPUs without 1GiB page support. Any page tables previously
+// covering the range are freed.
+bool vmm_map_huge(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags);
+
+// Unmaps a virtual address. A huge page covering it is split first, so the
+// rest of the huge page stays mapped.
 void vmm_unmap_page(pml4_t* pml4, uint64_t virt_addr);
 
 // Gets the physical address corresponding to a virtual address in the given PML4
 // Returns 0 if not mapped
 uint64_t vmm_get_physical_address(pml4_t* pml4, uint64_t virt_addr);
 
-// Loads the given PML4 into CR3
-void vmm_switch_address_space(pml4_t* pml4);
+// --- Range operations ---
+// These walk each table level once per range rather than once per page and
+// collect TLB invalidations into a single flush at the end: invlpg per page
+// up to VMM_TLB_BATCH_MAX pages, a full flush of the address space above.
+// virt_addr, phys_addr and size must be page aligned.
+#define VMM_TLB_BATCH_MAX 32
+
+// Maps [virt_addr, virt_addr + size) to consecutive frames from phys_addr
+bool vmm_map_range(pml4_t* pml4, uint64_t virt_addr, uint64_t phys_addr, uint64_t size, uint64_t flags);
 
-// Gets the currently active PML4 from CR3
-pml4_t* vmm_get_current_address_space(void);
+// Backs [virt_addr, virt_addr + size) with fresh zeroed frames. Pages that
+// are already mapped keep their frame and get the union of both
+// permissions (writable if either is, executable if either is). On failure
+// the pages mapped so far stay mapped.
+bool vmm_alloc_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, uint64_t flags);
+
+// Unmaps every page in the range, freeing the frames if free_frames is set
+void vmm_unmap_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, bool free_frames);
+
+// Replaces the flags of every mapped page in the range
+void vmm_protect_range(pml4_t* pml4, uint64_t virt_addr, uint64_t size, uint64_t flags);
+
+// Copies len bytes from src into the range mapped at virt_addr in pml4
+// through the HHDM, so pml4 does not have to be loaded. Returns false if
+// part of the range is not mapped.
+bool vmm_write_range(pml4_t* pml4, uint64_t virt_addr, const void* src, uint64_t len);
+
+// Loads the given address space into CR3, keeping its TLB entries if it
+// still owns a PCID
+void vmm_switch_address_space(struct address_space* as);
+
+// Gets the address space loaded on this CPU
+struct address_space* vmm_get_current_address_space(void);
+
+// Puts an application processor on the kernel page tables with the paging
+// features vmm_init enabled on the bootstrap processor
+void vmm_init_cpu(void);
+
+// Flushes this CPU's TLB entries of the current PCID, or all entries
+// (global ones included) if global is set. For TLB shootdowns.
+void vmm_flush_tlb_local(bool global);
+
+// Measures the average TSC cycles per round of switching into an address
+// space, touching `pages` pages of it and switching back. With use_pcid
+// false every switch flushes the TLB, as before PCIDs. Returns 0 if the
+// benchmark could not run.
+uint64_t vmm_tlb_benchmark(uint64_t pages, uint64_t rounds, bool use_pcid);
+
+// True if the CPU supports PCIDs and they are enabled
+bool vmm_pcid_supported(void);
+
+// Kernel virtual window for mappings that do not live in the HHDM
+// (framebuffer remaps, large kernel buffers). Its PML4 slot is created by
+// vmm_init so every address space copies it.
+#define VMM_KERNEL_WINDOW_BASE 0xFFFFC00000000000ULL
+#define VMM_KERNEL_WINDOW_SIZE 0x8000000000ULL // One PML4 slot (512GiB)
+
+// Maps a physical range into the kernel window using the largest pages the
+// alignment allows. Returns the virtual address of phys_addr, or NULL.
+void* vmm_map_physical(uint64_t phys_addr, uint64_t size, uint64_t flags);
+
+// Allocates a zeroed, writable kernel buffer backed by 2MiB pages where
+// possible (4KiB frames otherwise), charged to memstat category cat.
+// Returns NULL if out of memory.
+void* vmm_alloc_kernel_buffer(uint64_t size, enum memstat_category cat);
 
 // Helper to convert physical address to virtual using HHDM
 void* phys_to_virt(uint64_t phys_addr);
 
+// Helper to convert an HHDM virtual address back to physical
+uint64_t virt_to_phys(const void* virt_addr);
+
 // Global variable holding the physical address of the kernel's top-level PML4 table
 extern pml4_t* g_kernel_pml4;
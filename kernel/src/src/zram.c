@@ -0,0 +1,283 @@
+#include "zram.h"
+#include "lz.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "slab.h"
+#include "serial.h"
+#include "lib/string.h"
+
+#define ZRAM_SECTORS_PER_PAGE (PAGE_SIZE / BLOCK_SECTOR_SIZE)
+
+enum zram_kind {
+    ZRAM_EMPTY = 0,
+    ZRAM_SAME,        // Every word of the page is `word`
+    ZRAM_COMPRESSED,  // `data` is an object of size class `size_class`
+    ZRAM_RAW,         // `data` is a frame (physical address) of its own
+};
+
+struct zram_slot {
+    union {
+        void* data;
+        uint64_t word;
+    };
+    uint16_t size;       // ZRAM_COMPRESSED: compressed bytes
+    uint8_t kind;
+    uint8_t size_class;
+};
+
+struct zram {
+    struct block_device dev;  // First, so a device pointer is a zram pointer
+    struct zram_slot* slots;  // One per page
+    uint64_t pages;
+    spinlock_t lock;          // Protects slots and stats
+    struct zram_stats stats;
+};
+
+// Compressed pages go into the smallest of these slab caches that fits.
+// Each size packs a whole number of objects into a slab with little left
+// over; the largest is about half a page, beyond that compression does not
+// pay and the page is kept raw.
+static const uint16_t zram_class_sizes[] = { 240, 400, 496, 672, 800, 1008, 1344, ZRAM_MAX_COMPRESSED };
+#define ZRAM_CLASSES (sizeof(zram_class_sizes) / sizeof(zram_class_sizes[0]))
+
+static struct kmem_cache* zram_classes[ZRAM_CLASSES];
+static spinlock_t zram_class_lock = SPINLOCK_INIT;
+
+// Returns the cache of size class `cls`, created on first use
+static struct kmem_cache* zram_class_cache(unsigned int cls) {
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&zram_class_lock);
+    if (!zram_classes[cls]) {
+        char name[KMEM_NAME_LEN] = "zram-";
+        uitoa(zram_class_sizes[cls], name + 5, 10);
+        zram_classes[cls] = kmem_cache_create(name, zram_class_sizes[cls]);
+    }
+    struct kmem_cache* cache = zram_classes[cls];
+    spin_unlock(&zram_class_lock);
+    cpu_irq_restore(irq_flags);
+    return cache;
+}
+
+static unsigned int zram_class_for(size_t size) {
+    unsigned int cls = 0;
+    while (zram_class_sizes[cls] < size) {
+        cls++;
+    }
+    return cls;
+}
+
+// True if the page is one 64-bit word repeated (most often zero)
+static bool zram_page_same(const void* page, uint64_t* word) {
+    const uint64_t* words = page;
+    for (size_t i = 1; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+        if (words[i] != words[0]) {
+            return false;
+        }
+    }
+    *word = words[0];
+    return true;
+}
+
+// Drops what a detached slot held. Called without the device lock.
+static void zram_release(const struct zram_slot* slot) {
+    if (slot->kind == ZRAM_COMPRESSED) {
+        kmem_cache_free(zram_classes[slot->size_class], slot->data);
+    } else if (slot->kind == ZRAM_RAW) {
+        pmm_free_frame(slot->data);
+    }
+}
+
+// Detaches page `idx` and takes it out of the stats; returns what it held.
+// Called with the device lock held.
+static struct zram_slot zram_detach(struct zram* z, uint64_t idx) {
+    struct zram_slot old = z->slots[idx];
+    if (old.kind != ZRAM_EMPTY) {
+        z->stats.pages--;
+    }
+    if (old.kind == ZRAM_SAME) {
+        z->stats.same_pages--;
+    } else if (old.kind == ZRAM_RAW) {
+        z->stats.raw_pages--;
+        z->stats.pool_bytes -= PAGE_SIZE;
+    } else if (old.kind == ZRAM_COMPRESSED) {
+        z->stats.compressed_bytes -= old.size;
+        z->stats.pool_bytes -= zram_class_sizes[old.size_class];
+    }
+    z->slots[idx].kind = ZRAM_EMPTY;
+    return old;
+}
+
+static bool zram_store(struct zram* z, uint64_t idx, const uint8_t* src) {
+    uint64_t start = cpu_rdtsc();
+    struct zram_slot slot = { .kind = ZRAM_SAME };
+    if (!zram_page_same(src, &slot.word)) {
+        // Compress before anything is locked or allocated: the allocations
+        // below may run reclaim
+        uint8_t buf[ZRAM_MAX_COMPRESSED];
+        size_t size = lz_compress(src, PAGE_SIZE, buf, sizeof(buf));
+        if (size > 0) {
+            unsigned int cls = zram_class_for(size);
+            struct kmem_cache* cache = zram_class_cache(cls);
+            slot.data = cache ? kmem_cache_alloc(cache) : NULL;
+            if (!slot.data) {
+                return false;
+            }
+            memcpy(slot.data, buf, size);
+            slot.kind = ZRAM_COMPRESSED;
+            slot.size = (uint16_t)size;
+            slot.size_class = (uint8_t)cls;
+        } else {
+            slot.data = pmm_alloc_frame();
+            if (!slot.data) {
+                return false;
+            }
+            memcpy(phys_to_virt((uint64_t)slot.data), src, PAGE_SIZE);
+            slot.kind = ZRAM_RAW;
+        }
+    }
+
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&z->lock);
+    struct zram_slot old = zram_detach(z, idx);
+    z->slots[idx] = slot;
+    z->stats.pages++;
+    if (slot.kind == ZRAM_SAME) {
+        z->stats.same_pages++;
+    } else if (slot.kind == ZRAM_RAW) {
+        z->stats.raw_pages++;
+        z->stats.pool_bytes += PAGE_SIZE;
+    } else {
+        z->stats.compressed_bytes += slot.size;
+        z->stats.pool_bytes += zram_class_sizes[slot.size_class];
+    }
+    z->stats.stores++;
+    z->stats.store_cycles += cpu_rdtsc() - start;
+    spin_unlock(&z->lock);
+    cpu_irq_restore(irq_flags);
+
+    zram_release(&old);
+    return true;
+}
+
+static bool zram_load(struct zram* z, uint64_t idx, uint8_t* dst) {
+    uint64_t start = cpu_rdtsc();
+    bool ok = true;
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&z->lock);
+    const struct zram_slot* slot = &z->slots[idx];
+    if (slot->kind == ZRAM_EMPTY) {
+        memset(dst, 0, PAGE_SIZE); // Never written, reads as zeroes
+    } else if (slot->kind == ZRAM_SAME) {
+        uint64_t* words = (uint64_t*)dst;
+        for (size_t i = 0; i < PAGE_SIZE / sizeof(uint64_t); i++) {
+            words[i] = slot->word;
+        }
+    } else if (slot->kind == ZRAM_RAW) {
+        memcpy(dst, phys_to_virt((uint64_t)slot->data), PAGE_SIZE);
+    } else {
+        ok = lz_decompress(slot->data, slot->size, dst, PAGE_SIZE) == PAGE_SIZE;
+    }
+    uint64_t cycles = cpu_rdtsc() - start;
+    z->stats.loads++;
+    z->stats.load_cycles += cycles;
+    if (cycles > z->stats.load_max) {
+        z->stats.load_max = cycles;
+    }
+    spin_unlock(&z->lock);
+    cpu_irq_restore(irq_flags);
+
+    if (!ok) {
+        serial_write("zram: Corrupt page\n", 19);
+    }
+    return ok;
+}
+
+// Only whole, aligned pages: that is all swap ever transfers
+static bool zram_range_ok(uint64_t sector, uint64_t count) {
+    return sector % ZRAM_SECTORS_PER_PAGE == 0 && count % ZRAM_SECTORS_PER_PAGE == 0;
+}
+
+static bool zram_read(struct block_device* dev, uint64_t sector, uint64_t count, void* buf) {
+    if (!zram_range_ok(sector, count)) {
+        return false;
+    }
+    struct zram* z = (struct zram*)dev;
+    for (uint64_t i = 0; i < count / ZRAM_SECTORS_PER_PAGE; i++) {
+        if (!zram_load(z, sector / ZRAM_SECTORS_PER_PAGE + i, (uint8_t*)buf + i * PAGE_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static bool zram_write(struct block_device* dev, uint64_t sector, uint64_t count, const void* buf) {
+    if (!zram_range_ok(sector, count)) {
+        return false;
+    }
+    struct zram* z = (struct zram*)dev;
+    for (uint64_t i = 0; i < count / ZRAM_SECTORS_PER_PAGE; i++) {
+        if (!zram_store(z, sector / ZRAM_SECTORS_PER_PAGE + i, (const uint8_t*)buf + i * PAGE_SIZE)) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void zram_discard(struct block_device* dev, uint64_t sector, uint64_t count) {
+    struct zram* z = (struct zram*)dev;
+    // Partial pages keep their data
+    uint64_t first = (sector + ZRAM_SECTORS_PER_PAGE - 1) / ZRAM_SECTORS_PER_PAGE;
+    uint64_t end = (sector + count) / ZRAM_SECTORS_PER_PAGE;
+    for (uint64_t idx = first; idx < end; idx++) {
+        uint64_t irq_flags = cpu_irq_save();
+        spin_lock(&z->lock);
+        struct zram_slot old = zram_detach(z, idx);
+        spin_unlock(&z->lock);
+        cpu_irq_restore(irq_flags);
+        zram_release(&old);
+    }
+}
+
+struct block_device* zram_create(const char* name, uint64_t size) {
+    uint64_t pages = (size + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (pages == 0 || blockdev_find(name)) {
+        return NULL;
+    }
+    struct zram* z = kzalloc(sizeof(*z));
+    if (!z) {
+        return NULL;
+    }
+    z->slots = kzalloc(pages * sizeof(struct zram_slot));
+    if (!z->slots) {
+        kfree(z);
+        return NULL;
+    }
+    z->pages = pages;
+    z->lock = (spinlock_t)SPINLOCK_INIT;
+    strncpy(z->dev.name, name, BLOCKDEV_NAME_LEN - 1);
+    z->dev.sectors = pages * ZRAM_SECTORS_PER_PAGE;
+    z->dev.read = zram_read;
+    z->dev.write = zram_write;
+    z->dev.discard = zram_discard;
+    z->dev.priv = z;
+    if (!blockdev_register(&z->dev)) {
+        kfree(z->slots);
+        kfree(z);
+        return NULL;
+    }
+    return &z->dev;
+}
+
+bool zram_get_stats(struct block_device* dev, struct zram_stats* stats) {
+    if (dev->read != zram_read) {
+        return false;
+    }
+    struct zram* z = dev->priv;
+    uint64_t irq_flags = cpu_irq_save();
+    spin_lock(&z->lock);
+    *stats = z->stats;
+    spin_unlock(&z->lock);
+    cpu_irq_restore(irq_flags);
+    return true;
+}
@@ -0,0 +1,39 @@
+#pragma once
+
+#include <stdint.h>
+#include <stdbool.h>
+#include "blockdev.h"
+
+// --- Compressed RAM disk ---
+
+// A block device that keeps each page written to it LZ-compressed in the
+// kernel heap instead of in a fixed buffer, so it only costs memory for
+// what it holds. Used as a swap area it turns cold anonymous pages into a
+// compressed in-RAM tier: reclaim (swap_reclaim) picks the pages, the page
+// fault handler decompresses them on the next access.
+//
+// Transfers must be page-aligned whole pages. A page filled with one
+// repeated 64-bit word is stored as just that word; one that does not
+// compress below ZRAM_MAX_COMPRESSED keeps a frame of its own.
+
+#define ZRAM_MAX_COMPRESSED 2016
+
+// Creates and registers a zram device of `size` bytes (rounded up to a
+// page) of uncompressed capacity. Returns NULL if out of memory or the name
+// is taken.
+struct block_device* zram_create(const char* name, uint64_t size);
+
+struct zram_stats {
+    uint64_t pages;              // Pages held
+    uint64_t same_pages;         // ... stored as a repeated word
+    uint64_t raw_pages;          // ... stored uncompressed
+    uint64_t compressed_bytes;   // Compressed size of the other pages
+    uint64_t pool_bytes;         // Heap memory holding them (size classes)
+    uint64_t stores;             // Pages written
+    uint64_t loads;              // Pages read
+    uint64_t store_cycles;       // Total cycles compressing
+    uint64_t load_cycles;        // Total cycles decompressing
+    uint64_t load_max;           // Slowest decompression
+};
+// Counters of one device; false if dev is not a zram device
+bool zram_get_stats(struct block_device* dev, struct zram_stats* stats);
@@ -0,0 +1,40 @@
+#include "limine_libc.h"
+
+// Context switch benchmark: a parent and a forked child hand the CPU back
+// and forth with yield(), so every yield is one switch to the other process
+// (address space included). Reports cycles per switch, syscall overhead
+// included. Nothing else should be runnable meanwhile.
+#define ROUNDS 10000
+
+static inline unsigned long long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+int main() {
+    printf("context switch benchmark (%d round trips)\n", ROUNDS);
+
+    int pid = fork();
+    if (pid < 0) {
+        printf("fork failed\n");
+        return 1;
+    }
+    if (pid == 0) {
+        // One more than the parent, so it never waits on an exited partner
+        for (int i = 0; i <= ROUNDS; i++) {
+            yield();
+        }
+        exit(0);
+    }
+
+    yield(); // Let the child get going
+    unsigned long long start = rdtsc();
+    for (int i = 0; i < ROUNDS; i++) {
+        yield();
+    }
+    unsigned long long cycles = rdtsc() - start;
+    printf("  %d cycles per round trip, %d per switch\n",
+           (int)(cycles / ROUNDS), (int)(cycles / ROUNDS / 2));
+    return 0;
+}
@@ -0,0 +1,26 @@
+#include "limine_libc/stdio.h"
+#include "limine_libc/syscall.h"
+
+// Prints how much memory is free and where the rest went, in KiB
+static void show(const char *label, uint64_t frames) {
+    printf("%s %d KiB\n", label, (int)(frames * 4));
+}
+
+int main() {
+    struct meminfo info;
+    if (meminfo(&info) != 0) {
+        printf("free: meminfo failed\n");
+        return 1;
+    }
+    show("total:      ", info.total);
+    show("used:       ", info.total - info.free);
+    show("free:       ", info.free);
+    show("page tables:", info.page_tables);
+    show("user:       ", info.user);
+    show("page cache: ", info.page_cache);
+    show("kernel heap:", info.slab + info.kmalloc_large);
+    show("swap total: ", info.swap_total);
+    show("swap used:  ", info.swap_used);
+    printf("file data:   %d KiB\n", (int)(info.file_data_bytes / 1024));
+    return 0;
+}
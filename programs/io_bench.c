@@ -0,0 +1,83 @@
+#include "limine_libc.h"
+
+// File I/O throughput benchmark: moves 1MiB through a file with one large
+// read/write call and with 4KiB calls, and reports the cost per KiB.
+#define IO_SIZE (1024 * 1024)
+#define SMALL_CALL 4096
+#define ROUNDS 8
+#define IO_FILE "io_bench.dat"
+
+static inline unsigned long long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+static void report(const char *phase, unsigned long long cycles) {
+    printf("  %s: %d cycles/KiB\n", phase, (int)(cycles / ROUNDS / (IO_SIZE / 1024)));
+}
+
+// Writes or reads IO_SIZE bytes from the start of the file in calls of
+// `call` bytes. Returns the cycles taken, or 0 on failure.
+static unsigned long long transfer(char *buf, int call, int writing) {
+    int fd = open(IO_FILE, O_CREAT);
+    if (fd < 0) {
+        printf("open failed\n");
+        return 0;
+    }
+    unsigned long long start = rdtsc();
+    for (int done = 0; done < IO_SIZE; done += call) {
+        int n = writing ? write(fd, buf + done, call) : read(fd, buf + done, call);
+        if (n != call) {
+            printf("%s returned %d\n", writing ? "write" : "read", n);
+            close(fd);
+            return 0;
+        }
+    }
+    unsigned long long cycles = rdtsc() - start;
+    close(fd);
+    return cycles;
+}
+
+int main() {
+    printf("file I/O benchmark (%d KiB)\n", IO_SIZE / 1024);
+
+    char *src = malloc(IO_SIZE);
+    char *dst = malloc(IO_SIZE);
+    if (!src || !dst) {
+        printf("malloc failed\n");
+        return 1;
+    }
+    for (int i = 0; i < IO_SIZE; i++) {
+        src[i] = (char)(i * 7);
+    }
+
+    int calls[2] = { IO_SIZE, SMALL_CALL };
+    const char *names[2] = { "1MiB calls", "4KiB calls" };
+    for (int c = 0; c < 2; c++) {
+        unsigned long long write_cycles = 0, read_cycles = 0;
+        for (int round = 0; round < ROUNDS; round++) {
+            unsigned long long w = transfer(src, calls[c], 1);
+            memset(dst, 0, IO_SIZE);
+            unsigned long long r = transfer(dst, calls[c], 0);
+            if (!w || !r) {
+                return 1;
+            }
+            for (int i = 0; i < IO_SIZE; i++) {
+                if (src[i] != dst[i]) {
+                    printf("read back different data at %d\n", i);
+                    return 1;
+                }
+            }
+            write_cycles += w;
+            read_cycles += r;
+        }
+        printf(" %s\n", names[c]);
+        report("write", write_cycles);
+        report("read", read_cycles);
+    }
+
+    free(src);
+    free(dst);
+    return 0;
+}
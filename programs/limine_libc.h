@@ -1,5 +1,6 @@
 #pragma once
 #include "limine_libc/stdio.h"
 #include "limine_libc/string.h"
+#include "limine_libc/stdlib.h"
 #include "limine_libc/syscall.h"
 // This header now includes all libc headers for compatibility.
@@ -0,0 +1,206 @@
+#include "stdlib.h"
+#include "string.h"
+#include "syscall.h"
+#include <stdint.h>
+
+// Size-class allocator.
+//
+// Requests up to MALLOC_MAX_SMALL bytes are rounded up to a size class. Each
+// block has a 16 byte header recording its class, so free needs no lookup.
+// Blocks move through two layers of free lists:
+//  - a cache (struct malloc_cache): the fast path, used by one thread only
+//  - the central lists, which refill and drain caches in batches and carve
+//    new blocks out of spans taken from the heap (brk)
+// There is a single cache for now. With threads each gets its own cache and
+// only the central layer needs a lock.
+// Larger requests get a mapping of their own, returned to the kernel on free.
+
+#define MALLOC_HEADER 16     // Keeps user pointers 16 byte aligned
+#define MALLOC_SPAN_SIZE (64 * 1024)
+#define MALLOC_BATCH 32      // Blocks moved between a cache and the central lists
+#define MALLOC_CACHE_MAX 64  // Blocks of one class a cache holds before draining
+#define MALLOC_LARGE 0xFF    // Class of a block with its own mapping
+
+// Block sizes, header included. Spacing grows with the size so rounding
+// wastes at most about 25%.
+static const uint32_t malloc_class_size[] = {
+    32, 48, 64, 80, 96, 112, 128, 160, 192, 224, 256, 320, 384, 448, 512,
+    640, 768, 896, 1024, 1280, 1536, 1792, 2048, 2560, 3072, 3584, 4096,
+    6144, 8192, 12288, 16384, 24576, 32768
+};
+#define MALLOC_NUM_CLASSES (sizeof(malloc_class_size) / sizeof(malloc_class_size[0]))
+#define MALLOC_MAX_SMALL (32768 - MALLOC_HEADER)
+
+struct malloc_header {
+    uint64_t size;  // Block size (mapping size for large blocks)
+    uint64_t class_index;
+};
+
+// Free blocks are linked through their user area; the header stays intact
+struct malloc_free {
+    struct malloc_free *next;
+};
+
+struct malloc_cache {
+    struct malloc_free *bins[MALLOC_NUM_CLASSES];
+    uint32_t counts[MALLOC_NUM_CLASSES];
+};
+
+// Central layer
+static struct malloc_free *malloc_central[MALLOC_NUM_CLASSES];
+static uint8_t *malloc_span_next[MALLOC_NUM_CLASSES]; // Uncarved part of the
+static uint8_t *malloc_span_end[MALLOC_NUM_CLASSES];  // class's current span
+
+static struct malloc_cache malloc_main_cache;
+
+// The calling thread's cache
+static inline struct malloc_cache *malloc_get_cache(void) {
+    return &malloc_main_cache;
+}
+
+// Class for requests of up to 1024 bytes by 16 byte step, built on first use
+static uint8_t malloc_small_lookup[1024 / 16 + 1];
+static int malloc_lookup_ready = 0;
+
+static unsigned int malloc_class_of(size_t size) {
+    size_t block = size + MALLOC_HEADER;
+    if (size <= 1024) {
+        if (!malloc_lookup_ready) {
+            unsigned int c = 0;
+            for (unsigned int i = 0; i <= 1024 / 16; i++) {
+                while (malloc_class_size[c] < i * 16 + MALLOC_HEADER) c++;
+                malloc_small_lookup[i] = c;
+            }
+            malloc_lookup_ready = 1;
+        }
+        return malloc_small_lookup[(size + 15) / 16];
+    }
+    unsigned int c = 0;
+    while (malloc_class_size[c] < block) c++;
+    return c;
+}
+
+// Gets fresh memory for a span: heap first, a mapping once the heap is full
+static uint8_t *malloc_get_span(size_t size) {
+    void *span = sbrk(size);
+    if (span == (void *)-1) {
+        span = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (span == MAP_FAILED) return NULL;
+    }
+    return span;
+}
+
+// Takes one block of class c from the central layer
+static struct malloc_free *malloc_central_take(unsigned int c) {
+    struct malloc_free *block = malloc_central[c];
+    if (block) {
+        malloc_central[c] = block->next;
+        return block;
+    }
+
+    uint32_t size = malloc_class_size[c];
+    if (malloc_span_next[c] + size > malloc_span_end[c]) {
+        size_t span_size = size * 8 > MALLOC_SPAN_SIZE ? size * 8 : MALLOC_SPAN_SIZE;
+        uint8_t *span = malloc_get_span(span_size);
+        if (!span) return NULL;
+        malloc_span_next[c] = span;
+        malloc_span_end[c] = span + span_size;
+    }
+    struct malloc_header *header = (struct malloc_header *)malloc_span_next[c];
+    malloc_span_next[c] += size;
+    header->size = size;
+    header->class_index = c;
+    return (struct malloc_free *)(header + 1);
+}
+
+static void malloc_cache_refill(struct malloc_cache *cache, unsigned int c) {
+    while (cache->counts[c] < MALLOC_BATCH) {
+        struct malloc_free *block = malloc_central_take(c);
+        if (!block) break;
+        block->next = cache->bins[c];
+        cache->bins[c] = block;
+        cache->counts[c]++;
+    }
+}
+
+static void malloc_cache_drain(struct malloc_cache *cache, unsigned int c) {
+    for (unsigned int i = 0; i < MALLOC_BATCH && cache->bins[c]; i++) {
+        struct malloc_free *block = cache->bins[c];
+        cache->bins[c] = block->next;
+        block->next = malloc_central[c];
+        malloc_central[c] = block;
+        cache->counts[c]--;
+    }
+}
+
+static void *malloc_large(size_t size) {
+    size_t mapped = (size + MALLOC_HEADER + 4095) & ~(size_t)4095;
+    struct malloc_header *header = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+                                        MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (header == MAP_FAILED) return NULL;
+    header->size = mapped;
+    header->class_index = MALLOC_LARGE;
+    return header + 1;
+}
+
+void *malloc(size_t size) {
+    if (size > MALLOC_MAX_SMALL) {
+        if (size > ((size_t)1 << 40)) return NULL;
+        return malloc_large(size);
+    }
+
+    unsigned int c = malloc_class_of(size);
+    struct malloc_cache *cache = malloc_get_cache();
+    if (!cache->bins[c]) {
+        malloc_cache_refill(cache, c);
+        if (!cache->bins[c]) return NULL;
+    }
+    struct malloc_free *block = cache->bins[c];
+    cache->bins[c] = block->next;
+    cache->counts[c]--;
+    return block;
+}
+
+void free(void *ptr) {
+    if (!ptr) return;
+    struct malloc_header *header = (struct malloc_header *)ptr - 1;
+    if (header->class_index == MALLOC_LARGE) {
+        munmap(header, header->size);
+        return;
+    }
+
+    unsigned int c = header->class_index;
+    struct malloc_cache *cache = malloc_get_cache();
+    struct malloc_free *block = ptr;
+    block->next = cache->bins[c];
+    cache->bins[c] = block;
+    if (++cache->counts[c] > MALLOC_CACHE_MAX) {
+        malloc_cache_drain(cache, c);
+    }
+}
+
+void *calloc(size_t count, size_t size) {
+    size_t total;
+    if (__builtin_mul_overflow(count, size, &total)) return NULL;
+    void *ptr = malloc(total);
+    if (ptr) memset(ptr, 0, total);
+    return ptr;
+}
+
+void *realloc(void *ptr, size_t size) {
+    if (!ptr) return malloc(size);
+    if (size == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    struct malloc_header *header = (struct malloc_header *)ptr - 1;
+    size_t usable = header->size - MALLOC_HEADER;
+    if (size <= usable) return ptr;
+
+    void *moved = malloc(size);
+    if (!moved) return NULL;
+    memcpy(moved, ptr, usable);
+    free(ptr);
+    return moved;
+}
@@ -22,7 +22,7 @@ int read(int fd, void *buf, size_t count) {
 }
 
 int open(const char *pathname, int flags) {
-    // Flags are currently ignored by the kernel syscall
+    // Only O_CREAT is interpreted by the kernel for now
     return _syscall(SYS_OPEN, (uint64_t)pathname, flags, 0, 0, 0);
 }
 
@@ -46,6 +46,45 @@ int fork(void) {
     return _syscall(SYS_FORK, 0, 0, 0, 0, 0);
 }
 
+// Only five arguments reach the kernel: the page aligned offset carries the
+// fd in its low 12 bits
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset) {
+    uint64_t fd_offset = (flags & MAP_ANONYMOUS) ? 0 : ((offset & ~0xFFFULL) | (fd & 0xFFF));
+    return (void *)_syscall(SYS_MMAP, (uint64_t)addr, length, prot, flags, fd_offset);
+}
+
+int munmap(void *addr, size_t length) {
+    return _syscall(SYS_MUNMAP, (uint64_t)addr, length, 0, 0, 0);
+}
+
+// Current program break, fetched from the kernel on first use
+static uint64_t current_brk = 0;
+
+int brk(void *addr) {
+    uint64_t result = _syscall(SYS_BRK, (uint64_t)addr, 0, 0, 0, 0);
+    current_brk = result;
+    return result == (uint64_t)addr ? 0 : -1;
+}
+
+void *sbrk(intptr_t increment) {
+    if (current_brk == 0) {
+        current_brk = _syscall(SYS_BRK, 0, 0, 0, 0, 0);
+    }
+    uint64_t old_brk = current_brk;
+    if (increment != 0 && brk((void *)(old_brk + increment)) != 0) {
+        return (void *)-1;
+    }
+    return (void *)old_brk;
+}
+
+int meminfo(struct meminfo *info) {
+    return _syscall(SYS_MEMINFO, (uint64_t)info, 0, 0, 0, 0);
+}
+
+int yield(void) {
+    return _syscall(SYS_YIELD, 0, 0, 0, 0, 0);
+}
+
 
 // These seem like remnants or incorrect implementations, removing them.
 /*
@@ -12,6 +12,24 @@
 #define SYS_CLOSE      4
 #define SYS_READDIR    5 // New syscall for reading directory entries
 #define SYS_FORK       6 // Fork syscall
+#define SYS_MMAP       7
+#define SYS_MUNMAP     8
+#define SYS_BRK        9
+#define SYS_MEMINFO    10
+#define SYS_YIELD      11
+
+// mmap protection and flags
+#define PROT_READ      0x1
+#define PROT_WRITE     0x2
+#define PROT_EXEC      0x4
+#define MAP_PRIVATE    0x02
+#define MAP_FIXED      0x10
+#define MAP_ANONYMOUS  0x20
+#define MAP_FAILED     ((void *)-1)
+
+// open flags
+#define O_RDONLY       0x0
+#define O_CREAT        0x40 // Create the file if it does not exist
 
 #define STDIN   0
 #define STDOUT  1
@@ -24,6 +42,25 @@ struct dirent {
     // Add other fields like type if needed later
 };
 
+// Memory use by category (must match kernel). Counts are 4KiB frames
+// unless noted otherwise.
+struct meminfo {
+    uint64_t total;           // Frames managed by the kernel
+    uint64_t free;            // Includes zero_pool
+    uint64_t zero_pool;       // Free frames already zero-filled
+    uint64_t kernel;
+    uint64_t page_tables;
+    uint64_t user;            // Pages mapped into processes
+    uint64_t page_cache;
+    uint64_t slab;
+    uint64_t kmalloc_large;
+    uint64_t gui;             // GUI backbuffer
+    uint64_t ksm;             // Merged pages shared by identical user pages
+    uint64_t swap_total;      // Pages that fit in swap
+    uint64_t swap_used;       // Pages currently swapped out
+    uint64_t file_data_bytes; // In-memory file contents, in bytes
+};
+
 // Syscall wrapper function prototypes
 int write(int fd, const void *buf, size_t count);
 void exit(int status);
@@ -32,6 +69,13 @@ int open(const char *pathname, int flags);
 int close(int fd);
 int readdir(unsigned int index, struct dirent *dirp); // Wrapper for SYS_READDIR
 int fork(void); // Wrapper for SYS_FORK
+// Mappings are private and populated on first touch; offset must be page aligned
+void *mmap(void *addr, size_t length, int prot, int flags, int fd, size_t offset);
+int munmap(void *addr, size_t length);
+int brk(void *addr);
+void *sbrk(intptr_t increment); // Returns the old break, or (void *)-1
+int meminfo(struct meminfo *info);
+int yield(void); // Lets the next runnable process run first
 
 #endif // SYSCALL_H
 
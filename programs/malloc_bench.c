@@ -0,0 +1,90 @@
+#include "limine_libc.h"
+
+// Allocation throughput benchmark for the limine_libc malloc. Each phase
+// reports the average cost of one operation in cycles.
+#define PAIR_OPS 100000
+#define BATCH_BLOCKS 4096
+#define BATCH_ROUNDS 16
+#define LARGE_OPS 256
+
+static void *blocks[BATCH_BLOCKS];
+
+static inline unsigned long long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+// Small pseudo-random sizes, 1 to max bytes
+static unsigned int rng_state = 12345;
+static unsigned int next_size(unsigned int max) {
+    rng_state = rng_state * 1103515245 + 12345;
+    return (rng_state >> 16) % max + 1;
+}
+
+static void report(const char *phase, unsigned long long cycles, unsigned int ops) {
+    printf("  %s: %d cycles/op\n", phase, (int)(cycles / ops));
+}
+
+int main() {
+    printf("malloc benchmark\n");
+
+    // malloc immediately followed by free: the cache fast path
+    unsigned long long start = rdtsc();
+    for (int i = 0; i < PAIR_OPS; i++) {
+        void *p = malloc(next_size(1024));
+        if (!p) {
+            printf("malloc failed\n");
+            return 1;
+        }
+        *(char *)p = 1;
+        free(p);
+    }
+    report("malloc+free pairs (1-1024B)", rdtsc() - start, PAIR_OPS);
+
+    // Many live blocks: refills from and drains to the central lists
+    start = rdtsc();
+    for (int round = 0; round < BATCH_ROUNDS; round++) {
+        for (int i = 0; i < BATCH_BLOCKS; i++) {
+            blocks[i] = malloc(next_size(4096));
+            if (!blocks[i]) {
+                printf("malloc failed\n");
+                return 1;
+            }
+        }
+        for (int i = 0; i < BATCH_BLOCKS; i++) {
+            free(blocks[i]);
+        }
+    }
+    report("batch alloc then free (1-4096B)", rdtsc() - start, BATCH_ROUNDS * BATCH_BLOCKS * 2);
+
+    // Growing buffer
+    start = rdtsc();
+    char *buf = NULL;
+    unsigned int steps = 0;
+    for (unsigned int size = 16; size <= 1024 * 1024; size *= 2, steps++) {
+        buf = realloc(buf, size);
+        if (!buf) {
+            printf("realloc failed\n");
+            return 1;
+        }
+        buf[size - 1] = 1;
+    }
+    free(buf);
+    report("realloc doubling to 1MiB", rdtsc() - start, steps);
+
+    // Blocks above the largest size class get their own mapping
+    start = rdtsc();
+    for (int i = 0; i < LARGE_OPS; i++) {
+        char *p = malloc(64 * 1024);
+        if (!p) {
+            printf("malloc failed\n");
+            return 1;
+        }
+        p[0] = 1;
+        free(p);
+    }
+    report("64KiB malloc+free (mmap)", rdtsc() - start, LARGE_OPS);
+
+    return 0;
+}
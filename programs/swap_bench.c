@@ -0,0 +1,55 @@
+#include "limine_libc.h"
+
+// Memory pressure benchmark: touches a working set larger than what is
+// free, then walks it again, so pages have to go out to swap and come back.
+// Reports the cycles per page of each pass and what the kernel swapped.
+// Run it after `swapon` (or `swapon zram` for the compressed tier) in a VM
+// with little memory (e.g. qemu -m 64M).
+#define WORK_SIZE (32 * 1024 * 1024)
+#define PAGE 4096
+#define PASSES 3
+
+static inline unsigned long long rdtsc(void) {
+    unsigned int lo, hi;
+    __asm__ volatile ("rdtsc" : "=a"(lo), "=d"(hi));
+    return ((unsigned long long)hi << 32) | lo;
+}
+
+int main() {
+    printf("swap benchmark (%d KiB working set)\n", WORK_SIZE / 1024);
+
+    struct meminfo before;
+    if (meminfo(&before) != 0) {
+        printf("meminfo failed\n");
+        return 1;
+    }
+
+    unsigned char *buf = mmap(NULL, WORK_SIZE, PROT_READ | PROT_WRITE,
+                              MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+    if (buf == MAP_FAILED) {
+        printf("mmap failed\n");
+        return 1;
+    }
+
+    for (int pass = 0; pass < PASSES; pass++) {
+        unsigned long long start = rdtsc();
+        for (int off = 0; off < WORK_SIZE; off += PAGE) {
+            unsigned char expect = (unsigned char)(off / PAGE + pass - 1);
+            if (pass > 0 && buf[off] != expect) {
+                printf("page %d lost its contents\n", off / PAGE);
+                return 1;
+            }
+            buf[off] = (unsigned char)(off / PAGE + pass);
+        }
+        unsigned long long cycles = rdtsc() - start;
+        printf("  pass %d: %d cycles/page\n", pass, (int)(cycles / (WORK_SIZE / PAGE)));
+    }
+
+    struct meminfo after;
+    meminfo(&after);
+    printf("  swap used: %d KiB (was %d KiB)\n",
+           (int)(after.swap_used * 4), (int)(before.swap_used * 4));
+
+    munmap(buf, WORK_SIZE);
+    return 0;
+}